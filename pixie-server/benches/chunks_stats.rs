@@ -0,0 +1,113 @@
+//! Throughput of the chunk lookups done by concurrent store clients, comparing [`ChunksStats`] with
+//! the single `Mutex<BTreeMap>` it replaced. While the clients look up chunks, another thread adds
+//! new ones, as the server does while an image is being stored.
+
+use criterion::{BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use pixie_server::state::chunks_stats::ChunksStats;
+use pixie_shared::{ChunkHash, ChunkStats, Codec};
+use std::{
+    collections::BTreeMap,
+    hint::black_box,
+    sync::{
+        Mutex,
+        atomic::{AtomicBool, Ordering},
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+const CHUNKS: u32 = 1 << 16;
+const THREADS: [usize; 4] = [1, 4, 16, 64];
+
+trait Index: Sync {
+    fn has_chunk(&self, hash: &ChunkHash) -> bool;
+    fn add_chunk(&self, hash: ChunkHash, stats: ChunkStats);
+}
+
+impl Index for Mutex<BTreeMap<ChunkHash, ChunkStats>> {
+    fn has_chunk(&self, hash: &ChunkHash) -> bool {
+        self.lock().unwrap().contains_key(hash)
+    }
+
+    fn add_chunk(&self, hash: ChunkHash, stats: ChunkStats) {
+        self.lock().unwrap().insert(hash, stats);
+    }
+}
+
+impl Index for ChunksStats {
+    fn has_chunk(&self, hash: &ChunkHash) -> bool {
+        self.contains_key(hash)
+    }
+
+    fn add_chunk(&self, hash: ChunkHash, stats: ChunkStats) {
+        self.insert(hash, stats);
+    }
+}
+
+fn hash(n: u32) -> ChunkHash {
+    *blake3::hash(&n.to_le_bytes()).as_bytes()
+}
+
+fn stats() -> ChunkStats {
+    ChunkStats {
+        csize: 1 << 20,
+        codec: Codec::Lz4,
+        ref_cnt: 1,
+    }
+}
+
+/// Runs `iters` lookups on each of `threads` threads, returning the time taken by the slowest
+/// thread divided by the number of threads, so that the reported throughput is the total one.
+fn lookups(index: &impl Index, hashes: &[ChunkHash], threads: usize, iters: u64) -> Duration {
+    let stop = AtomicBool::new(false);
+    thread::scope(|s| {
+        s.spawn(|| {
+            let mut n = CHUNKS;
+            while !stop.load(Ordering::Relaxed) {
+                index.add_chunk(hash(n), stats());
+                n += 1;
+                thread::sleep(Duration::from_micros(50));
+            }
+        });
+        let clients: Vec<_> = (0..threads)
+            .map(|t| {
+                s.spawn(move || {
+                    let start = Instant::now();
+                    for i in 0..iters as usize {
+                        let hash = &hashes[(i * 7919 + t * 104729) % hashes.len()];
+                        black_box(index.has_chunk(hash));
+                    }
+                    start.elapsed()
+                })
+            })
+            .collect();
+        let elapsed = clients.into_iter().map(|c| c.join().unwrap()).max();
+        stop.store(true, Ordering::Relaxed);
+        elapsed.unwrap() / threads as u32
+    })
+}
+
+fn bench_has_chunk(c: &mut Criterion) {
+    let hashes: Vec<ChunkHash> = (0..CHUNKS).map(hash).collect();
+    let mut group = c.benchmark_group("has_chunk");
+    group.throughput(Throughput::Elements(1));
+    for threads in THREADS {
+        let btree: Mutex<BTreeMap<_, _>> =
+            Mutex::new(hashes.iter().map(|&hash| (hash, stats())).collect());
+        group.bench_with_input(
+            BenchmarkId::new("mutex_btree", threads),
+            &threads,
+            |b, &threads| b.iter_custom(|iters| lookups(&btree, &hashes, threads, iters)),
+        );
+        let sharded: ChunksStats = hashes.iter().map(|&hash| (hash, stats())).collect();
+        group.bench_with_input(
+            BenchmarkId::new("sharded", threads),
+            &threads,
+            |b, &threads| b.iter_custom(|iters| lookups(&sharded, &hashes, threads, iters)),
+        );
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_has_chunk);
+criterion_main!(benches);
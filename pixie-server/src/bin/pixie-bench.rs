@@ -0,0 +1,797 @@
+//! Runs the udp and tcp servers against simulated clients, to measure how long flashing an image
+//! takes without real machines.
+//!
+//! The server is the real one, with a storage directory holding a synthetic image, and it
+//! broadcasts on the loopback network `127.0.0.0/8`, where each simulated client has its own
+//! address. Clients download the manifest of the image with [`TcpRequest::GetImageManifest`],
+//! then request and decode its chunks as pixie-uefi does. The network and the disks are
+//! simulated: chunk packets are received once by the bench and delivered to each client through a
+//! link with the given speed and loss, and chunks take time to be written according to the given
+//! disk speed, without writing anything.
+//!
+//! The server CPU time is measured on the threads of the runtime running it, and the rebroadcast
+//! overhead compares the packets broadcast with the ones needed to send each chunk once.
+//!
+//! Like the server, the bench must run as root, and not while a server is running, as the ports
+//! are fixed. The simulated clients share the machine with the server: packets dropped because a
+//! client could not keep up are reported separately, and mean that the machine cannot simulate
+//! that many clients at that speed.
+
+use anyhow::{Context, Result, bail, ensure};
+use clap::Parser;
+use macaddr::MacAddr6;
+use pixie_server::{ingest::Ingest, neighbors, state::State, tcp, udp};
+use pixie_shared::{
+    ACTION_PORT, CHUNKS_PORT, Chunk, ChunkHash, Codec, Image, ImageDisk, MAX_CHUNK_SIZE,
+    MAX_REQUEST_CHUNKS, ManifestPart, RegistrationInfo, TcpRequest, UDP_BODY_LEN, UdpRequest,
+    chunk_codec::{Decoder, Encoder, FecMode},
+    manifest::ManifestDecoder,
+    util::BytesFmt,
+};
+use std::{
+    collections::{BTreeMap, HashMap, VecDeque},
+    fs,
+    net::{Ipv4Addr, SocketAddr},
+    os::fd::AsRawFd,
+    path::{Path, PathBuf},
+    sync::{
+        Arc,
+        atomic::{AtomicU64, Ordering},
+    },
+};
+use tokio::{
+    io::{AsyncReadExt, AsyncWriteExt},
+    net::{TcpSocket, TcpStream, UdpSocket},
+    runtime::{Builder, Handle},
+    sync::mpsc::{self, Receiver, Sender, error::TrySendError},
+    time::{self, Duration, Instant},
+};
+
+/// Name of the threads running the server, whose CPU time is measured.
+const SERVER_THREAD: &str = "pixie-server";
+const GROUP: &str = "bench";
+const IMAGE: &str = "bench";
+/// Clients are placed in rows of this many columns, and get the address `127.1.row.col`.
+const COLUMNS: usize = 250;
+
+/// Time given to the servers to bind their sockets before the clients start.
+const STARTUP_DELAY: Duration = Duration::from_millis(500);
+/// Requested size of the receive buffer of the socket receiving the chunk packets.
+const RECV_BUFFER: usize = 64 << 20;
+/// Number of clients whose links are simulated by the same task.
+const CLIENTS_PER_SHARD: usize = 16;
+/// Packets queued for each task simulating the links.
+const SHARD_QUEUE: usize = 4096;
+/// Bytes that can be queued on the link of a client, as in the buffer of a switch port; a link
+/// drops the packets that arrive while it is full.
+const LINK_BUFFER: f64 = (256 << 10) as f64;
+
+// As in pixie-uefi, see `flash.rs` there.
+const MIN_WINDOW: usize = 8;
+const MAX_WINDOW: usize = 1024;
+const REQUEST_TIMEOUT: Duration = Duration::from_millis(100);
+const REPORT_INTERVAL: Duration = Duration::from_millis(100);
+const REQUEST_INTERVAL: Duration = Duration::from_millis(500);
+const MAX_BACKLOG: usize = 32;
+const MANIFEST_PART_LEN: u32 = 256 << 10;
+
+fn parse_fec(fec: &str) -> Result<FecMode, String> {
+    match fec.split_once(':') {
+        None if fec == "xor" => Ok(FecMode::Xor),
+        Some(("rs", redundancy)) => redundancy
+            .parse()
+            .map(FecMode::Rs)
+            .map_err(|e| format!("invalid redundancy: {e}")),
+        _ => Err("expected `xor` or `rs:<redundancy>`".into()),
+    }
+}
+
+/// Command line arguments for pixie-bench.
+#[derive(Parser, Debug, Clone)]
+struct BenchOptions {
+    /// Number of simulated clients.
+    #[clap(long, default_value_t = 100)]
+    clients: usize,
+    /// Size of the image, in MiB.
+    #[clap(long, default_value_t = 256)]
+    image_size: usize,
+    /// Size of the chunks of the image, in KiB.
+    #[clap(long, default_value_t = 1024)]
+    chunk_size: usize,
+    /// Broadcast speed of the server, in Mbit/s.
+    #[clap(long, default_value_t = 1000)]
+    broadcast_speed: u32,
+    /// Forward error correction used by the server: `xor`, or `rs:<redundancy>` with the
+    /// redundancy as a percentage.
+    #[clap(long, default_value = "xor", value_parser = parse_fec)]
+    fec: FecMode,
+    /// Number of broadcast workers of the server.
+    #[clap(long, default_value_t = 1)]
+    broadcast_workers: usize,
+    /// Speed of the link of each client, in Mbit/s.
+    #[clap(long, default_value_t = 1000)]
+    link_speed: u32,
+    /// Fraction of the packets randomly lost on the link of each client.
+    #[clap(long, default_value_t = 0.001)]
+    loss: f64,
+    /// Write speed of the disk of each client, in MiB/s.
+    #[clap(long, default_value_t = 200)]
+    disk_speed: u32,
+    /// Maximum number of partially received chunks kept by each client; the least recently used
+    /// one is dropped to make room for a new one. pixie-uefi keeps as many as fit in memory, and
+    /// spills the others to disk, but here they all take memory in the same process.
+    #[clap(long, default_value_t = 16)]
+    max_decoders: usize,
+    /// Seed of the simulated packet loss and of the content of the image.
+    #[clap(long, default_value_t = 0)]
+    seed: u64,
+    /// Maximum time for all the clients to finish, in seconds.
+    #[clap(long, default_value_t = 600)]
+    timeout: u64,
+}
+
+fn config_yaml(options: &BenchOptions) -> String {
+    let fec = match options.fec {
+        FecMode::Xor => "xor".to_owned(),
+        FecMode::Rs(redundancy) => format!("!rs {redundancy}"),
+    };
+    format!(
+        "hosts:
+  interfaces:
+  - network: 127.0.0.1/8
+    dhcp: !static [127.1.1.1, 127.1.255.255]
+    broadcast_speed: {}
+    fec: {fec}
+    broadcast_workers: {}
+http:
+  listen_on: 127.0.0.1:0
+groups:
+  - [{GROUP}, 1]
+images:
+  - {IMAGE}
+",
+        options.broadcast_speed * 1_000_000,
+        options.broadcast_workers,
+    )
+}
+
+fn client_ip(index: usize) -> Ipv4Addr {
+    Ipv4Addr::new(
+        127,
+        1,
+        (index / COLUMNS + 1) as u8,
+        (index % COLUMNS + 1) as u8,
+    )
+}
+
+/// Content of the chunk at `start`: random in its first half, so that chunks are all different
+/// and compress to about half of their size, and zero in the rest.
+fn chunk_data(seed: u64, start: usize, size: usize) -> Vec<u8> {
+    let mut data = vec![0; size];
+    let mut hasher = blake3::Hasher::new();
+    hasher.update(&seed.to_le_bytes());
+    hasher.update(&(start as u64).to_le_bytes());
+    hasher.finalize_xof().fill(&mut data[..size / 2]);
+    data
+}
+
+/// Stores the synthetic image, returning the number of packets needed to broadcast each of its
+/// chunks once.
+fn store_image(state: &State, options: &BenchOptions) -> Result<u64> {
+    let image_size = options.image_size << 20;
+    let chunk_size = options.chunk_size << 10;
+    let mut chunks = Vec::new();
+    let mut packets = 0;
+    let mut scratch = Vec::new();
+    let mut buf = [0; UDP_BODY_LEN];
+    for start in (0..image_size).step_by(chunk_size) {
+        let size = chunk_size.min(image_size - start);
+        let data = chunk_data(options.seed, start, size);
+        let cdata = lz4_flex::compress(&data);
+        state.add_chunk(&cdata, &mut scratch)?;
+        let mut encoder = Encoder::with_fec(&cdata, options.fec);
+        while encoder.next_packet(&mut buf[32..]).is_some() {
+            packets += 1;
+        }
+        chunks.push(Chunk {
+            hash: *blake3::hash(&data).as_bytes(),
+            start,
+            size,
+            csize: cdata.len(),
+            codec: Codec::Lz4,
+        });
+    }
+    let image = Image {
+        boot_option_id: 0,
+        boot_entry: Vec::new(),
+        disks: vec![ImageDisk {
+            size: image_size as u64,
+            chunks,
+        }],
+    };
+    state.add_image(IMAGE.to_owned(), &image)?;
+    Ok(packets)
+}
+
+/// CPU time used so far by the threads of the server runtime. Threads that exited are not
+/// counted, which is why the runtime keeps its threads alive.
+fn server_cpu_time() -> Result<Duration> {
+    // SAFETY: sysconf has no preconditions.
+    let ticks_per_sec = unsafe { libc::sysconf(libc::_SC_CLK_TCK) } as f64;
+    let mut ticks = 0;
+    for task in fs::read_dir("/proc/self/task")? {
+        // The thread may have exited in the meantime.
+        let Ok(stat) = fs::read_to_string(task?.path().join("stat")) else {
+            continue;
+        };
+        let (Some(name_start), Some(name_end)) = (stat.find('('), stat.rfind(')')) else {
+            bail!("invalid thread stat: {stat:?}");
+        };
+        if &stat[name_start + 1..name_end] != SERVER_THREAD {
+            continue;
+        }
+        // The fields after the name start from the third one; utime and stime are the 14th and
+        // 15th.
+        let fields: Vec<&str> = stat[name_end + 1..].split_whitespace().collect();
+        for field in &fields[11..13] {
+            ticks += field.parse::<u64>().context("invalid thread stat")?;
+        }
+    }
+    Ok(Duration::from_secs_f64(ticks as f64 / ticks_per_sec))
+}
+
+/// Counters of the simulated network, shared by all the clients.
+#[derive(Default)]
+struct NetCounters {
+    /// Chunk packets broadcast by the server.
+    broadcast: AtomicU64,
+    /// Packets dropped because the link of a client was full.
+    link_full: AtomicU64,
+    /// Packets dropped by the simulated loss.
+    lost: AtomicU64,
+    /// Packets dropped because a client, or the task simulating its link, could not keep up.
+    overrun: AtomicU64,
+}
+
+/// Source of the simulated packet loss (splitmix64), seeded per client.
+struct Rng(u64);
+
+impl Rng {
+    fn next_f64(&mut self) -> f64 {
+        self.0 = self.0.wrapping_add(0x9e3779b97f4a7c15);
+        let mut z = self.0;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+        z ^= z >> 31;
+        (z >> 11) as f64 / (1u64 << 53) as f64
+    }
+}
+
+/// The link of a client, modelled as a token bucket of [`LINK_BUFFER`] bytes refilled at the
+/// link speed.
+struct Link {
+    tx: Sender<Arc<[u8]>>,
+    rng: Rng,
+    tokens: f64,
+}
+
+/// Delivers the packets it receives to the clients with the given links, until all of them are
+/// done.
+async fn simulate_links(
+    mut rx: Receiver<Arc<[u8]>>,
+    mut links: Vec<Link>,
+    options: Arc<BenchOptions>,
+    counters: Arc<NetCounters>,
+) {
+    let bytes_per_sec = options.link_speed as f64 * 1e6 / 8.0;
+    let mut last = Instant::now();
+    while !links.is_empty() {
+        let Some(packet) = rx.recv().await else {
+            break;
+        };
+        let now = Instant::now();
+        let refill = (now - last).as_secs_f64() * bytes_per_sec;
+        last = now;
+        links.retain_mut(|link| {
+            link.tokens = (link.tokens + refill).min(LINK_BUFFER);
+            if link.tokens < packet.len() as f64 {
+                counters.link_full.fetch_add(1, Ordering::Relaxed);
+                return true;
+            }
+            link.tokens -= packet.len() as f64;
+            if link.rng.next_f64() < options.loss {
+                counters.lost.fetch_add(1, Ordering::Relaxed);
+                return true;
+            }
+            match link.tx.try_send(packet.clone()) {
+                Ok(()) => true,
+                Err(TrySendError::Full(_)) => {
+                    counters.overrun.fetch_add(1, Ordering::Relaxed);
+                    true
+                }
+                Err(TrySendError::Closed(_)) => false,
+            }
+        });
+    }
+}
+
+/// Receives the chunk packets broadcast by the server, and hands them to the tasks simulating
+/// the links.
+async fn receive_packets(
+    socket: UdpSocket,
+    shards: Vec<Sender<Arc<[u8]>>>,
+    counters: Arc<NetCounters>,
+) -> Result<()> {
+    let mut buf = [0; UDP_BODY_LEN];
+    loop {
+        let len = socket.recv(&mut buf).await?;
+        counters.broadcast.fetch_add(1, Ordering::Relaxed);
+        let packet: Arc<[u8]> = buf[..len].into();
+        for shard in &shards {
+            if let Err(TrySendError::Full(_)) = shard.try_send(packet.clone()) {
+                counters.overrun.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+}
+
+fn bind_chunks_socket() -> Result<UdpSocket> {
+    let socket = std::net::UdpSocket::bind((Ipv4Addr::UNSPECIFIED, CHUNKS_PORT))
+        .context("bind chunks socket")?;
+    let size = RECV_BUFFER as libc::c_int;
+    // SAFETY: the option value points to `size`, which is valid for the given length.
+    let ret = unsafe {
+        libc::setsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_RCVBUF,
+            &size as *const _ as *const libc::c_void,
+            size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if ret < 0 {
+        log::warn!(
+            "Could not set receive buffer: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+    socket.set_nonblocking(true)?;
+    Ok(UdpSocket::from_std(socket)?)
+}
+
+/// Sends a request to the tcp server and returns the response.
+async fn request(stream: &mut TcpStream, req: &TcpRequest<'_>) -> Result<Vec<u8>> {
+    let data = postcard::to_allocvec(req)?;
+    stream.write_u64_le(data.len() as u64).await?;
+    stream.write_all(&data).await?;
+    let len = stream.read_u64_le().await?;
+    let mut resp = vec![0; len as usize];
+    stream.read_exact(&mut resp).await?;
+    Ok(resp)
+}
+
+/// Downloads the manifest of the image in parts, as pixie-uefi does, returning its chunks.
+async fn fetch_chunks(stream: &mut TcpStream) -> Result<Vec<Chunk>> {
+    let mut decoder = ManifestDecoder::new();
+    let mut chunks = Vec::new();
+    let mut offset = 0;
+    let mut layout_hash = None;
+    loop {
+        let req = TcpRequest::GetImageManifest {
+            offset,
+            len: MANIFEST_PART_LEN,
+        };
+        let part: ManifestPart = postcard::from_bytes(&request(stream, &req).await?)?;
+        ensure!(
+            layout_hash.is_none_or(|hash| hash == part.layout_hash),
+            "image changed while downloading its manifest"
+        );
+        layout_hash = Some(part.layout_hash);
+        decoder.push(&part.data);
+        offset += part.data.len() as u64;
+        while let Some((_, chunk)) = decoder.next_chunk()? {
+            chunks.push(chunk);
+        }
+        if offset >= part.total_len {
+            decoder.finish()?;
+            return Ok(chunks);
+        }
+        ensure!(!part.data.is_empty(), "empty manifest part");
+    }
+}
+
+struct ChunkInfo {
+    size: usize,
+    csize: usize,
+    positions: usize,
+}
+
+struct ClientStats {
+    /// Time from the start of the bench to the last chunk being written.
+    time: Duration,
+    received: u64,
+    lost: u64,
+    requests: u64,
+    requested: u64,
+    /// Kept open until the server is stopped, as the server logs closed connections as errors.
+    _stream: TcpStream,
+}
+
+/// Adds `packet` to the decoder of its chunk, returning the number of packets detected as lost
+/// and the chunk, if it is now complete.
+fn handle_packet(
+    ip: Ipv4Addr,
+    packet: &[u8],
+    chunks: &mut BTreeMap<ChunkHash, ChunkInfo>,
+    decoders: &mut HashMap<ChunkHash, (Decoder, Instant)>,
+    max_decoders: usize,
+    now: Instant,
+) -> (u64, Option<ChunkInfo>) {
+    if packet.len() < 34 {
+        return (0, None);
+    }
+    let hash: ChunkHash = packet[..32].try_into().expect("hash is 32 bytes");
+    let Some(info) = chunks.get(&hash) else {
+        decoders.remove(&hash);
+        return (0, None);
+    };
+    if !decoders.contains_key(&hash) && decoders.len() >= max_decoders {
+        let oldest = decoders
+            .iter()
+            .min_by_key(|(_, (_, last_use))| *last_use)
+            .map(|(hash, _)| *hash);
+        if let Some(oldest) = oldest {
+            decoders.remove(&oldest);
+        }
+    }
+    let (decoder, last_use) = decoders
+        .entry(hash)
+        .or_insert_with(|| (Decoder::new(info.csize), now));
+    *last_use = now;
+    let lost_before = decoder.lost_packets();
+    if let Err(e) = decoder.add_packet(&packet[32..]) {
+        log::warn!("Client {ip} received invalid packet: {e}");
+        return (0, None);
+    }
+    let lost = (decoder.lost_packets() - lost_before) as u64;
+    if decoder.finish().is_none() {
+        return (lost, None);
+    }
+    decoders.remove(&hash);
+    (lost, chunks.remove(&hash))
+}
+
+/// Flashes the image as pixie-uefi does, with the request window and receiver reports of
+/// `flash.rs` there, and with writes that take the time given by the disk speed.
+async fn client(
+    ip: Ipv4Addr,
+    mut rx: Receiver<Arc<[u8]>>,
+    options: Arc<BenchOptions>,
+    start: Instant,
+) -> Result<ClientStats> {
+    let server_addr = SocketAddr::new(Ipv4Addr::LOCALHOST.into(), ACTION_PORT);
+    let socket = TcpSocket::new_v4()?;
+    socket.bind(SocketAddr::new(ip.into(), 0))?;
+    let mut stream = socket.connect(server_addr).await?;
+    let mut chunks = BTreeMap::<ChunkHash, ChunkInfo>::new();
+    for chunk in fetch_chunks(&mut stream).await? {
+        chunks
+            .entry(chunk.hash)
+            .or_insert(ChunkInfo {
+                size: chunk.size,
+                csize: chunk.csize,
+                positions: 0,
+            })
+            .positions += 1;
+    }
+
+    let udp = UdpSocket::bind((ip, 0)).await?;
+    let disk_bytes_per_sec = options.disk_speed as f64 * (1 << 20) as f64;
+    let mut disk_free = Instant::now();
+    let mut writes = VecDeque::new();
+    let mut decoders = HashMap::<ChunkHash, (Decoder, Instant)>::new();
+
+    let mut stats = ClientStats {
+        time: Duration::ZERO,
+        received: 0,
+        lost: 0,
+        requests: 0,
+        requested: 0,
+        _stream: stream,
+    };
+    let mut window = 4 * MIN_WINDOW;
+    let mut recv_since_request = 0;
+    let mut lost_since_request = 0;
+    let mut report_packets = 0;
+    let mut report_lost = 0;
+    let mut next_report = Instant::now() + REPORT_INTERVAL;
+    let mut next_request = Instant::now();
+
+    while !chunks.is_empty() {
+        let now = Instant::now();
+        while writes.front().is_some_and(|&end| end <= now) {
+            writes.pop_front();
+        }
+
+        let mut idle = false;
+        tokio::select! {
+            packet = rx.recv() => {
+                let packet = packet.context("chunk packets stopped")?;
+                stats.received += 1;
+                report_packets += 1;
+                let (lost, chunk) = handle_packet(
+                    ip,
+                    &packet,
+                    &mut chunks,
+                    &mut decoders,
+                    options.max_decoders,
+                    now,
+                );
+                stats.lost += lost;
+                report_lost += lost;
+                lost_since_request += lost;
+                if let Some(info) = chunk {
+                    let bytes = (info.size * info.positions) as f64;
+                    disk_free =
+                        disk_free.max(now) + Duration::from_secs_f64(bytes / disk_bytes_per_sec);
+                    writes.push_back(disk_free);
+                    recv_since_request += 1;
+                }
+            }
+            _ = time::sleep(REQUEST_TIMEOUT) => idle = true,
+        }
+
+        let now = Instant::now();
+        if idle || recv_since_request >= window || now >= next_request {
+            next_request = now + REQUEST_INTERVAL;
+            if lost_since_request > 0 || writes.len() > MAX_BACKLOG {
+                window = (window / 2).max(MIN_WINDOW);
+            } else if 2 * recv_since_request >= window {
+                window = (window + recv_since_request).min(MAX_WINDOW);
+            }
+            recv_since_request = 0;
+            lost_since_request = 0;
+
+            let hashes: Vec<_> = chunks.keys().take(window).copied().collect();
+            stats.requested += hashes.len() as u64;
+            for hashes in hashes.chunks(MAX_REQUEST_CHUNKS) {
+                stats.requests += 1;
+                let msg = postcard::to_allocvec(&UdpRequest::RequestChunks(hashes.to_vec()))?;
+                udp.send_to(&msg, server_addr).await?;
+            }
+        }
+
+        if Instant::now() >= next_report {
+            next_report = Instant::now() + REPORT_INTERVAL;
+            if report_packets > 0 {
+                let msg = postcard::to_allocvec(&UdpRequest::ReceiverReport {
+                    received: report_packets,
+                    lost: report_lost as u32,
+                    backlog: writes.len() as u32,
+                })?;
+                udp.send_to(&msg, server_addr).await?;
+            }
+            report_packets = 0;
+            report_lost = 0;
+        }
+    }
+
+    time::sleep_until(disk_free).await;
+    stats.time = disk_free.max(Instant::now()) - start;
+    Ok(stats)
+}
+
+struct Report {
+    times: Vec<Duration>,
+    broadcast_packets: u64,
+    min_packets: u64,
+    server_cpu: Duration,
+    elapsed: Duration,
+    clients: Vec<ClientStats>,
+    net: Arc<NetCounters>,
+}
+
+fn percentile(sorted: &[Duration], p: f64) -> f64 {
+    sorted[((sorted.len() - 1) as f64 * p).round() as usize].as_secs_f64()
+}
+
+impl Report {
+    fn print(&self, options: &BenchOptions) {
+        let image_size = (options.image_size as u64) << 20;
+        println!(
+            "{} clients flashed {} in {:.2}s",
+            self.clients.len(),
+            BytesFmt(image_size),
+            self.elapsed.as_secs_f64()
+        );
+        println!(
+            "Time to flash: p50 {:.2}s, p90 {:.2}s, p99 {:.2}s, max {:.2}s",
+            percentile(&self.times, 0.5),
+            percentile(&self.times, 0.9),
+            percentile(&self.times, 0.99),
+            percentile(&self.times, 1.0),
+        );
+        println!(
+            "Broadcast: {} packets, {} needed to send each chunk once ({:.1}% overhead)",
+            self.broadcast_packets,
+            self.min_packets,
+            100.0 * (self.broadcast_packets as f64 / self.min_packets as f64 - 1.0),
+        );
+        let sum = |f: fn(&ClientStats) -> u64| self.clients.iter().map(f).sum::<u64>();
+        println!(
+            "Requests: {} requests for {} chunks",
+            sum(|c| c.requests),
+            sum(|c| c.requested)
+        );
+        println!(
+            "Client packets: {} received, {} detected as lost; dropped {} by full links, {} by \
+             simulated loss, {} by overruns",
+            sum(|c| c.received),
+            sum(|c| c.lost),
+            self.net.link_full.load(Ordering::Relaxed),
+            self.net.lost.load(Ordering::Relaxed),
+            self.net.overrun.load(Ordering::Relaxed),
+        );
+        println!(
+            "Server CPU: {:.2}s ({:.0}% of a core)",
+            self.server_cpu.as_secs_f64(),
+            100.0 * self.server_cpu.as_secs_f64() / self.elapsed.as_secs_f64()
+        );
+    }
+}
+
+async fn run(options: Arc<BenchOptions>, storage_dir: &Path, server: &Handle) -> Result<Report> {
+    fs::create_dir_all(storage_dir.join("images"))?;
+    fs::write(storage_dir.join("config.yaml"), config_yaml(&options))?;
+
+    let state = {
+        let storage_dir = storage_dir.to_owned();
+        Arc::new(
+            server
+                .spawn_blocking(move || State::load(storage_dir))
+                .await??,
+        )
+    };
+    log::info!(
+        "Storing a {} image",
+        BytesFmt((options.image_size as u64) << 20)
+    );
+    let min_packets = {
+        let state = state.clone();
+        let options = options.clone();
+        server
+            .spawn_blocking(move || store_image(&state, &options))
+            .await??
+    };
+
+    let ips: Vec<Ipv4Addr> = (0..options.clients).map(client_ip).collect();
+    for &ip in &ips {
+        let [_, _, row, col] = ip.octets();
+        let mac = MacAddr6::new(0x02, 0, 0x7f, 1, row, col);
+        neighbors::set_mac(ip.into(), mac);
+        state.register_unit(
+            mac,
+            RegistrationInfo {
+                group: GROUP.to_owned(),
+                row,
+                col,
+                image: IMAGE.to_owned(),
+            },
+        )?;
+    }
+
+    // As pixie-uefi, the clients queue as many packets as given by the flash options of the
+    // server.
+    let rx_queue = state.config.flash.rx_queue;
+    let net = Arc::new(NetCounters::default());
+    let mut shards = Vec::new();
+    let mut client_rxs = Vec::new();
+    for (shard, ips) in ips.chunks(CLIENTS_PER_SHARD).enumerate() {
+        let (shard_tx, shard_rx) = mpsc::channel(SHARD_QUEUE);
+        shards.push(shard_tx);
+        let links = (0..ips.len())
+            .map(|i| {
+                let (tx, rx) = mpsc::channel(rx_queue);
+                client_rxs.push(rx);
+                let index = (shard * CLIENTS_PER_SHARD + i) as u64;
+                Link {
+                    tx,
+                    rng: Rng(options.seed ^ index.wrapping_mul(0x2545f4914f6cdd1d)),
+                    tokens: LINK_BUFFER,
+                }
+            })
+            .collect();
+        tokio::spawn(simulate_links(
+            shard_rx,
+            links,
+            options.clone(),
+            net.clone(),
+        ));
+    }
+    let receiver = tokio::spawn(receive_packets(bind_chunks_socket()?, shards, net.clone()));
+
+    let mut udp_server = server.spawn(udp::main(state.clone(), Arc::new(Ingest::default())));
+    let mut tcp_server = server.spawn(tcp::main(state.clone()));
+    time::sleep(STARTUP_DELAY).await;
+
+    log::info!("Flashing {} clients", options.clients);
+    let cpu_start = server_cpu_time()?;
+    let start = Instant::now();
+    let clients = ips.iter().zip(client_rxs).map(|(&ip, rx)| {
+        let options = options.clone();
+        async move {
+            tokio::spawn(client(ip, rx, options, start))
+                .await?
+                .with_context(|| format!("client {ip}"))
+        }
+    });
+    let clients = time::timeout(
+        Duration::from_secs(options.timeout),
+        futures::future::try_join_all(clients),
+    );
+    let clients = tokio::select! {
+        clients = clients => clients.context("clients did not finish in time")??,
+        res = &mut udp_server => bail!("udp server stopped: {:?}", res?),
+        res = &mut tcp_server => bail!("tcp server stopped: {:?}", res?),
+    };
+    let elapsed = start.elapsed();
+    let server_cpu = server_cpu_time()? - cpu_start;
+    receiver.abort();
+
+    state.cancel_token.cancel();
+    udp_server.await??;
+    tcp_server.await??;
+
+    let mut times: Vec<_> = clients.iter().map(|client| client.time).collect();
+    times.sort();
+    Ok(Report {
+        times,
+        broadcast_packets: net.broadcast.load(Ordering::Relaxed),
+        min_packets,
+        server_cpu,
+        elapsed,
+        clients,
+        net,
+    })
+}
+
+fn main() -> Result<()> {
+    env_logger::init();
+
+    let options = BenchOptions::parse();
+    ensure!(
+        (1..=COLUMNS * 255).contains(&options.clients),
+        "the number of clients must be between 1 and {}",
+        COLUMNS * 255
+    );
+    ensure!(
+        options.chunk_size > 0 && options.chunk_size << 10 <= MAX_CHUNK_SIZE,
+        "the chunk size must be between 1 and {} KiB",
+        MAX_CHUNK_SIZE >> 10
+    );
+    ensure!(
+        options.broadcast_speed.checked_mul(1_000_000).is_some() && options.broadcast_speed > 0,
+        "the broadcast speed must be between 1 and {} Mbit/s",
+        u32::MAX / 1_000_000
+    );
+    ensure!(options.max_decoders > 0, "max_decoders must be positive");
+    let options = Arc::new(options);
+
+    let storage_dir: PathBuf =
+        std::env::temp_dir().join(format!("pixie-bench-{}", std::process::id()));
+    let server = Builder::new_multi_thread()
+        .enable_all()
+        .thread_name(SERVER_THREAD)
+        .thread_keep_alive(Duration::from_secs(3600))
+        .build()?;
+    let clients = Builder::new_multi_thread().enable_all().build()?;
+
+    let report = clients.block_on(run(options.clone(), &storage_dir, server.handle()));
+    server.shutdown_timeout(Duration::from_secs(1));
+    if let Err(e) = fs::remove_dir_all(&storage_dir) {
+        log::warn!("Could not remove {}: {e}", storage_dir.display());
+    }
+
+    report?.print(&options);
+    Ok(())
+}
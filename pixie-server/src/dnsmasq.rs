@@ -1,6 +1,10 @@
 //! Starts and configures dnsmasq.
 
-use crate::{find_network, state::State};
+use crate::{
+    find_network,
+    neighbors::{self, LEASE_SCRIPT},
+    state::State,
+};
 use anyhow::{Context, Result};
 use macaddr::MacAddr6;
 use pixie_shared::{DhcpMode, Unit};
@@ -76,6 +80,7 @@ interface={name}
 {interfaces_config}
 
 dhcp-hostsfile={run_str}/hosts
+dhcp-script={run_str}/{LEASE_SCRIPT}
 dhcp-boot=pixie-uefi.efi
 except-interface=lo
 user=root
@@ -135,6 +140,7 @@ pub async fn main(state: Arc<State>) -> Result<()> {
     let mut units_rx = state.subscribe_units();
 
     write_config(&state).await?;
+    neighbors::create_lease_script(&state)?;
     let mut hosts = get_hosts(&state.hostmap, &units_rx.borrow_and_update());
     write_hosts(&state, &hosts).await?;
 
@@ -150,18 +156,23 @@ pub async fn main(state: Arc<State>) -> Result<()> {
             .context("Failed to start dnsmasq")?,
     };
 
-    loop {
-        tokio::select! {
-            ret = units_rx.changed() => ret.unwrap(),
-            _ = state.cancel_token.cancelled() => break,
+    let update_hosts = async {
+        loop {
+            tokio::select! {
+                ret = units_rx.changed() => ret.unwrap(),
+                _ = state.cancel_token.cancelled() => break,
+            }
+
+            let hosts2 = get_hosts(&state.hostmap, &units_rx.borrow_and_update());
+            if hosts != hosts2 {
+                hosts = hosts2;
+                write_hosts(&state, &hosts).await?;
+                dnsmasq.reload()?;
+            }
         }
+        Ok(())
+    };
 
-        let hosts2 = get_hosts(&state.hostmap, &units_rx.borrow_and_update());
-        if hosts != hosts2 {
-            hosts = hosts2;
-            write_hosts(&state, &hosts).await?;
-            dnsmasq.reload()?;
-        }
-    }
+    tokio::try_join!(update_hosts, neighbors::main(&state))?;
     Ok(())
 }
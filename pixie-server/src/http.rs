@@ -10,10 +10,11 @@ use axum::{
     response::IntoResponse,
     routing::get,
 };
-use futures::StreamExt;
-use pixie_shared::{Action, HttpConfig, StatusUpdate};
-use std::sync::Arc;
-use tokio::net::TcpListener;
+use futures::{Stream, StreamExt};
+use macaddr::MacAddr6;
+use pixie_shared::{Action, HttpConfig, StatusUpdate, Unit};
+use std::{collections::HashMap, sync::Arc, time::Duration};
+use tokio::{net::TcpListener, sync::watch};
 use tokio_stream::wrappers::WatchStream;
 use tower_http::{
     services::ServeDir, trace::TraceLayer, validate_request::ValidateRequestHeaderLayer,
@@ -144,12 +145,96 @@ async fn delete_image(
 
 /// `GET /admin/gc`
 ///
-/// Removes all chunks not used by any image.
+/// Starts removing all chunks not used by any image in the background; progress is reported on
+/// `/admin/status`.
 async fn gc(extract::State(state): extract::State<Arc<State>>) -> impl IntoResponse {
-    match state.gc_chunks() {
-        Ok(()) => (StatusCode::NO_CONTENT, String::new()),
-        Err(e) => (StatusCode::INTERNAL_SERVER_ERROR, format!("{e}\n")),
+    if !state.start_gc() {
+        return (
+            StatusCode::CONFLICT,
+            "Garbage collection already running\n".to_owned(),
+        );
     }
+    tokio::task::spawn_blocking(move || {
+        if let Err(e) = state.gc_chunks() {
+            log::error!("Garbage collection failed: {e:?}");
+        }
+    });
+    (StatusCode::ACCEPTED, String::new())
+}
+
+/// Minimum time between two updates of the units sent on the same status stream.
+const UNITS_UPDATE_INTERVAL: Duration = Duration::from_millis(500);
+
+/// Minimum time between two updates of the unit metrics sent on the same status stream.
+const METRICS_UPDATE_INTERVAL: Duration = Duration::from_secs(2);
+
+/// Minimum time between two updates of the garbage collection progress sent on the same status
+/// stream.
+const GC_PROGRESS_UPDATE_INTERVAL: Duration = Duration::from_millis(500);
+
+/// Like [`WatchStream`], but changes are coalesced so that at most one value is yielded every
+/// `interval`.
+fn throttled<T: Clone + Send + Sync + 'static>(
+    rx: watch::Receiver<T>,
+    interval: Duration,
+) -> impl Stream<Item = T> {
+    futures::stream::unfold((rx, true), move |(mut rx, first)| async move {
+        if !first {
+            rx.changed().await.ok()?;
+            tokio::time::sleep(interval).await;
+        }
+        let value = rx.borrow_and_update().clone();
+        Some((value, (rx, false)))
+    })
+}
+
+/// Stream of the changes to the units: all the units first, then only the ones that changed
+/// since the previous message. Changes are coalesced, so that at most one message is sent every
+/// [`UNITS_UPDATE_INTERVAL`].
+fn units_updates(state: &State) -> impl Stream<Item = StatusUpdate> + use<> {
+    let mut units_rx = state.subscribe_units();
+    let units = units_rx.borrow_and_update().clone();
+    let last: HashMap<MacAddr6, Unit> = units.iter().map(|unit| (unit.mac, unit.clone())).collect();
+    let deltas = futures::stream::unfold(
+        (units_rx, last, 0),
+        |(mut units_rx, mut last, version)| async move {
+            loop {
+                units_rx.changed().await.ok()?;
+                tokio::time::sleep(UNITS_UPDATE_INTERVAL).await;
+                let (changed, removed) = {
+                    let units = units_rx.borrow_and_update();
+                    let changed: Vec<Unit> = units
+                        .iter()
+                        .filter(|unit| last.get(&unit.mac) != Some(unit))
+                        .cloned()
+                        .collect();
+                    let removed: Vec<MacAddr6> = last
+                        .keys()
+                        .filter(|mac| !units.iter().any(|unit| unit.mac == **mac))
+                        .copied()
+                        .collect();
+                    (changed, removed)
+                };
+                if changed.is_empty() && removed.is_empty() {
+                    continue;
+                }
+                for mac in &removed {
+                    last.remove(mac);
+                }
+                for unit in &changed {
+                    last.insert(unit.mac, unit.clone());
+                }
+                let version = version + 1;
+                let update = StatusUpdate::UnitsDelta {
+                    version,
+                    changed,
+                    removed,
+                };
+                return Some((update, (units_rx, last, version)));
+            }
+        },
+    );
+    futures::stream::once(async move { StatusUpdate::Units(units) }).chain(deltas)
 }
 
 /// `GET /admin/status`
@@ -161,13 +246,22 @@ async fn status(extract::State(state): extract::State<Arc<State>>) -> impl IntoR
         StatusUpdate::HostMap(state.hostmap.clone()),
     ];
 
-    let units_rx = WatchStream::new(state.subscribe_units());
+    let units_rx = units_updates(&state);
     let image_rx = WatchStream::new(state.subscribe_images());
+    let server_stats_rx = WatchStream::new(state.subscribe_server_stats());
+    let unit_metrics_rx = throttled(state.subscribe_unit_metrics(), METRICS_UPDATE_INTERVAL);
+    let gc_progress_rx = throttled(state.subscribe_gc_progress(), GC_PROGRESS_UPDATE_INTERVAL);
 
     let messages = futures::stream::iter(initial_messages)
         .chain(futures::stream::select(
-            image_rx.map(StatusUpdate::ImagesStats),
-            units_rx.map(StatusUpdate::Units),
+            futures::stream::select(image_rx.map(StatusUpdate::ImagesStats), units_rx),
+            futures::stream::select(
+                server_stats_rx.map(StatusUpdate::ServerStats),
+                futures::stream::select(
+                    unit_metrics_rx.map(StatusUpdate::UnitMetrics),
+                    gc_progress_rx.map(StatusUpdate::GcProgress),
+                ),
+            ),
         ))
         .take_until(state.cancel_token.clone().cancelled_owned());
     let lines = messages.map(|msg| serde_json::to_string(&msg).map(|x| x + "\n"));
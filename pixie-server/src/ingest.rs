@@ -0,0 +1,79 @@
+//! Ingestion of the frequent updates sent by the clients: action progress and pings.
+//!
+//! Clients report their progress for every chunk, so only the latest update of each client is
+//! kept, and all of them are applied to the [`State`] at once every [`BATCH_INTERVAL`]. Mac
+//! addresses are also resolved at that point, once per client.
+
+use crate::{
+    neighbors::find_mac,
+    state::{State, UnitUpdate},
+};
+use anyhow::Result;
+use pixie_shared::Action;
+use std::{
+    collections::HashMap,
+    net::IpAddr,
+    sync::{Arc, Mutex},
+    time::Duration,
+};
+
+const BATCH_INTERVAL: Duration = Duration::from_millis(250);
+
+#[derive(Default)]
+pub struct Ingest {
+    pending: Mutex<HashMap<IpAddr, UnitUpdate>>,
+}
+
+impl Ingest {
+    fn update(&self, ip: IpAddr, f: impl FnOnce(&mut UnitUpdate)) {
+        f(self
+            .pending
+            .lock()
+            .expect("ingest lock is poisoned")
+            .entry(ip)
+            .or_default());
+    }
+
+    pub fn progress(&self, ip: IpAddr, action: Action, progress: (usize, usize)) {
+        self.update(ip, |update| update.progress = Some((action, progress)));
+    }
+
+    pub fn ping(&self, ip: IpAddr, time: u64, comment: &[u8]) {
+        self.update(ip, |update| update.ping = Some((time, comment.to_owned())));
+    }
+
+    /// Applies the pending updates to the state. Looking up mac addresses may block, so this runs
+    /// outside of the async tasks.
+    fn flush(&self, state: &State) {
+        let pending = std::mem::take(&mut *self.pending.lock().expect("ingest lock is poisoned"));
+        let mut updates = HashMap::with_capacity(pending.len());
+        for (ip, update) in pending {
+            match find_mac(ip) {
+                Ok(mac) => {
+                    updates.insert(mac, update);
+                }
+                Err(err) => log::error!("Error handling update from {ip}: {err}"),
+            }
+        }
+        state.apply_unit_updates(&updates);
+    }
+}
+
+pub async fn main(state: Arc<State>, ingest: Arc<Ingest>) -> Result<()> {
+    let mut interval = tokio::time::interval(BATCH_INTERVAL);
+    interval.set_missed_tick_behavior(tokio::time::MissedTickBehavior::Delay);
+    loop {
+        tokio::select! {
+            _ = interval.tick() => {}
+            _ = state.cancel_token.cancelled() => break,
+        }
+        flush(&state, &ingest).await?;
+    }
+    flush(&state, &ingest).await
+}
+
+async fn flush(state: &Arc<State>, ingest: &Arc<Ingest>) -> Result<()> {
+    let (state, ingest) = (state.clone(), ingest.clone());
+    tokio::task::spawn_blocking(move || ingest.flush(&state)).await?;
+    Ok(())
+}
@@ -0,0 +1,36 @@
+//! The pixie server, run by the `pixie-server` binary; `pixie-bench` runs parts of it against
+//! simulated clients.
+
+pub mod dnsmasq;
+pub mod http;
+pub mod ingest;
+pub mod neighbors;
+pub mod ping;
+pub mod recompress;
+pub mod state;
+pub mod tcp;
+pub mod udp;
+
+use anyhow::{Result, bail};
+use interfaces::Interface;
+use ipnet::Ipv4Net;
+use std::net::{IpAddr, Ipv4Addr};
+
+/// Find the network where the server has the given IP.
+fn find_network(ip: Ipv4Addr) -> Result<(String, Ipv4Net)> {
+    for interface in Interface::get_all()? {
+        for address in &interface.addresses {
+            let Some(IpAddr::V4(addr)) = address.addr.map(|x| x.ip()) else {
+                continue;
+            };
+            let Some(IpAddr::V4(mask)) = address.mask.map(|x| x.ip()) else {
+                continue;
+            };
+            let network = Ipv4Net::with_netmask(addr, mask).expect("invalid network mask");
+            if addr == ip {
+                return Ok((interface.name.clone(), network));
+            }
+        }
+    }
+    bail!("Could not find the network for {}", ip);
+}
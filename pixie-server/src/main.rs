@@ -1,100 +1,15 @@
-mod dnsmasq;
-mod http;
-mod ping;
-mod state;
-mod tcp;
-mod udp;
-
-use crate::state::State;
-use anyhow::{Context, Result, bail, ensure};
+use anyhow::{Context, Result, ensure};
 use clap::Parser;
-use interfaces::Interface;
-use ipnet::Ipv4Net;
-use macaddr::MacAddr6;
-use std::{
-    fs,
-    io::{BufRead, BufReader},
-    net::{IpAddr, Ipv4Addr},
-    path::PathBuf,
-    process::{Child, Command, Stdio},
-    sync::Arc,
+use pixie_server::{
+    dnsmasq, http,
+    ingest::{self, Ingest},
+    ping, recompress,
+    state::State,
+    tcp, udp,
 };
+use std::{fs, path::PathBuf, sync::Arc};
 use tokio::{signal::unix::SignalKind, task::JoinHandle};
 
-/// Finds the mac address for the given ip.
-///
-/// This function searches the address in the arp cache, if it is not available it tries to
-/// populate it by pinging the peer.
-fn find_mac(ip: IpAddr) -> Result<MacAddr6> {
-    struct Zombie {
-        inner: Child,
-    }
-
-    impl Drop for Zombie {
-        fn drop(&mut self) {
-            self.inner.kill().unwrap();
-            self.inner.wait().unwrap();
-        }
-    }
-
-    if ip.is_loopback() {
-        bail!("localhost not supported");
-    }
-
-    // Repeat twice, sending a ping if looking at ip neigh the first time fails.
-    for _ in 0..2 {
-        let mut child = Zombie {
-            inner: Command::new("ip")
-                .arg("neigh")
-                .stdin(Stdio::null())
-                .stdout(Stdio::piped())
-                .stderr(Stdio::null())
-                .spawn()?,
-        };
-        let stdout = child.inner.stdout.take().unwrap();
-        let lines = BufReader::new(stdout).lines();
-
-        for line in lines {
-            let line = line?;
-            let mut parts = line.split(' ');
-
-            if parts.next().and_then(|s| s.parse().ok()) == Some(ip) {
-                let mac = parts.nth(3).unwrap();
-                if let Ok(mac) = mac.parse() {
-                    return Ok(mac);
-                }
-            }
-        }
-
-        let _ = Command::new("ping")
-            .args([&ip.to_string(), "-c", "1", "-W", "0.1"])
-            .stdout(Stdio::null())
-            .spawn()?
-            .wait();
-    }
-
-    bail!("Mac address not found");
-}
-
-/// Find the network where the server has the given IP.
-fn find_network(ip: Ipv4Addr) -> Result<(String, Ipv4Net)> {
-    for interface in Interface::get_all()? {
-        for address in &interface.addresses {
-            let Some(IpAddr::V4(addr)) = address.addr.map(|x| x.ip()) else {
-                continue;
-            };
-            let Some(IpAddr::V4(mask)) = address.mask.map(|x| x.ip()) else {
-                continue;
-            };
-            let network = Ipv4Net::with_netmask(addr, mask).expect("invalid network mask");
-            if addr == ip {
-                return Ok((interface.name.clone(), network));
-            }
-        }
-    }
-    bail!("Could not find the network for {}", ip);
-}
-
 /// Command line arguments for pixie-server.
 #[derive(Parser, Debug)]
 struct PixieOptions {
@@ -148,13 +63,27 @@ async fn main() -> Result<()> {
         Ok(())
     }
 
+    let ingest = Arc::new(Ingest::default());
+
     let dnsmasq_task = flatten(tokio::spawn(dnsmasq::main(state.clone())));
     let http_task = flatten(tokio::spawn(http::main(state.clone())));
-    let udp_task = flatten(tokio::spawn(udp::main(state.clone())));
+    let udp_task = flatten(tokio::spawn(udp::main(state.clone(), ingest.clone())));
     let tcp_task = flatten(tokio::spawn(tcp::main(state.clone())));
-    let ping_task = flatten(tokio::spawn(ping::main(state.clone())));
-
-    tokio::try_join!(dnsmasq_task, http_task, udp_task, tcp_task, ping_task)?;
+    let ping_task = flatten(tokio::spawn(ping::main(state.clone(), ingest.clone())));
+
+    let ingest_task = flatten(tokio::spawn(ingest::main(state.clone(), ingest)));
+    let recompress_task = flatten(tokio::spawn(recompress::main(state.clone())));
+
+    tokio::try_join!(
+        dnsmasq_task,
+        http_task,
+        udp_task,
+        tcp_task,
+        ping_task,
+        ingest_task,
+        recompress_task
+    )?;
+    state.save_units()?;
 
     Ok(())
 }
@@ -0,0 +1,185 @@
+//! Mapping from the ip addresses of the clients to their mac addresses.
+//!
+//! Looking up the neighbour table requires running `ip neigh`, which is way too slow to be done
+//! for every packet, so the results are cached. dnsmasq reports the changes to its leases by
+//! running a script that writes them to a fifo (see [`LEASES_FIFO`]), which keeps the cache up
+//! to date; entries also expire after [`CACHE_TTL`], for addresses not leased by dnsmasq, except
+//! the ones recorded with [`set_mac`].
+
+use crate::state::State;
+use anyhow::{Context, Result, bail};
+use macaddr::MacAddr6;
+use std::{
+    collections::BTreeMap,
+    io::{BufRead, BufReader},
+    net::IpAddr,
+    os::unix::{ffi::OsStrExt, fs::FileTypeExt},
+    process::{Child, Command, Stdio},
+    sync::Mutex,
+    time::{Duration, Instant},
+};
+use tokio::{io::AsyncBufReadExt, net::unix::pipe};
+
+/// Name of the fifo, in the run directory, to which lease changes are written.
+pub const LEASES_FIFO: &str = "leases.fifo";
+/// Name of the script, in the run directory, run by dnsmasq on lease changes.
+pub const LEASE_SCRIPT: &str = "lease-event.sh";
+
+const CACHE_TTL: Duration = Duration::from_secs(300);
+
+/// Mac address of each ip, with the time it was looked up, or `None` for entries that do not
+/// expire.
+static CACHE: Mutex<BTreeMap<IpAddr, (MacAddr6, Option<Instant>)>> = Mutex::new(BTreeMap::new());
+
+/// Finds the mac address for the given ip, using the cache if possible.
+pub fn find_mac(ip: IpAddr) -> Result<MacAddr6> {
+    {
+        let cache = CACHE.lock().expect("mac cache lock is poisoned");
+        if let Some(&(mac, time)) = cache.get(&ip)
+            && time.is_none_or(|time| time.elapsed() < CACHE_TTL)
+        {
+            return Ok(mac);
+        }
+    }
+    let mac = lookup_mac(ip)?;
+    CACHE
+        .lock()
+        .expect("mac cache lock is poisoned")
+        .insert(ip, (mac, Some(Instant::now())));
+    Ok(mac)
+}
+
+/// Records the mac address of `ip`, for clients whose address is not in the neighbour table, such
+/// as the simulated clients of pixie-bench. The entry does not expire, but is replaced by lease
+/// changes for the same addresses.
+pub fn set_mac(ip: IpAddr, mac: MacAddr6) {
+    CACHE
+        .lock()
+        .expect("mac cache lock is poisoned")
+        .insert(ip, (mac, None));
+}
+
+/// Applies a lease change reported by dnsmasq, a line with the action, the mac address and the
+/// ip address.
+fn handle_lease_event(line: &str) {
+    let mut parts = line.split_whitespace();
+    let (Some(action), Some(mac), Some(ip)) = (parts.next(), parts.next(), parts.next()) else {
+        log::warn!("Invalid lease event: {line:?}");
+        return;
+    };
+    let (Ok(mac), Ok(ip)) = (mac.parse::<MacAddr6>(), ip.parse::<IpAddr>()) else {
+        // Non-ethernet clients, or events other than lease changes.
+        return;
+    };
+    let mut cache = CACHE.lock().expect("mac cache lock is poisoned");
+    match action {
+        "add" | "old" => {
+            cache.retain(|_, (cached, _)| *cached != mac);
+            cache.insert(ip, (mac, Some(Instant::now())));
+        }
+        "del" => {
+            cache.remove(&ip);
+        }
+        _ => {}
+    }
+}
+
+/// Creates the fifo and the script used by dnsmasq to report lease changes.
+pub fn create_lease_script(state: &State) -> Result<()> {
+    let fifo = state.run_dir.join(LEASES_FIFO);
+    let is_fifo = std::fs::symlink_metadata(&fifo).is_ok_and(|m| m.file_type().is_fifo());
+    if !is_fifo {
+        let _ = std::fs::remove_file(&fifo);
+        let path = std::ffi::CString::new(fifo.as_os_str().as_bytes())?;
+        // SAFETY: `path` is a valid nul-terminated string.
+        if unsafe { libc::mkfifo(path.as_ptr(), 0o600) } < 0 {
+            return Err(std::io::Error::last_os_error())
+                .with_context(|| format!("create {}", fifo.display()));
+        }
+    }
+    let script = state.run_dir.join(LEASE_SCRIPT);
+    let content = format!(
+        "#!/bin/sh\n# Run by dnsmasq as: <add|old|del> <mac> <ip> [hostname]\necho \"$1 $2 $3\" > '{}'\n",
+        fifo.display()
+    );
+    std::fs::write(&script, content).with_context(|| format!("write {}", script.display()))?;
+    std::fs::set_permissions(&script, std::os::unix::fs::PermissionsExt::from_mode(0o755))?;
+    Ok(())
+}
+
+/// Keeps the cache up to date with the lease changes reported by dnsmasq.
+pub async fn main(state: &State) -> Result<()> {
+    let fifo = state.run_dir.join(LEASES_FIFO);
+    // Opening the fifo for writing too keeps it open when the script exits.
+    let receiver = pipe::OpenOptions::new()
+        .read_write(true)
+        .open_receiver(&fifo)
+        .with_context(|| format!("open {}", fifo.display()))?;
+    let mut lines = tokio::io::BufReader::new(receiver).lines();
+    loop {
+        let line = tokio::select! {
+            line = lines.next_line() => line?,
+            _ = state.cancel_token.cancelled() => break,
+        };
+        let Some(line) = line else {
+            break;
+        };
+        handle_lease_event(&line);
+    }
+    Ok(())
+}
+
+/// Looks up the mac address for the given ip.
+///
+/// This function searches the address in the arp cache, if it is not available it tries to
+/// populate it by pinging the peer.
+fn lookup_mac(ip: IpAddr) -> Result<MacAddr6> {
+    struct Zombie {
+        inner: Child,
+    }
+
+    impl Drop for Zombie {
+        fn drop(&mut self) {
+            self.inner.kill().unwrap();
+            self.inner.wait().unwrap();
+        }
+    }
+
+    if ip.is_loopback() {
+        bail!("localhost not supported");
+    }
+
+    // Repeat twice, sending a ping if looking at ip neigh the first time fails.
+    for _ in 0..2 {
+        let mut child = Zombie {
+            inner: Command::new("ip")
+                .arg("neigh")
+                .stdin(Stdio::null())
+                .stdout(Stdio::piped())
+                .stderr(Stdio::null())
+                .spawn()?,
+        };
+        let stdout = child.inner.stdout.take().unwrap();
+        let lines = BufReader::new(stdout).lines();
+
+        for line in lines {
+            let line = line?;
+            let mut parts = line.split(' ');
+
+            if parts.next().and_then(|s| s.parse().ok()) == Some(ip) {
+                let mac = parts.nth(3).unwrap();
+                if let Ok(mac) = mac.parse() {
+                    return Ok(mac);
+                }
+            }
+        }
+
+        let _ = Command::new("ping")
+            .args([&ip.to_string(), "-c", "1", "-W", "0.1"])
+            .stdout(Stdio::null())
+            .spawn()?
+            .wait();
+    }
+
+    bail!("Mac address not found");
+}
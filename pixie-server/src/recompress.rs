@@ -0,0 +1,83 @@
+//! Background recompression of the stored chunks with zstd, enabled by `zstd_level` in the
+//! configuration.
+//!
+//! Clients upload chunks compressed with LZ4, which is fast enough not to slow down storing an
+//! image, while flashing is usually limited by the network: recompressing the chunks once with a
+//! stronger codec makes every following flash faster. Hashes are computed over the uncompressed
+//! data, so deduplication is not affected.
+//!
+//! Units that are flashing have already fetched the compressed sizes of the chunks of their
+//! image, so chunks are only replaced when no unit is flashing.
+
+use crate::state::State;
+use anyhow::Result;
+use std::{collections::HashSet, sync::Arc, time::Duration};
+
+/// Interval at which it is checked whether units are still flashing.
+const FLASHING_CHECK_INTERVAL: Duration = Duration::from_secs(10);
+
+pub async fn main(state: Arc<State>) -> Result<()> {
+    let Some(level) = state.config.zstd_level else {
+        return Ok(());
+    };
+    let mut images_rx = state.subscribe_images();
+    // Chunks that zstd does not make smaller.
+    let mut incompressible = HashSet::new();
+    loop {
+        images_rx.borrow_and_update();
+        let chunks: Vec<_> = state
+            .chunks_to_recompress()
+            .into_iter()
+            .filter(|hash| !incompressible.contains(hash))
+            .collect();
+        if !chunks.is_empty() {
+            log::info!("Recompressing {} chunks with zstd", chunks.len());
+        }
+        let mut saved_total = 0;
+        for hash in chunks {
+            let saved = loop {
+                while state.is_any_unit_flashing() {
+                    tokio::select! {
+                        _ = tokio::time::sleep(FLASHING_CHECK_INTERVAL) => {}
+                        _ = state.cancel_token.cancelled() => return Ok(()),
+                    }
+                }
+                if state.cancel_token.is_cancelled() {
+                    return Ok(());
+                }
+                let state = state.clone();
+                let res = tokio::task::spawn_blocking(move || state.recompress_chunk(hash, level))
+                    .await?;
+                // Nothing is returned if a unit started flashing in the meantime.
+                if let Some(saved) = res.transpose() {
+                    break saved;
+                }
+            };
+            match saved {
+                Ok(0) => {
+                    incompressible.insert(hash);
+                }
+                Ok(saved) => saved_total += saved,
+                Err(err) => {
+                    log::error!("Failed to recompress chunk {}: {err:?}", hex::encode(hash));
+                    incompressible.insert(hash);
+                }
+            }
+        }
+        if saved_total > 0 {
+            log::info!("Recompression saved {saved_total} bytes");
+            let state = state.clone();
+            if let Err(err) =
+                tokio::task::spawn_blocking(move || state.update_image_csizes()).await?
+            {
+                log::error!("Failed to update the sizes of the images: {err:?}");
+            }
+        }
+
+        tokio::select! {
+            changed = images_rx.changed() => changed?,
+            _ = state.cancel_token.cancelled() => break,
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,83 @@
+//! A size-bounded LRU cache of compressed chunks.
+
+use pixie_shared::{ChunkCacheStats, ChunkHash};
+use std::{
+    collections::{BTreeMap, HashMap},
+    sync::Arc,
+};
+
+pub struct ChunkCache {
+    max_size: u64,
+    size: u64,
+    tick: u64,
+    /// Data and last access time of each cached chunk.
+    entries: HashMap<ChunkHash, (Arc<[u8]>, u64)>,
+    /// Cached chunks ordered by last access time.
+    lru: BTreeMap<u64, ChunkHash>,
+    hits: u64,
+    misses: u64,
+}
+
+impl ChunkCache {
+    pub fn new(max_size: u64) -> Self {
+        Self {
+            max_size,
+            size: 0,
+            tick: 0,
+            entries: HashMap::new(),
+            lru: BTreeMap::new(),
+            hits: 0,
+            misses: 0,
+        }
+    }
+
+    /// Looks up a chunk, marking it as the most recently used one. Misses are not counted here,
+    /// as the chunk may not exist at all; see [`ChunkCache::record_miss`].
+    pub fn get(&mut self, hash: &ChunkHash) -> Option<Arc<[u8]>> {
+        let (data, last_used) = self.entries.get_mut(hash)?;
+        self.hits += 1;
+        self.tick += 1;
+        self.lru.remove(last_used);
+        self.lru.insert(self.tick, *hash);
+        *last_used = self.tick;
+        Some(data.clone())
+    }
+
+    /// Counts a lookup of an existing chunk that was not found in the cache.
+    pub fn record_miss(&mut self) {
+        self.misses += 1;
+    }
+
+    /// Inserts a chunk, evicting the least recently used ones to stay within the size limit.
+    pub fn insert(&mut self, hash: ChunkHash, data: Arc<[u8]>) {
+        if data.len() as u64 > self.max_size {
+            return;
+        }
+        self.remove(&hash);
+        self.size += data.len() as u64;
+        while self.size > self.max_size {
+            let (_, oldest) = self.lru.pop_first().expect("cache size is positive");
+            let (data, _) = self.entries.remove(&oldest).expect("lru entry not found");
+            self.size -= data.len() as u64;
+        }
+        self.tick += 1;
+        self.lru.insert(self.tick, hash);
+        self.entries.insert(hash, (data, self.tick));
+    }
+
+    pub fn remove(&mut self, hash: &ChunkHash) {
+        if let Some((data, last_used)) = self.entries.remove(hash) {
+            self.lru.remove(&last_used);
+            self.size -= data.len() as u64;
+        }
+    }
+
+    pub fn stats(&self) -> ChunkCacheStats {
+        ChunkCacheStats {
+            hits: self.hits,
+            misses: self.misses,
+            size: self.size,
+            chunks: self.entries.len() as u64,
+        }
+    }
+}
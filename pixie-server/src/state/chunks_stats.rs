@@ -0,0 +1,164 @@
+//! Index of the chunks stored by the server, shared by all the tasks serving the clients.
+//!
+//! The index is split in [`SHARDS`] hash maps, each behind its own lock, so that lookups from
+//! different clients rarely contend with each other or with the tasks adding chunks. Chunk hashes
+//! are uniformly distributed, so the shard of a chunk is just given by the first byte of its hash.
+//!
+//! There is no consistent view across shards: callers that need one, such as the server when
+//! updating the reference counts of a whole image, must serialize the changes by other means.
+
+use pixie_shared::{ChunkHash, ChunkStats};
+use std::{
+    collections::HashMap,
+    sync::{RwLock, RwLockReadGuard, RwLockWriteGuard},
+};
+
+/// Number of shards, which must be a power of two not bigger than 256.
+pub const SHARDS: usize = 64;
+
+type Shard = HashMap<ChunkHash, ChunkStats>;
+
+#[derive(Debug)]
+pub struct ChunksStats {
+    shards: Box<[RwLock<Shard>]>,
+}
+
+impl Default for ChunksStats {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl ChunksStats {
+    pub fn new() -> Self {
+        Self {
+            shards: (0..SHARDS).map(|_| RwLock::default()).collect(),
+        }
+    }
+
+    fn read(&self, hash: &ChunkHash) -> RwLockReadGuard<'_, Shard> {
+        self.shards[hash[0] as usize % SHARDS]
+            .read()
+            .expect("chunks_stats lock is poisoned")
+    }
+
+    fn write(&self, hash: &ChunkHash) -> RwLockWriteGuard<'_, Shard> {
+        self.shards[hash[0] as usize % SHARDS]
+            .write()
+            .expect("chunks_stats lock is poisoned")
+    }
+
+    pub fn contains_key(&self, hash: &ChunkHash) -> bool {
+        self.read(hash).contains_key(hash)
+    }
+
+    pub fn get(&self, hash: &ChunkHash) -> Option<ChunkStats> {
+        self.read(hash).get(hash).copied()
+    }
+
+    pub fn insert(&self, hash: ChunkHash, stats: ChunkStats) -> Option<ChunkStats> {
+        self.write(&hash).insert(hash, stats)
+    }
+
+    pub fn remove(&self, hash: &ChunkHash) -> Option<ChunkStats> {
+        self.write(hash).remove(hash)
+    }
+
+    /// Calls `f` on the stats of the given chunk, if present, while holding the lock of its shard.
+    pub fn update<T>(&self, hash: &ChunkHash, f: impl FnOnce(&mut ChunkStats) -> T) -> Option<T> {
+        self.write(hash).get_mut(hash).map(f)
+    }
+
+    pub fn len(&self) -> usize {
+        self.shards
+            .iter()
+            .map(|shard| shard.read().expect("chunks_stats lock is poisoned").len())
+            .sum()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Calls `f` on every chunk, locking one shard at a time.
+    pub fn for_each(&self, mut f: impl FnMut(&ChunkHash, &ChunkStats)) {
+        for shard in self.shards.iter() {
+            let shard = shard.read().expect("chunks_stats lock is poisoned");
+            for (hash, stats) in shard.iter() {
+                f(hash, stats);
+            }
+        }
+    }
+
+    /// Returns the hashes of the chunks whose stats satisfy `pred`.
+    pub fn filter(&self, mut pred: impl FnMut(&ChunkStats) -> bool) -> Vec<ChunkHash> {
+        let mut hashes = Vec::new();
+        self.for_each(|hash, stats| {
+            if pred(stats) {
+                hashes.push(*hash);
+            }
+        });
+        hashes
+    }
+}
+
+impl FromIterator<(ChunkHash, ChunkStats)> for ChunksStats {
+    fn from_iter<I: IntoIterator<Item = (ChunkHash, ChunkStats)>>(iter: I) -> Self {
+        let mut shards: Vec<Shard> = (0..SHARDS).map(|_| Shard::new()).collect();
+        for (hash, stats) in iter {
+            shards[hash[0] as usize % SHARDS].insert(hash, stats);
+        }
+        Self {
+            shards: shards.into_iter().map(RwLock::new).collect(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use pixie_shared::Codec;
+
+    fn stats(csize: u64) -> ChunkStats {
+        ChunkStats {
+            csize,
+            codec: Codec::Lz4,
+            ref_cnt: 0,
+        }
+    }
+
+    fn hash(n: u32) -> ChunkHash {
+        *blake3::hash(&n.to_le_bytes()).as_bytes()
+    }
+
+    #[test]
+    fn test_insert_remove() {
+        let chunks = ChunksStats::new();
+        assert!(chunks.is_empty());
+        for n in 0..1000 {
+            assert!(chunks.insert(hash(n), stats(n as u64)).is_none());
+        }
+        assert_eq!(chunks.len(), 1000);
+        assert!(chunks.contains_key(&hash(10)));
+        assert_eq!(chunks.get(&hash(10)).unwrap().csize, 10);
+        assert_eq!(chunks.remove(&hash(10)).unwrap().csize, 10);
+        assert!(!chunks.contains_key(&hash(10)));
+        assert!(chunks.remove(&hash(10)).is_none());
+        assert_eq!(chunks.len(), 999);
+    }
+
+    #[test]
+    fn test_update() {
+        let chunks: ChunksStats = (0..100).map(|n| (hash(n), stats(n as u64))).collect();
+        assert_eq!(
+            chunks.update(&hash(5), |stats| stats.ref_cnt += 1),
+            Some(())
+        );
+        assert_eq!(chunks.update(&hash(100), |stats| stats.ref_cnt += 1), None);
+        assert_eq!(chunks.get(&hash(5)).unwrap().ref_cnt, 1);
+        assert_eq!(chunks.filter(|stats| stats.ref_cnt > 0), [hash(5)]);
+        let mut total = 0;
+        chunks.for_each(|_, stats| total += stats.csize);
+        assert_eq!(total, (0..100).sum::<u64>());
+    }
+}
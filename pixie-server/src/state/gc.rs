@@ -0,0 +1,131 @@
+//! Garbage collection of the chunks not used by any image.
+//!
+//! Garbage collection runs in batches, releasing the locks between them, so that clients and
+//! broadcasters are not stalled while it deletes chunks and compacts the packs.
+
+use crate::state::State;
+use anyhow::Result;
+use pixie_shared::{ChunkHash, GcProgress};
+use tokio::sync::watch;
+
+/// Maximum number of chunks deleted while holding the locks.
+const DELETE_BATCH: usize = 4096;
+/// Approximate number of bytes moved at once while compacting the packs.
+const COMPACT_BATCH_BYTES: u64 = 64 << 20;
+
+/// Marks the garbage collection as no longer running when dropped, even if it panicked.
+struct GcRunning<'a>(&'a watch::Sender<Option<GcProgress>>);
+
+impl Drop for GcRunning<'_> {
+    fn drop(&mut self) {
+        self.0.send_replace(None);
+    }
+}
+
+impl State {
+    /// Marks the garbage collection as running; returns `false` if it already was.
+    pub fn start_gc(&self) -> bool {
+        self.gc_progress.send_if_modified(|progress| {
+            if progress.is_some() {
+                return false;
+            }
+            *progress = Some(GcProgress::Deleting { done: 0, total: 0 });
+            true
+        })
+    }
+
+    /// Deletes all chunks which are not part of any image, then compacts the packs containing
+    /// them. Must be called after a successful [`State::start_gc`].
+    pub fn gc_chunks(&self) -> Result<()> {
+        let _running = GcRunning(&self.gc_progress);
+        self.delete_unused_chunks()
+            .and_then(|()| self.compact_packs())
+    }
+
+    fn delete_unused_chunks(&self) -> Result<()> {
+        let unused: Vec<ChunkHash> = self.chunks_stats.filter(|stats| stats.ref_cnt == 0);
+        let total = unused.len() as u64;
+
+        for (index, batch) in unused.chunks(DELETE_BATCH).enumerate() {
+            let done = (index * DELETE_BATCH) as u64;
+            self.gc_progress
+                .send_replace(Some(GcProgress::Deleting { done, total }));
+            let mut res = Ok(());
+            self.images_stats.send_modify(|images_stats| {
+                // Chunks are removed from the index before the packs and the cache are locked, as
+                // get_chunk_cdata never takes the cache while holding a shard of the index.
+                let mut deleted = Vec::with_capacity(batch.len());
+                for hash in batch {
+                    // The chunk may have been used by a new image in the meantime.
+                    let Some(stats) = self
+                        .chunks_stats
+                        .get(hash)
+                        .filter(|stats| stats.ref_cnt == 0)
+                    else {
+                        continue;
+                    };
+                    images_stats.total_csize -= stats.csize;
+                    images_stats.reclaimable -= stats.csize;
+                    self.chunks_stats.remove(hash);
+                    deleted.push(hash);
+                }
+                let mut packs = self.packs.lock().expect("packs lock is poisoned");
+                let mut chunk_cache = self
+                    .chunk_cache
+                    .lock()
+                    .expect("chunk_cache lock is poisoned");
+                for hash in deleted {
+                    // Keep going on errors, so that the packs match the rest of the state.
+                    if let Err(e) = packs.remove(hash) {
+                        res = Err(e);
+                    }
+                    chunk_cache.remove(hash);
+                }
+            });
+            res?;
+        }
+        Ok(())
+    }
+
+    fn compact_packs(&self) -> Result<()> {
+        let Some(mut compaction) = self
+            .packs
+            .lock()
+            .expect("packs lock is poisoned")
+            .start_compaction()?
+        else {
+            return Ok(());
+        };
+        loop {
+            let (done, total) = compaction.progress();
+            self.gc_progress.send_replace(Some(GcProgress::Compacting {
+                done: done as u64,
+                total: total as u64,
+            }));
+            let readers = self
+                .packs
+                .lock()
+                .expect("packs lock is poisoned")
+                .next_to_move(&mut compaction, COMPACT_BATCH_BYTES);
+            if readers.is_empty() {
+                break;
+            }
+            let mut chunks = Vec::with_capacity(readers.len());
+            for (hash, reader) in readers {
+                chunks.push((hash, reader.read()?));
+            }
+            let mut packs = self.packs.lock().expect("packs lock is poisoned");
+            for (hash, data) in chunks {
+                packs.move_chunk(&compaction, hash, &data)?;
+            }
+        }
+        self.packs
+            .lock()
+            .expect("packs lock is poisoned")
+            .finish_compaction(compaction)
+    }
+
+    pub fn subscribe_gc_progress(&self) -> watch::Receiver<Option<GcProgress>> {
+        self.gc_progress.subscribe()
+    }
+}
@@ -1,97 +1,327 @@
-use crate::state::{CHUNKS_DIR, IMAGES_DIR, State, atomic_write};
+use crate::state::{IMAGES_DIR, State, atomic_write};
 use anyhow::{Context, Result, ensure};
-use pixie_shared::{ChunkHash, ChunkStats, ChunksStats, Image, ImagesStats, MAX_CHUNK_SIZE};
+use pixie_shared::{
+    Action, Chunk, ChunkHash, ChunkStats, Codec, Image, ImageDelta, ImageDisk, ImagesStats,
+    MAX_CHUNK_SIZE, ManifestPart, manifest,
+};
+use serde_derive::Deserialize;
+use std::{
+    ops::Bound::{Excluded, Unbounded},
+    sync::{Arc, atomic::Ordering},
+};
 use tokio::sync::watch;
 
+/// Image files start with this, followed by the serialized [`Image`]. Files without it contain an
+/// image in the format used before images could have more than one disk.
+const IMAGE_MAGIC: &[u8] = b"PIXIMG\x00\x02";
+/// Magic of the image files written before chunks had a codec.
+const IMAGE_MAGIC_V1: &[u8] = b"PIXIMG\x00\x01";
+
+/// A chunk in the format used before chunks had a codec, which was always LZ4.
+#[derive(Deserialize)]
+struct ChunkV1 {
+    hash: ChunkHash,
+    start: usize,
+    size: usize,
+    csize: usize,
+}
+
+impl From<ChunkV1> for Chunk {
+    fn from(chunk: ChunkV1) -> Self {
+        Chunk {
+            hash: chunk.hash,
+            start: chunk.start,
+            size: chunk.size,
+            csize: chunk.csize,
+            codec: Codec::Lz4,
+        }
+    }
+}
+
+#[derive(Deserialize)]
+struct ImageDiskV1 {
+    size: u64,
+    chunks: Vec<ChunkV1>,
+}
+
+/// An image in the format used before chunks had a codec.
+#[derive(Deserialize)]
+struct ImageV1 {
+    boot_option_id: u16,
+    boot_entry: Vec<u8>,
+    disks: Vec<ImageDiskV1>,
+}
+
+/// An image in the format used before images could have more than one disk.
+#[derive(Deserialize)]
+struct LegacyImage {
+    boot_option_id: u16,
+    boot_entry: Vec<u8>,
+    disk: Vec<ChunkV1>,
+}
+
+/// Serializes an image in the format of image files.
+pub(super) fn serialize_image(image: &Image) -> Vec<u8> {
+    let mut data = IMAGE_MAGIC.to_vec();
+    data.extend(postcard::to_allocvec(image).expect("failed to serialize image"));
+    data
+}
+
+/// Deserializes an image file, in either the current or one of the legacy formats. Only files
+/// without a magic are parsed in the format without one, so a corrupted file is reported as such.
+pub(super) fn deserialize_image(data: &[u8]) -> Result<Image> {
+    if let Some(data) = data.strip_prefix(IMAGE_MAGIC) {
+        return postcard::from_bytes(data).context("failed to deserialize image");
+    }
+    if let Some(data) = data.strip_prefix(IMAGE_MAGIC_V1) {
+        let image: ImageV1 = postcard::from_bytes(data).context("failed to deserialize image")?;
+        let disks = image
+            .disks
+            .into_iter()
+            .map(|disk| ImageDisk {
+                size: disk.size,
+                chunks: disk.chunks.into_iter().map(Chunk::from).collect(),
+            })
+            .collect();
+        return Ok(Image {
+            boot_option_id: image.boot_option_id,
+            boot_entry: image.boot_entry,
+            disks,
+        });
+    }
+    let LegacyImage {
+        boot_option_id,
+        boot_entry,
+        disk,
+    } = postcard::from_bytes(data).context("failed to deserialize image")?;
+    // The size of the disk was not recorded, and cannot be recovered: the end of its last chunk
+    // is used instead. This is a lower bound, enough for the check that the disk being flashed is
+    // large enough, but images with empty space at the end of the disk report a smaller size.
+    let size = disk
+        .iter()
+        .map(|chunk| (chunk.start + chunk.size) as u64)
+        .max()
+        .unwrap_or(0);
+    Ok(Image {
+        boot_option_id,
+        boot_entry,
+        disks: vec![ImageDisk {
+            size,
+            chunks: disk.into_iter().map(Chunk::from).collect(),
+        }],
+    })
+}
+
+/// Compressed size of the data of `image` that is not in `prev`, its previous version.
+pub(super) fn incremental_csize(image: &Image, prev: Option<&Image>) -> u64 {
+    match prev {
+        Some(prev) => image.delta(prev).added_csize,
+        None => image.csize(),
+    }
+}
+
+/// Maximum number of deltas kept by [`State::get_image_delta`].
+const MAX_CACHED_DELTAS: usize = 16;
+
+/// Maximum length of a [`ManifestPart`].
+const MAX_MANIFEST_PART: u32 = 1 << 20;
+
+/// A manifest kept by [`State::get_image_manifest`].
+pub(super) struct CachedManifest {
+    /// Value of `images_version` when the image was read.
+    version: u64,
+    layout_hash: ChunkHash,
+    /// Full name of the version with the same content as the image, read together with it.
+    full_name: Option<String>,
+    data: Vec<u8>,
+}
+
 impl State {
     /// Checks whether the database contains the given chunk.
     pub fn has_chunk(&self, hash: ChunkHash) -> bool {
-        self.chunks_stats
-            .lock()
-            .expect("chunks_stats lock is poisoned")
-            .contains_key(&hash)
+        self.chunks_stats.contains_key(&hash)
+    }
+
+    /// Checks which of the given chunks are in the database, returning a bitmap as described in
+    /// [`pixie_shared::TcpRequest::HasChunks`].
+    pub fn has_chunks(&self, hashes: &[ChunkHash]) -> Vec<u8> {
+        let mut bitmap = vec![0; hashes.len().div_ceil(8)];
+        for (i, hash) in hashes.iter().enumerate() {
+            if self.chunks_stats.contains_key(hash) {
+                bitmap[i / 8] |= 1 << (i % 8);
+            }
+        }
+        bitmap
     }
 
     /// Get the chunk compressed data.
-    pub fn get_chunk_cdata(&self, hash: ChunkHash) -> Result<Option<Vec<u8>>> {
-        let path = self.storage_dir.join(CHUNKS_DIR).join(hex::encode(hash));
-        let chunks_stats = self
-            .chunks_stats
+    pub fn get_chunk_cdata(&self, hash: ChunkHash) -> Result<Option<Arc<[u8]>>> {
+        if let Some(cdata) = self
+            .chunk_cache
             .lock()
-            .expect("chunks_stats lock is poisoned");
-        let cdata = chunks_stats
-            .contains_key(&hash)
-            .then(|| std::fs::read(&path))
-            .transpose()?;
-        Ok(cdata)
+            .expect("chunk_cache lock is poisoned")
+            .get(&hash)
+        {
+            return Ok(Some(cdata));
+        }
+
+        let Some(reader) = self
+            .packs
+            .lock()
+            .expect("packs lock is poisoned")
+            .reader(&hash)
+        else {
+            return Ok(None);
+        };
+        self.chunk_cache
+            .lock()
+            .expect("chunk_cache lock is poisoned")
+            .record_miss();
+        // The pack is kept open by the reader, so the data can be read even if the chunk gets
+        // garbage collected in the meantime.
+        let cdata: Arc<[u8]> = reader
+            .read()
+            .with_context(|| format!("read chunk {}", hex::encode(hash)))?
+            .into();
+
+        // Only cache the data if the chunk was not deleted or recompressed since it was read.
+        // Chunks are removed from the cache with the packs locked when doing either, so checking
+        // and inserting with the packs locked never leaves stale data in the cache.
+        let packs = self.packs.lock().expect("packs lock is poisoned");
+        if packs.is_current(&hash, &reader) {
+            self.chunk_cache
+                .lock()
+                .expect("chunk_cache lock is poisoned")
+                .insert(hash, cdata.clone());
+        }
+        Ok(Some(cdata))
     }
 
-    /// Store the given chunk to the database.
-    pub fn add_chunk(&self, data: &[u8]) -> Result<()> {
-        let mut res = Ok(());
-        let dec = lz4_flex::decompress(data, MAX_CHUNK_SIZE)?;
-        ensure!(
-            dec.len() <= MAX_CHUNK_SIZE,
-            "Decompressed chunk size is too big: {}",
-            dec.len()
-        );
-        let hash = *blake3::hash(&dec).as_bytes();
-        let path = self.storage_dir.join(CHUNKS_DIR).join(hex::encode(hash));
+    /// Store the given chunk to the database. The chunk is decompressed into `scratch`, to avoid
+    /// allocating a new buffer for each chunk.
+    pub fn add_chunk(&self, data: &[u8], scratch: &mut Vec<u8>) -> Result<()> {
+        let mut res = Ok(false);
+        scratch.resize(MAX_CHUNK_SIZE, 0);
+        let len = lz4_flex::decompress_into(data, scratch)
+            .context("Invalid chunk, or decompressed chunk size is too big")?;
+        let hash = *blake3::hash(&scratch[..len]).as_bytes();
+        // Avoid taking the images_stats lock for chunks that are already present, which is the
+        // common case when storing an image similar to an existing one.
+        if self.chunks_stats.contains_key(&hash) {
+            return Ok(());
+        }
         self.images_stats.send_if_modified(|images_stats| {
             res = (|| {
-                let mut chunks_stats = self
-                    .chunks_stats
+                if self.chunks_stats.contains_key(&hash) {
+                    return Ok(false);
+                }
+                self.packs
                     .lock()
-                    .expect("chunks_stats lock is poisoned");
+                    .expect("packs lock is poisoned")
+                    .add(hash, data, Codec::Lz4)?;
                 let chunk = ChunkStats {
                     csize: data.len() as u64,
+                    codec: Codec::Lz4,
                     ref_cnt: 0,
                 };
-                let ins = chunks_stats.insert(hash, chunk).is_none();
-                if ins {
-                    atomic_write(&path, data)?;
-                    images_stats.total_csize += data.len() as u64;
-                    images_stats.reclaimable += data.len() as u64;
-                }
-                Ok(())
+                self.chunks_stats.insert(hash, chunk);
+                images_stats.total_csize += data.len() as u64;
+                images_stats.reclaimable += data.len() as u64;
+                Ok(true)
             })();
-            res.is_ok()
+            matches!(res, Ok(true))
         });
-        res
+        res.map(|_| ())
     }
 
-    /// Finds and deletes all chunks which are not part of any image.
-    pub fn gc_chunks(&self) -> Result<()> {
-        let mut res = Ok(());
-        self.images_stats.send_modify(|images_stats| {
-            let mut chunks_stats = self
-                .chunks_stats
-                .lock()
-                .expect("chunks_stats lock is poisoned");
-            chunks_stats.retain(|k, v| {
-                if res.is_ok() && v.ref_cnt == 0 {
-                    let path = self.storage_dir.join(CHUNKS_DIR).join(hex::encode(k));
-                    res = std::fs::remove_file(path);
-                    if res.is_ok() {
-                        images_stats.total_csize -= v.csize;
-                        images_stats.reclaimable -= v.csize;
-                        false
-                    } else {
-                        true
-                    }
-                } else {
-                    true
+    /// Returns the chunks used by some image that are still compressed with LZ4.
+    pub fn chunks_to_recompress(&self) -> Vec<ChunkHash> {
+        self.chunks_stats
+            .filter(|stats| stats.codec == Codec::Lz4 && stats.ref_cnt > 0)
+    }
+
+    /// Recompresses the given LZ4 chunk with zstd at `level`, keeping it as it is if that does not
+    /// make it smaller. Returns the number of bytes saved, or `None` if the chunk was not replaced
+    /// because a unit is flashing.
+    pub fn recompress_chunk(&self, hash: ChunkHash, level: i32) -> Result<Option<u64>> {
+        let Some(reader) = self
+            .packs
+            .lock()
+            .expect("packs lock is poisoned")
+            .reader(&hash)
+        else {
+            return Ok(Some(0));
+        };
+        let cdata = reader.read()?;
+        let mut data = vec![0; MAX_CHUNK_SIZE];
+        let len = lz4_flex::decompress_into(&cdata, &mut data).context("Invalid chunk")?;
+        data.truncate(len);
+        ensure!(
+            *blake3::hash(&data).as_bytes() == hash,
+            "Chunk {} is corrupted",
+            hex::encode(hash)
+        );
+        let zdata = zstd::bulk::compress(&data, level).context("zstd compression failed")?;
+        if zdata.len() >= cdata.len() {
+            return Ok(Some(0));
+        }
+
+        let mut res = Ok(Some(0));
+        self.images_stats.send_if_modified(|images_stats| {
+            res = (|| {
+                // Units that are flashing have the old compressed size. The units are kept locked
+                // until the chunk is replaced, so that none can start flashing in the meantime.
+                let units = self.units.borrow();
+                if units
+                    .iter()
+                    .any(|unit| unit.curr_action == Some(Action::Flash))
+                {
+                    return Ok(None);
+                }
+                // The chunk may have been deleted, or replaced, in the meantime.
+                let Some(stats) = self
+                    .chunks_stats
+                    .get(&hash)
+                    .filter(|stats| stats.codec == Codec::Lz4)
+                else {
+                    return Ok(Some(0));
+                };
+                // The cache entry is removed with the packs still locked, see get_chunk_cdata.
+                let mut packs = self.packs.lock().expect("packs lock is poisoned");
+                packs.replace(hash, &zdata, Codec::Zstd)?;
+                self.chunk_cache
+                    .lock()
+                    .expect("chunk_cache lock is poisoned")
+                    .remove(&hash);
+                drop(packs);
+                let saved = stats.csize - zdata.len() as u64;
+                images_stats.total_csize -= saved;
+                if stats.ref_cnt == 0 {
+                    images_stats.reclaimable -= saved;
                 }
-            });
+                self.chunks_stats.update(&hash, |stats| {
+                    stats.csize = zdata.len() as u64;
+                    stats.codec = Codec::Zstd;
+                });
+                self.images_version.fetch_add(1, Ordering::AcqRel);
+                Ok(Some(saved))
+            })();
+            matches!(res, Ok(Some(saved)) if saved > 0)
         });
-        Ok(res?)
+        res
     }
 
-    pub fn get_image_serialized(&self, image: &str) -> Result<Option<Vec<u8>>> {
+    /// Reads the file of the given image, which is either its name or its full name
+    /// (`name@version`).
+    fn get_image_serialized(&self, image: &str) -> Result<Option<Vec<u8>>> {
+        let (name, version) = image.split_once('@').unwrap_or((image, ""));
         ensure!(
-            self.config.images.iter().any(|i| i == image),
+            self.config.images.iter().any(|i| i == name),
             "Unknown image: {image}"
         );
+        if !version.is_empty() && !self.images_stats.borrow().images.contains_key(image) {
+            return Ok(None);
+        }
 
         let path = self.storage_dir.join(IMAGES_DIR).join(image);
         match std::fs::read(path) {
@@ -101,64 +331,308 @@ impl State {
         }
     }
 
-    /// Assumes that new_image is valid
+    /// Reads an image file, to be called while holding `images_lock` so that it cannot change
+    /// before the stats are updated.
+    fn read_image_file(&self, name: &str) -> Result<Option<Image>> {
+        let path = self.storage_dir.join(IMAGES_DIR).join(name);
+        match std::fs::read(&path) {
+            Ok(data) => Ok(Some(deserialize_image(&data)?)),
+            Err(e) if e.kind() == std::io::ErrorKind::NotFound => Ok(None),
+            Err(e) => Err(e).with_context(|| format!("read {}", path.display())),
+        }
+    }
+
+    /// Assumes that new_image is valid, and that `old_image` is the current content of the file
+    /// of the image, as returned by [`State::read_image_file`]. Must be called while holding the
+    /// images_stats lock, which serializes all the changes to the reference counts.
     fn write_image(
         &self,
         name: String,
         new_image: &Image,
+        old_image: Option<&Image>,
         images_stats: &mut ImagesStats,
-        chunks_stats: &mut ChunksStats,
     ) -> Result<()> {
         let path = self.storage_dir.join(IMAGES_DIR).join(&name);
 
-        let old_chunks = if images_stats.images.contains_key(&name) {
-            let old_image = std::fs::read(&path)?;
-            let old_image: Image =
-                postcard::from_bytes(&old_image).expect("failed to deserialize image");
-            old_image.disk
+        let old_chunks: Vec<Chunk> = if images_stats.images.contains_key(&name) {
+            let old_image = old_image.with_context(|| format!("image file {name} not found"))?;
+            old_image.chunks().copied().collect()
         } else {
             Vec::new()
         };
 
-        let data = postcard::to_allocvec(&new_image).expect("failed to serialize image");
+        let data = serialize_image(new_image);
         atomic_write(&path, &data).context("failed to write image")?;
+        self.images_version.fetch_add(1, Ordering::AcqRel);
 
         images_stats
             .images
             .insert(name, (new_image.size(), new_image.csize()));
 
-        for chunk in &new_image.disk {
-            let info = chunks_stats.get_mut(&chunk.hash).expect("chunk not found");
-            if info.ref_cnt == 0 {
-                images_stats.reclaimable -= info.csize;
-            }
-            info.ref_cnt += 1;
+        for chunk in new_image.chunks() {
+            self.chunks_stats
+                .update(&chunk.hash, |info| {
+                    if info.ref_cnt == 0 {
+                        images_stats.reclaimable -= info.csize;
+                    }
+                    info.ref_cnt += 1;
+                })
+                .expect("chunk not found");
         }
 
         for chunk in &old_chunks {
-            let info = chunks_stats.get_mut(&chunk.hash).expect("chunk not found");
-            info.ref_cnt -= 1;
-            if info.ref_cnt == 0 {
-                images_stats.reclaimable += info.csize;
-            }
+            self.release_chunk(&chunk.hash, images_stats);
         }
 
         Ok(())
     }
 
-    pub fn add_image(&self, name: String, image: &Image) -> Result<()> {
-        ensure!(self.config.images.contains(&name), "Unknown image: {name}");
+    /// Drops a reference to the given chunk, which must be present. Must be called while holding
+    /// the images_stats lock.
+    fn release_chunk(&self, hash: &ChunkHash, images_stats: &mut ImagesStats) {
+        self.chunks_stats
+            .update(hash, |info| {
+                info.ref_cnt -= 1;
+                if info.ref_cnt == 0 {
+                    images_stats.reclaimable += info.csize;
+                }
+            })
+            .expect("chunk not found");
+    }
+
+    /// Reads the given image, which is either its name or its full name (`name@version`).
+    ///
+    /// The compressed size and the codec of the chunks are the current ones, which change when
+    /// chunks are recompressed, rather than the ones recorded in the image file.
+    pub fn get_image(&self, image: &str) -> Result<Option<Image>> {
+        let Some(data) = self.get_image_serialized(image)? else {
+            return Ok(None);
+        };
+        let mut image = deserialize_image(&data)?;
+        self.fill_chunk_stats(&mut image);
+        Ok(Some(image))
+    }
+
+    /// Replaces the compressed size and codec of the chunks of an image, as stored in its file,
+    /// with the current ones, which change when chunks are recompressed.
+    fn fill_chunk_stats(&self, image: &mut Image) {
+        for chunk in image.disks.iter_mut().flat_map(|disk| &mut disk.chunks) {
+            if let Some(stats) = self.chunks_stats.get(&chunk.hash) {
+                chunk.csize = stats.csize as usize;
+                chunk.codec = stats.codec;
+            }
+        }
+    }
+
+    /// Recomputes the compressed sizes of the images, and of their deltas, from the current sizes
+    /// of the chunks.
+    pub fn update_image_csizes(&self) -> Result<()> {
+        let _images_lock = self.images_lock.lock().expect("images lock is poisoned");
+        let names: Vec<String> = self.images_stats.borrow().images.keys().cloned().collect();
+        let mut csizes = Vec::with_capacity(names.len());
+        let mut deltas = Vec::new();
+        // Versions of the same image are next to each other, sorted by date.
+        let mut prev_version: Option<(String, Image)> = None;
+        for full_name in names {
+            let Some(mut image) = self.read_image_file(&full_name)? else {
+                continue;
+            };
+            self.fill_chunk_stats(&mut image);
+            csizes.push((full_name.clone(), image.csize()));
+            if let Some((name, _)) = full_name.split_once('@') {
+                let prev = prev_version
+                    .as_ref()
+                    .filter(|(prev_name, _)| prev_name == name)
+                    .map(|(_, prev)| prev);
+                deltas.push((full_name.clone(), incremental_csize(&image, prev)));
+                prev_version = Some((name.to_owned(), image));
+            }
+        }
 
         let mut res = Ok(());
         self.images_stats.send_modify(|images_stats| {
             res = (|| {
-                let mut chunks_stats = self
-                    .chunks_stats
+                self.invalidate_snapshot()?;
+                for (name, csize) in csizes {
+                    if let Some((_, image_csize)) = images_stats.images.get_mut(&name) {
+                        *image_csize = csize;
+                    }
+                }
+                for (name, csize) in deltas {
+                    if let Some(delta_csize) = images_stats.deltas.get_mut(&name) {
+                        *delta_csize = csize;
+                    }
+                }
+                self.update_snapshot(images_stats)
+            })();
+        });
+        res
+    }
+
+    /// Returns the full name of the version of the given image that is currently in use, to be
+    /// called while holding `images_lock`.
+    ///
+    /// The version is recorded when it is written or rolled back to; otherwise, as after a
+    /// restart, it is found by comparing the image with its versions, once.
+    fn image_version(&self, image: &str) -> Result<Option<String>> {
+        if let Some(version) = self.current_version(image) {
+            return Ok(version);
+        }
+        let version = self.find_image_version(image)?;
+        self.current_versions
+            .lock()
+            .expect("current_versions lock is poisoned")
+            .insert(image.to_owned(), version.clone());
+        Ok(version)
+    }
+
+    fn current_version(&self, image: &str) -> Option<Option<String>> {
+        self.current_versions
+            .lock()
+            .expect("current_versions lock is poisoned")
+            .get(image)
+            .cloned()
+    }
+
+    /// Finds the version with the same content as the given image, to be called while holding
+    /// `images_lock`.
+    fn find_image_version(&self, image: &str) -> Result<Option<String>> {
+        // Images are compared after conversion to the current format, as a legacy version may
+        // have been rolled back to.
+        let Some(data) = self.get_image(image)? else {
+            return Ok(None);
+        };
+        let data = serialize_image(&data);
+        let prefix = format!("{image}@");
+        let versions: Vec<String> = self
+            .images_stats
+            .borrow()
+            .images
+            .keys()
+            .filter(|name| name.starts_with(&prefix))
+            .cloned()
+            .collect();
+        // Versions sort by date, and the current one is most likely the last one.
+        for version in versions.into_iter().rev() {
+            if self
+                .get_image(&version)?
+                .map(|image| serialize_image(&image))
+                == Some(data.clone())
+            {
+                return Ok(Some(version));
+            }
+        }
+        Ok(None)
+    }
+
+    /// Computes the changes from the version `from` (`name@version`) to the current content of
+    /// `image`. Versions never change, so deltas can be cached: usually all the units flashing an
+    /// image ask for the same one.
+    pub fn get_image_delta(&self, image: &str, from: &str) -> Result<Option<Arc<ImageDelta>>> {
+        if !from.contains('@') || !self.images_stats.borrow().images.contains_key(from) {
+            return Ok(None);
+        }
+        let Some(new_image) = self.get_image(image)? else {
+            return Ok(None);
+        };
+        let key = (from.to_owned(), new_image.layout_hash());
+        if let Some(delta) = self
+            .image_deltas
+            .lock()
+            .expect("image_deltas lock is poisoned")
+            .get(&key)
+        {
+            return Ok(Some(delta.clone()));
+        }
+        let Some(old_image) = self.get_image(from)? else {
+            return Ok(None);
+        };
+        let delta = Arc::new(new_image.delta(&old_image));
+        let mut image_deltas = self
+            .image_deltas
+            .lock()
+            .expect("image_deltas lock is poisoned");
+        if image_deltas.len() >= MAX_CACHED_DELTAS {
+            image_deltas.clear();
+        }
+        image_deltas.insert(key, delta.clone());
+        Ok(Some(delta))
+    }
+
+    /// Returns at most `len` bytes of the manifest of the given image, starting from `offset`, and
+    /// the version with the same content. Manifests are cached until an image is written or
+    /// deleted, or a chunk is recompressed, so that they are encoded only once for all the units
+    /// flashing an image.
+    pub fn get_image_manifest(&self, image: &str, offset: u64, len: u32) -> Result<ManifestPart> {
+        let version = self.images_version.load(Ordering::Acquire);
+        let cached = self
+            .manifests
+            .lock()
+            .expect("manifests lock is poisoned")
+            .get(image)
+            .filter(|manifest| manifest.version == version)
+            .cloned();
+        let manifest = match cached {
+            Some(manifest) => manifest,
+            None => {
+                // The image and its version are read together, so that they always match.
+                let (content, full_name) = {
+                    let _images_lock = self.images_lock.lock().expect("images lock is poisoned");
+                    let content = self.get_image(image)?.context("Image not found")?;
+                    (content, self.image_version(image)?)
+                };
+                let manifest = Arc::new(CachedManifest {
+                    version,
+                    layout_hash: content.layout_hash(),
+                    full_name,
+                    data: manifest::encode(&content),
+                });
+                self.manifests
                     .lock()
-                    .expect("chunks_stats lock is poisoned");
-                for chunk in &image.disk {
+                    .expect("manifests lock is poisoned")
+                    .insert(image.to_owned(), manifest.clone());
+                manifest
+            }
+        };
+        let total_len = manifest.data.len();
+        let start = usize::try_from(offset).map_or(total_len, |offset| offset.min(total_len));
+        let end = start
+            .saturating_add(len.min(MAX_MANIFEST_PART) as usize)
+            .min(total_len);
+        Ok(ManifestPart {
+            layout_hash: manifest.layout_hash,
+            version: manifest.full_name.clone(),
+            total_len: total_len as u64,
+            data: manifest.data[start..end].to_vec(),
+        })
+    }
+
+    /// Returns the full name of the last version of the given image.
+    fn last_version(&self, name: &str) -> Option<String> {
+        let prefix = format!("{name}@");
+        self.images_stats
+            .borrow()
+            .images
+            .keys()
+            .rfind(|full_name| full_name.starts_with(&prefix))
+            .cloned()
+    }
+
+    pub fn add_image(&self, name: String, image: &Image) -> Result<()> {
+        ensure!(self.config.images.contains(&name), "Unknown image: {name}");
+
+        let _images_lock = self.images_lock.lock().expect("images lock is poisoned");
+        let old_image = self.read_image_file(&name)?;
+        let prev_version = match self.last_version(&name) {
+            Some(prev) => self.read_image_file(&prev)?,
+            None => None,
+        };
+        let mut res = Ok(String::new());
+        self.images_stats.send_modify(|images_stats| {
+            res = (|| {
+                for chunk in image.chunks() {
                     ensure!(
-                        chunks_stats.contains_key(&chunk.hash),
+                        self.chunks_stats.contains_key(&chunk.hash),
                         "chunk {} not found",
                         hex::encode(chunk.hash)
                     );
@@ -166,12 +640,32 @@ impl State {
                 let now = chrono::Utc::now();
                 let version = now.to_rfc3339_opts(chrono::SecondsFormat::Secs, true);
                 let name_with_version = format!("{name}@{version}");
-                self.write_image(name, image, images_stats, &mut chunks_stats)?;
-                self.write_image(name_with_version, image, images_stats, &mut chunks_stats)?;
-                Ok(())
+                self.invalidate_snapshot()?;
+                self.write_image(name.clone(), image, old_image.as_ref(), images_stats)?;
+                self.write_image(name_with_version.clone(), image, None, images_stats)?;
+                images_stats.deltas.insert(
+                    name_with_version.clone(),
+                    incremental_csize(image, prev_version.as_ref()),
+                );
+                self.update_snapshot(images_stats)?;
+                Ok(name_with_version)
             })();
         });
-        res
+        self.set_current_version(&name, res.as_ref().ok().cloned());
+        res.map(|_| ())
+    }
+
+    /// Records the version in use of an image after changing it, to be called while holding
+    /// `images_lock`; if the change failed the version is found again when needed.
+    fn set_current_version(&self, name: &str, version: Option<String>) {
+        let mut current_versions = self
+            .current_versions
+            .lock()
+            .expect("current_versions lock is poisoned");
+        match version {
+            Some(version) => current_versions.insert(name.to_owned(), Some(version)),
+            None => current_versions.remove(name),
+        };
     }
 
     pub fn rollback_image(&self, full_name: &str) -> Result<()> {
@@ -181,25 +675,28 @@ impl State {
         ensure!(it.next().is_none(), "Invalid image name");
         ensure!(self.config.images.contains(&name), "Unknown image: {name}");
 
+        let _images_lock = self.images_lock.lock().expect("images lock is poisoned");
+        ensure!(
+            self.images_stats.borrow().images.contains_key(full_name),
+            "Unknown image: {full_name}"
+        );
+        let image = self.read_image_file(full_name)?;
+        let old_image = self.read_image_file(&name)?;
         let mut res = Ok(());
-        let path = self.storage_dir.join(IMAGES_DIR).join(full_name);
         self.images_stats.send_modify(|images_stats| {
             res = (|| {
-                let mut chunks_stats = self
-                    .chunks_stats
-                    .lock()
-                    .expect("chunks_stats lock is poisoned");
-                ensure!(
-                    images_stats.images.contains_key(full_name),
-                    "Unknown image: {full_name}"
-                );
-                let data = std::fs::read(&path)?;
-                let image =
-                    postcard::from_bytes::<Image>(&data).expect("failed to deserialize image");
-                self.write_image(name, &image, images_stats, &mut chunks_stats)?;
+                let image = image
+                    .as_ref()
+                    .filter(|_| images_stats.images.contains_key(full_name))
+                    .with_context(|| format!("Unknown image: {full_name}"))?;
+                self.invalidate_snapshot()?;
+                self.write_image(name.clone(), image, old_image.as_ref(), images_stats)?;
+                self.update_snapshot(images_stats)?;
                 Ok(())
             })();
         });
+        let version = res.as_ref().ok().map(|()| full_name.to_owned());
+        self.set_current_version(&name, version.filter(|_| full_name.contains('@')));
         res
     }
 
@@ -210,33 +707,76 @@ impl State {
         ensure!(it.next().is_none(), "Invalid image name");
         ensure!(self.config.images.contains(&name), "Unknown image: {name}");
 
+        let _images_lock = self.images_lock.lock().expect("images lock is poisoned");
+        ensure!(
+            self.images_stats.borrow().images.contains_key(full_name),
+            "Unknown image: {full_name}"
+        );
+        let image = self.read_image_file(full_name)?;
+        // The delta of the next version becomes relative to the previous one. Versions of the same
+        // image are next to each other, as they share the prefix.
+        let prefix = format!("{name}@");
+        let (prev_name, next_name) = {
+            let images_stats = self.images_stats.borrow();
+            let version = |(version, _): (&String, _)| {
+                Some(version)
+                    .filter(|version| version.starts_with(&prefix))
+                    .cloned()
+            };
+            let images = &images_stats.images;
+            let mut prev = images.range::<str, _>((Unbounded, Excluded(full_name)));
+            let mut next = images.range::<str, _>((Excluded(full_name), Unbounded));
+            (
+                prev.next_back().and_then(version),
+                next.next().and_then(version),
+            )
+        };
+        let next = match next_name.filter(|_| full_name.contains('@')) {
+            Some(next_name) => {
+                let prev = match prev_name {
+                    Some(prev_name) => self.read_image_file(&prev_name)?,
+                    None => None,
+                };
+                let next = self.read_image_file(&next_name)?;
+                next.map(|next| (next_name, incremental_csize(&next, prev.as_ref())))
+            }
+            None => None,
+        };
         let mut res = Ok(());
         self.images_stats.send_modify(|images_stats| {
             res = (|| {
-                let mut chunks_stats = self
-                    .chunks_stats
-                    .lock()
-                    .expect("chunks_stats lock is poisoned");
-                ensure!(
-                    images_stats.images.contains_key(full_name),
-                    "Unknown image: {full_name}"
-                );
+                let image = image
+                    .as_ref()
+                    .filter(|_| images_stats.images.contains_key(full_name))
+                    .with_context(|| format!("Unknown image: {full_name}"))?;
                 let path = self.storage_dir.join(IMAGES_DIR).join(full_name);
-                let data = std::fs::read(&path)?;
-                let image: Image =
-                    postcard::from_bytes(&data).expect("failed to deserialize image");
+                self.invalidate_snapshot()?;
                 std::fs::remove_file(&path)?;
+                self.images_version.fetch_add(1, Ordering::AcqRel);
                 images_stats.images.remove(full_name);
-                for chunk in image.disk {
-                    let info = chunks_stats.get_mut(&chunk.hash).expect("chunk not found");
-                    info.ref_cnt -= 1;
-                    if info.ref_cnt == 0 {
-                        images_stats.reclaimable += info.csize;
-                    }
+                images_stats.deltas.remove(full_name);
+                if let Some((next_name, delta)) = &next {
+                    images_stats.deltas.insert(next_name.clone(), *delta);
+                }
+                for chunk in image.chunks() {
+                    self.release_chunk(&chunk.hash, images_stats);
                 }
+                self.update_snapshot(images_stats)?;
                 Ok(())
             })();
         });
+        self.image_deltas
+            .lock()
+            .expect("image_deltas lock is poisoned")
+            .retain(|(from, _), _| from != full_name);
+        self.manifests
+            .lock()
+            .expect("manifests lock is poisoned")
+            .remove(full_name);
+        let current = self.current_version(&name).flatten();
+        if res.is_err() || !full_name.contains('@') || current.as_deref() == Some(full_name) {
+            self.set_current_version(&name, None);
+        }
         res
     }
 
@@ -0,0 +1,28 @@
+use crate::state::State;
+use macaddr::MacAddr6;
+use pixie_shared::{ClientMetrics, UnitMetrics};
+use tokio::sync::watch;
+
+impl State {
+    /// Records the last metrics reported by a unit; units that are not registered are ignored.
+    pub fn set_unit_metrics(&self, mac: MacAddr6, timestamp: u64, metrics: ClientMetrics) {
+        let units = self.units.borrow();
+        if !units.iter().any(|unit| unit.mac == mac) {
+            return;
+        }
+        self.unit_metrics.send_modify(|all| {
+            // Also drops the metrics of the units that were forgotten.
+            all.retain(|m| m.mac != mac && units.iter().any(|unit| unit.mac == m.mac));
+            all.push(UnitMetrics {
+                mac,
+                timestamp,
+                metrics,
+            });
+            all.sort_by_key(|m| m.mac);
+        });
+    }
+
+    pub fn subscribe_unit_metrics(&self) -> watch::Receiver<Vec<UnitMetrics>> {
+        self.unit_metrics.subscribe()
+    }
+}
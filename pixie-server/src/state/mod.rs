@@ -4,38 +4,52 @@
 //! - `config.yaml`: configuration file for pixie-server
 //! - `registered.json`: json file containing all information about registered units.
 //! - `admin/`: directory containing the static files for the admin web interface.
-//! - `chunks/`: directory containing the image's chunks.
+//! - `packs/`: directory containing the image's chunks, see [`packs`].
 //! - `images/`: directory containing the image's info.
+//! - `snapshot`, `generation`: chunk reference counts and image sizes, see [`snapshot`].
 //! - `tftpboot/`: directory containing the necessary files for network boot.
 
 #![warn(clippy::unwrap_used)]
 
+mod chunk_cache;
+pub mod chunks_stats;
+mod gc;
 mod images;
+mod metrics;
+mod packs;
+mod snapshot;
+mod stats;
 mod units;
 
+use crate::state::{chunk_cache::ChunkCache, chunks_stats::ChunksStats, packs::PackStore};
 use anyhow::{Context, Result, anyhow, ensure};
 use pixie_shared::{
-    ChunkHash, ChunkStats, ChunksStats, Config, Image, ImagesStats, RegistrationInfo, Unit,
+    BroadcastStats, ChunkHash, ChunkStats, Codec, Config, GcProgress, Image, ImageDelta,
+    ImagesStats, RegistrationInfo, ServerStats, Unit, UnitMetrics,
 };
 use std::{
-    collections::HashMap,
+    collections::{BTreeMap, HashMap},
     fs::File,
     io::{ErrorKind, Write},
     net::{IpAddr, Ipv4Addr},
     path::{Path, PathBuf},
     sync::{
-        Mutex,
+        Arc, Mutex,
         atomic::{AtomicU64, Ordering},
     },
 };
 use tokio::sync::watch;
 use tokio_util::sync::CancellationToken;
 
-pub use units::UnitSelector;
+pub use units::{UnitSelector, UnitUpdate};
 
 const CONFIG_YAML: &str = "config.yaml";
 const REGISTERED_JSON: &str = "registered.json";
+/// Maximum time for a change to the units to be written to `registered.json`.
+const PERSIST_UNITS_DELAY: std::time::Duration = std::time::Duration::from_secs(2);
+/// Directory used to store one file per chunk, whose content is moved to `packs/` at startup.
 const CHUNKS_DIR: &str = "chunks";
+const PACKS_DIR: &str = "packs";
 const IMAGES_DIR: &str = "images";
 
 /// Atomically write `data` at the specified `path`.
@@ -85,6 +99,89 @@ fn build_hostmap(path: Option<&Path>) -> Result<HashMap<Ipv4Addr, String>> {
     Ok(hostmap)
 }
 
+/// Size and csize of each image, and [`ImagesStats::deltas`].
+type ScannedImages = (BTreeMap<String, (u64, u64)>, BTreeMap<String, u64>);
+
+/// Reads all the images in `images_dir`, counting the references to each chunk in
+/// `chunks_stats`.
+fn scan_images(images_dir: &Path, chunks_stats: &ChunksStats) -> Result<ScannedImages> {
+    let mut names = std::fs::read_dir(images_dir)
+        .with_context(|| format!("open images dir: {}", images_dir.display()))?
+        .map(|image_entry| {
+            let image_entry = image_entry?;
+            image_entry
+                .file_name()
+                .into_string()
+                .map_err(|_| anyhow!("invalid image name {:?}", image_entry.file_name()))
+        })
+        .collect::<Result<Vec<_>>>()?;
+    // The versions of each image are read in order, to compare each one with the previous one.
+    names.sort_by_cached_key(|name| {
+        let (name, version) = name.split_once('@').unwrap_or((name, ""));
+        (name.to_owned(), version.to_owned())
+    });
+
+    let mut images = BTreeMap::new();
+    let mut deltas = BTreeMap::new();
+    let mut prev_version: Option<(String, Image)> = None;
+    for image_name in names {
+        let path = images_dir.join(&image_name);
+        let content =
+            std::fs::read(&path).with_context(|| format!("read image file: {}", path.display()))?;
+        let mut image = images::deserialize_image(&content)
+            .with_context(|| format!("deserialize image from {}", path.display()))?;
+        // The sizes in the file are those of the chunks when the image was stored, which may have
+        // been recompressed since.
+        for chunk in image.disks.iter_mut().flat_map(|disk| &mut disk.chunks) {
+            chunk.csize = chunks_stats
+                .update(&chunk.hash, |stats| {
+                    stats.ref_cnt += 1;
+                    stats.csize as usize
+                })
+                .with_context(|| format!("chunk {} not found", hex::encode(chunk.hash)))?;
+        }
+        images.insert(image_name.clone(), (image.size(), image.csize()));
+        if let Some((name, _)) = image_name.split_once('@') {
+            let prev = prev_version
+                .as_ref()
+                .filter(|(prev_name, _)| prev_name == name)
+                .map(|(_, prev)| prev);
+            deltas.insert(image_name.clone(), images::incremental_csize(&image, prev));
+            prev_version = Some((name.to_owned(), image));
+        }
+    }
+    Ok((images, deltas))
+}
+
+/// Moves the chunks stored as one file each in `chunks_dir` to `packs`, then deletes the
+/// directory.
+fn migrate_chunks_dir(chunks_dir: &Path, packs: &mut PackStore) -> Result<()> {
+    let mut count = 0;
+    for file in std::fs::read_dir(chunks_dir)
+        .with_context(|| format!("open chunks dir: {}", chunks_dir.display()))?
+    {
+        let file = file?;
+        let hash = file
+            .file_name()
+            .to_str()
+            .and_then(|s| hex::decode(s).ok())
+            .and_then(|s| ChunkHash::try_from(&s[..]).ok())
+            .with_context(|| format!("invalid chunk name: {:?}", file.file_name()))?;
+        let path = file.path();
+        let data =
+            std::fs::read(&path).with_context(|| format!("read chunk: {}", path.display()))?;
+        packs.add(hash, &data, Codec::Lz4)?;
+        std::fs::remove_file(&path)?;
+        count += 1;
+    }
+    std::fs::remove_dir(chunks_dir)?;
+    log::info!(
+        "Moved {count} chunks from {} to packs",
+        chunks_dir.display()
+    );
+    Ok(())
+}
+
 /// See [the module-level documentation][self].
 pub struct State {
     /// The storage_dir received by command line arguments.
@@ -99,7 +196,28 @@ pub struct State {
     units: watch::Sender<Vec<Unit>>,
     registration_hint: Mutex<Option<RegistrationInfo>>,
     images_stats: watch::Sender<ImagesStats>,
-    chunks_stats: Mutex<ChunksStats>,
+    /// Held while changing the image files, which can then be read before taking the other locks.
+    images_lock: Mutex<()>,
+    /// Changed only while holding the images_stats lock, but can be read without it.
+    chunks_stats: ChunksStats,
+    packs: Mutex<PackStore>,
+    chunk_cache: Mutex<ChunkCache>,
+    /// Deltas computed by [`State::get_image_delta`], by old version and layout hash of the new
+    /// one.
+    image_deltas: Mutex<HashMap<(String, ChunkHash), Arc<ImageDelta>>>,
+    /// Full name of the version in use of each image, if any, see [`State::get_image_manifest`].
+    current_versions: Mutex<HashMap<String, Option<String>>>,
+    /// Manifests of the images, see [`State::get_image_manifest`].
+    manifests: Mutex<HashMap<String, Arc<images::CachedManifest>>>,
+    /// Incremented after changing the content of an image file, or the codec of a chunk, so that
+    /// manifests read before the change are never used afterwards.
+    images_version: AtomicU64,
+    server_stats: watch::Sender<ServerStats>,
+    /// Last metrics reported by each unit, sorted by mac address.
+    unit_metrics: watch::Sender<Vec<UnitMetrics>>,
+    gc_progress: watch::Sender<Option<GcProgress>>,
+    /// Generation of the snapshot, see [`snapshot`].
+    generation: AtomicU64,
 
     /// Token to shutdown the entire server.
     pub cancel_token: CancellationToken,
@@ -116,6 +234,12 @@ impl State {
                 .with_context(|| format!("deserialize config from {}", path.display()))?
         };
 
+        ensure!(
+            config.store.chunking.is_valid(),
+            "invalid chunking options: {:?}",
+            config.store.chunking
+        );
+
         let hostmap = build_hostmap(config.hosts.hostsfile.as_deref())?;
 
         let units_path = storage_dir.join(REGISTERED_JSON);
@@ -141,76 +265,94 @@ impl State {
         }
         let units = watch::Sender::new(units);
 
+        // Changes are batched, writing the units at most once every PERSIST_UNITS_DELAY; they
+        // are also written on shutdown, see `save_units`.
         let mut units_rx = units.subscribe();
+        let persist_path = units_path.clone();
         tokio::spawn(async move {
+            let mut last_json = None;
             while units_rx.changed().await.is_ok() {
-                let units = units_rx.borrow_and_update().clone();
-                let json = serde_json::to_vec(&units).expect("serialize units");
-                // TODO(virv): handle error
-                atomic_write(&units_path, &json).expect("write units file");
+                tokio::time::sleep(PERSIST_UNITS_DELAY).await;
+                let json =
+                    serde_json::to_vec(&*units_rx.borrow_and_update()).expect("serialize units");
+                if last_json.as_ref() != Some(&json) {
+                    // TODO(virv): handle error
+                    atomic_write(&persist_path, &json).expect("write units file");
+                    last_json = Some(json);
+                }
             }
         });
 
+        let mut packs = PackStore::open(storage_dir.join(PACKS_DIR))?;
         let chunks_dir = storage_dir.join(CHUNKS_DIR);
-        let mut chunks_stats: ChunksStats = std::fs::read_dir(&chunks_dir)
-            .with_context(|| format!("open chunks dir: {}", chunks_dir.display()))?
-            .map(|file| {
-                let file = file?;
-                let metadata = file.metadata()?;
-                let csize = metadata.len();
-
-                let name = file
-                    .file_name()
-                    .to_str()
-                    .and_then(|s| hex::decode(s).ok())
-                    .and_then(|s| ChunkHash::try_from(&s[..]).ok())
-                    .with_context(|| format!("invalid chunk name: {:?}", file.file_name()))?;
-
-                Ok((name, ChunkStats { csize, ref_cnt: 0 }))
+        if chunks_dir.exists() {
+            migrate_chunks_dir(&chunks_dir, &mut packs)?;
+        }
+        let chunks_stats: ChunksStats = packs
+            .chunks()
+            .map(|(hash, csize, codec)| {
+                let stats = ChunkStats {
+                    csize,
+                    codec,
+                    ref_cnt: 0,
+                };
+                (hash, stats)
             })
-            .collect::<Result<_>>()?;
-
-        let images_dir = storage_dir.join(IMAGES_DIR);
-        let images = std::fs::read_dir(&images_dir)
-            .with_context(|| format!("open images dir: {}", images_dir.display()))?
-            .map(|image_entry| {
-                let image_entry = image_entry?;
-                let path = image_entry.path();
-                let image_name = image_entry
-                    .file_name()
-                    .into_string()
-                    .map_err(|_| anyhow!("invalid image name {:?}", image_entry.file_name()))?;
-                let content = std::fs::read(&path)
-                    .with_context(|| format!("read image file: {}", path.display()))?;
-                let image = postcard::from_bytes::<Image>(&content)
-                    .with_context(|| format!("deserialize image from {}", path.display()))?;
-                for chunk in &image.disk {
-                    let chunk_stats = chunks_stats
-                        .get_mut(&chunk.hash)
-                        .with_context(|| format!("chunk {} not found", hex::encode(chunk.hash)))?;
-                    chunk_stats.ref_cnt += 1;
+            .collect();
+
+        let generation = snapshot::load_generation(&storage_dir)?;
+        let snapshot = snapshot::load_snapshot(&storage_dir, generation).filter(|snapshot| {
+            snapshot
+                .ref_cnts
+                .iter()
+                .all(|(hash, _)| chunks_stats.contains_key(hash))
+        });
+        let snapshot_is_valid = snapshot.is_some();
+        let (images, deltas) = match snapshot {
+            Some(snapshot) => {
+                for (hash, ref_cnt) in snapshot.ref_cnts {
+                    chunks_stats
+                        .update(&hash, |stats| stats.ref_cnt = ref_cnt)
+                        .expect("snapshot chunks were checked");
                 }
-                Ok((image_name, (image.size(), image.csize())))
-            })
-            .collect::<Result<_>>()?;
+                (snapshot.images, snapshot.deltas)
+            }
+            None => {
+                log::info!("Snapshot not available, reading all images");
+                scan_images(&storage_dir.join(IMAGES_DIR), &chunks_stats)?
+            }
+        };
 
-        let reclaimable = chunks_stats
-            .values()
-            .filter(|stat| stat.ref_cnt == 0)
-            .map(|stat| stat.csize)
-            .sum();
-        let total_csize = chunks_stats.values().map(|stat| stat.csize).sum();
+        let mut reclaimable = 0;
+        let mut total_csize = 0;
+        chunks_stats.for_each(|_, stat| {
+            if stat.ref_cnt == 0 {
+                reclaimable += stat.csize;
+            }
+            total_csize += stat.csize;
+        });
 
         let images_stats = ImagesStats {
             total_csize,
             reclaimable,
             images,
+            deltas,
         };
 
+        if !snapshot_is_valid {
+            snapshot::write_snapshot(&storage_dir, generation, &images_stats, &chunks_stats)?;
+        }
+
         let run_dir = PathBuf::from(format!("/run/pixie-{}", std::process::id()));
         std::fs::create_dir(&run_dir)
             .with_context(|| format!("failed to create directory {}", run_dir.display()))?;
 
+        let chunk_cache = ChunkCache::new(config.chunk_cache_size);
+        let server_stats = ServerStats {
+            broadcast: vec![BroadcastStats::default(); config.hosts.interfaces.len()],
+            chunk_cache: chunk_cache.stats(),
+        };
+
         let cancel_token = CancellationToken::new();
 
         Ok(Self {
@@ -221,7 +363,18 @@ impl State {
             units,
             registration_hint: Mutex::new(None),
             images_stats: watch::Sender::new(images_stats),
-            chunks_stats: Mutex::new(chunks_stats),
+            images_lock: Mutex::new(()),
+            chunks_stats,
+            packs: Mutex::new(packs),
+            chunk_cache: Mutex::new(chunk_cache),
+            image_deltas: Mutex::new(HashMap::new()),
+            current_versions: Mutex::new(HashMap::new()),
+            manifests: Mutex::new(HashMap::new()),
+            images_version: AtomicU64::new(0),
+            server_stats: watch::Sender::new(server_stats),
+            unit_metrics: watch::Sender::new(Vec::new()),
+            gc_progress: watch::Sender::new(None),
+            generation: AtomicU64::new(generation),
             cancel_token,
         })
     }
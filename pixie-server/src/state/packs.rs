@@ -0,0 +1,487 @@
+//! Append-only storage for chunks.
+//!
+//! Chunks are appended to pack files `packs/{id:08x}.pack`; each chunk is stored as its hash, its
+//! compressed size as a little-endian u64, and its compressed data, so that pack files are
+//! self-describing. The location of every chunk is recorded in `packs/index`, a sequence of
+//! fixed-size records appended after the chunk data has been written, which is loaded with a
+//! single read at startup. The most significant byte of the compressed size holds the
+//! [`Codec`], which is zero (LZ4) for chunks stored before codecs were introduced.
+//!
+//! A chunk is replaced by appending its new data and a new index record, the last record of a
+//! chunk being the valid one.
+//!
+//! A chunk is deleted by appending a tombstone record, whose compressed size is [`TOMBSTONE`], so
+//! that its space is still accounted as dead after a restart; a [`Compaction`] then moves the live
+//! chunks out of the packs where enough space is taken by deleted ones, rewrites the index without
+//! the tombstones and removes the old packs.
+
+use crate::state::atomic_write;
+use anyhow::{Context, Result};
+use pixie_shared::{ChunkHash, Codec};
+use std::{
+    collections::{BTreeMap, HashMap},
+    fs::File,
+    io::Write,
+    os::unix::fs::FileExt,
+    path::{Path, PathBuf},
+    sync::Arc,
+};
+
+const INDEX: &str = "index";
+/// A new pack is started once the current one grows past this size.
+const MAX_PACK_SIZE: u64 = 1 << 30;
+/// Hash and compressed size.
+const CHUNK_HEADER_LEN: u64 = 32 + 8;
+/// Hash, pack id, offset and compressed size.
+const INDEX_RECORD_LEN: usize = 32 + 4 + 8 + 8;
+/// Position of the codec in the compressed size.
+const CODEC_SHIFT: u32 = 56;
+/// Compressed size of the index records of deleted chunks, with a codec that is never used.
+const TOMBSTONE: u64 = 0xff << CODEC_SHIFT;
+/// Packs are compacted only once deleted chunks take at least this fraction of them, so that
+/// deleting a few chunks does not rewrite whole packs.
+const MIN_DEAD_RATIO: f64 = 0.25;
+
+/// Encodes the compressed size and the codec of a chunk as they are stored.
+fn encode_csize(csize: u64, codec: Codec) -> u64 {
+    let codec: u64 = match codec {
+        Codec::Lz4 => 0,
+        Codec::Zstd => 1,
+    };
+    csize | codec << CODEC_SHIFT
+}
+
+/// Decodes the compressed size and the codec of a chunk, if the codec is known.
+fn decode_csize(value: u64) -> Option<(u64, Codec)> {
+    let codec = match value >> CODEC_SHIFT {
+        0 => Codec::Lz4,
+        1 => Codec::Zstd,
+        _ => return None,
+    };
+    Some((value & ((1 << CODEC_SHIFT) - 1), codec))
+}
+
+/// Position of the compressed data of a chunk.
+#[derive(Clone, Copy, PartialEq, Eq)]
+struct Location {
+    pack: u32,
+    offset: u64,
+    csize: u64,
+    codec: Codec,
+}
+
+impl Location {
+    fn to_record(self, hash: &ChunkHash) -> [u8; INDEX_RECORD_LEN] {
+        let mut record = [0; INDEX_RECORD_LEN];
+        record[..32].copy_from_slice(hash);
+        record[32..36].copy_from_slice(&self.pack.to_le_bytes());
+        record[36..44].copy_from_slice(&self.offset.to_le_bytes());
+        record[44..].copy_from_slice(&encode_csize(self.csize, self.codec).to_le_bytes());
+        record
+    }
+
+    /// Index record of a deleted chunk.
+    fn tombstone(hash: &ChunkHash) -> [u8; INDEX_RECORD_LEN] {
+        let mut record = [0; INDEX_RECORD_LEN];
+        record[..32].copy_from_slice(hash);
+        record[44..].copy_from_slice(&TOMBSTONE.to_le_bytes());
+        record
+    }
+
+    /// Parses an index record; the location is `None` if the codec is unknown.
+    fn from_record(record: &[u8]) -> (ChunkHash, Option<Self>) {
+        let hash = record_field(record, 0);
+        let csize = decode_csize(u64::from_le_bytes(record_field(record, 44)));
+        let location = csize.map(|(csize, codec)| Location {
+            pack: u32::from_le_bytes(record_field(record, 32)),
+            offset: u64::from_le_bytes(record_field(record, 36)),
+            csize,
+            codec,
+        });
+        (hash, location)
+    }
+}
+
+/// Returns the `N` bytes of an index record starting at `start`.
+fn record_field<const N: usize>(record: &[u8], start: usize) -> [u8; N] {
+    record[start..start + N]
+        .try_into()
+        .expect("index records have a fixed length")
+}
+
+struct Pack {
+    file: Arc<File>,
+    len: u64,
+    /// Bytes taken by deleted chunks.
+    dead: u64,
+}
+
+/// A chunk to be read from its pack, which can be done without holding any lock.
+pub struct ChunkReader {
+    file: Arc<File>,
+    location: Location,
+}
+
+impl ChunkReader {
+    pub fn read(&self) -> Result<Vec<u8>> {
+        let mut data = vec![0; self.location.csize as usize];
+        self.file.read_exact_at(&mut data, self.location.offset)?;
+        Ok(data)
+    }
+}
+
+/// Compaction of the packs containing deleted chunks, done in steps so that the store is not
+/// locked for the whole time: the live chunks are moved to the current pack, and once they are
+/// all moved the index is rewritten and the old packs are removed.
+pub struct Compaction {
+    packs: Vec<u32>,
+    to_move: Vec<ChunkHash>,
+    total: usize,
+}
+
+impl Compaction {
+    /// Number of chunks moved so far, and total number of chunks to move.
+    pub fn progress(&self) -> (usize, usize) {
+        (self.total - self.to_move.len(), self.total)
+    }
+}
+
+pub struct PackStore {
+    dir: PathBuf,
+    index: HashMap<ChunkHash, Location>,
+    packs: BTreeMap<u32, Pack>,
+    index_file: File,
+    current: u32,
+}
+
+fn pack_path(dir: &Path, id: u32) -> PathBuf {
+    dir.join(format!("{id:08x}.pack"))
+}
+
+fn open_for_append(path: &Path) -> Result<File> {
+    File::options()
+        .read(true)
+        .append(true)
+        .create(true)
+        .open(path)
+        .with_context(|| format!("open {}", path.display()))
+}
+
+impl PackStore {
+    /// Opens the pack store in `dir`, creating it if needed.
+    pub fn open(dir: PathBuf) -> Result<Self> {
+        std::fs::create_dir_all(&dir)
+            .with_context(|| format!("create packs dir: {}", dir.display()))?;
+
+        let mut packs = BTreeMap::new();
+        for entry in
+            std::fs::read_dir(&dir).with_context(|| format!("open packs dir: {}", dir.display()))?
+        {
+            let entry = entry?;
+            let name = entry.file_name();
+            let Some(id) = name
+                .to_str()
+                .and_then(|name| name.strip_suffix(".pack"))
+                .and_then(|id| u32::from_str_radix(id, 16).ok())
+            else {
+                continue;
+            };
+            let file = open_for_append(&entry.path())?;
+            let len = file.metadata()?.len();
+            packs.insert(
+                id,
+                Pack {
+                    file: Arc::new(file),
+                    len,
+                    dead: len,
+                },
+            );
+        }
+
+        let index_path = dir.join(INDEX);
+        let index_file = open_for_append(&index_path)?;
+        let data = std::fs::read(&index_path)
+            .with_context(|| format!("read pack index: {}", index_path.display()))?;
+        let records = data.chunks_exact(INDEX_RECORD_LEN);
+        if !records.remainder().is_empty() {
+            log::warn!("Truncating partially written pack index record");
+            index_file.set_len((data.len() - records.remainder().len()) as u64)?;
+        }
+
+        let mut index: HashMap<ChunkHash, Location> = HashMap::new();
+        for record in records {
+            if u64::from_le_bytes(record_field(record, 44)) == TOMBSTONE {
+                let hash = record_field(record, 0);
+                if let Some(old) = index.remove(&hash) {
+                    let pack = packs
+                        .get_mut(&old.pack)
+                        .expect("indexed chunks are in existing packs");
+                    pack.dead += CHUNK_HEADER_LEN + old.csize;
+                }
+                continue;
+            }
+            let (hash, location) = Location::from_record(record);
+            let Some(location) = location else {
+                log::warn!("Ignoring chunk {} with unknown codec", hex::encode(hash));
+                continue;
+            };
+            let valid = packs.get(&location.pack).is_some_and(|pack| {
+                location.offset >= CHUNK_HEADER_LEN
+                    && location
+                        .offset
+                        .checked_add(location.csize)
+                        .is_some_and(|end| end <= pack.len)
+            });
+            if !valid {
+                log::warn!("Ignoring chunk {} outside of packs", hex::encode(hash));
+                continue;
+            }
+            if let Some(old) = index.insert(hash, location) {
+                let pack = packs
+                    .get_mut(&old.pack)
+                    .expect("indexed chunks are in existing packs");
+                pack.dead += CHUNK_HEADER_LEN + old.csize;
+            }
+            let pack = packs
+                .get_mut(&location.pack)
+                .expect("location was checked to be in an existing pack");
+            pack.dead = pack.dead.saturating_sub(CHUNK_HEADER_LEN + location.csize);
+        }
+
+        let mut store = Self {
+            dir,
+            index,
+            packs,
+            index_file,
+            current: 0,
+        };
+        match store.packs.last_key_value() {
+            Some((&id, pack)) if pack.len < MAX_PACK_SIZE => store.current = id,
+            _ => store.new_pack()?,
+        }
+        Ok(store)
+    }
+
+    /// Starts appending chunks to a new pack.
+    fn new_pack(&mut self) -> Result<()> {
+        let id = self.packs.last_key_value().map_or(0, |(&id, _)| id + 1);
+        let file = open_for_append(&pack_path(&self.dir, id))?;
+        let pack = Pack {
+            file: Arc::new(file),
+            len: 0,
+            dead: 0,
+        };
+        self.packs.insert(id, pack);
+        self.current = id;
+        Ok(())
+    }
+
+    /// Returns the hash, compressed size and codec of all chunks in the store.
+    pub fn chunks(&self) -> impl Iterator<Item = (ChunkHash, u64, Codec)> + '_ {
+        self.index
+            .iter()
+            .map(|(hash, location)| (*hash, location.csize, location.codec))
+    }
+
+    pub fn reader(&self, hash: &ChunkHash) -> Option<ChunkReader> {
+        let location = *self.index.get(hash)?;
+        Some(ChunkReader {
+            file: self.packs[&location.pack].file.clone(),
+            location,
+        })
+    }
+
+    /// Checks whether `reader` still reads the current data of the chunk, which was not deleted,
+    /// replaced or moved since the reader was created.
+    pub fn is_current(&self, hash: &ChunkHash, reader: &ChunkReader) -> bool {
+        self.index.get(hash) == Some(&reader.location)
+    }
+
+    /// Appends a chunk to the current pack, without recording it in the index.
+    fn append(&mut self, hash: &ChunkHash, data: &[u8], codec: Codec) -> Result<Location> {
+        if self.packs[&self.current].len >= MAX_PACK_SIZE {
+            self.new_pack()?;
+        }
+        let pack = self
+            .packs
+            .get_mut(&self.current)
+            .expect("current pack is always open");
+
+        let mut buf = Vec::with_capacity(CHUNK_HEADER_LEN as usize + data.len());
+        buf.extend_from_slice(hash);
+        buf.extend_from_slice(&encode_csize(data.len() as u64, codec).to_le_bytes());
+        buf.extend_from_slice(data);
+        if let Err(e) = (&*pack.file).write_all(&buf) {
+            // Drop whatever was partially written, so that the pack length stays consistent.
+            let _ = pack.file.set_len(pack.len);
+            return Err(e).context("write to pack");
+        }
+
+        let location = Location {
+            pack: self.current,
+            offset: pack.len + CHUNK_HEADER_LEN,
+            csize: data.len() as u64,
+            codec,
+        };
+        pack.len += buf.len() as u64;
+        Ok(location)
+    }
+
+    /// Appends a chunk and records it in the index, returning its previous location.
+    fn insert(&mut self, hash: ChunkHash, data: &[u8], codec: Codec) -> Result<Option<Location>> {
+        let location = self.append(&hash, data, codec)?;
+        self.index_file
+            .write_all(&location.to_record(&hash))
+            .context("write to pack index")?;
+        Ok(self.index.insert(hash, location))
+    }
+
+    /// Stores a chunk, unless it is already present.
+    pub fn add(&mut self, hash: ChunkHash, data: &[u8], codec: Codec) -> Result<()> {
+        if self.index.contains_key(&hash) {
+            return Ok(());
+        }
+        self.insert(hash, data, codec)?;
+        Ok(())
+    }
+
+    /// Replaces the data of a chunk, which must have the same uncompressed content.
+    pub fn replace(&mut self, hash: ChunkHash, data: &[u8], codec: Codec) -> Result<()> {
+        if let Some(old) = self.insert(hash, data, codec)? {
+            let pack = self.packs.get_mut(&old.pack).with_context(|| {
+                format!("pack {} of chunk {} not found", old.pack, hex::encode(hash))
+            })?;
+            pack.dead += CHUNK_HEADER_LEN + old.csize;
+        }
+        Ok(())
+    }
+
+    /// Deletes a chunk; its space is reclaimed by the next [`Compaction`]. The chunk is removed
+    /// from the index even if recording its deletion fails.
+    pub fn remove(&mut self, hash: &ChunkHash) -> Result<()> {
+        let Some(location) = self.index.remove(hash) else {
+            return Ok(());
+        };
+        let pack = self
+            .packs
+            .get_mut(&location.pack)
+            .expect("indexed chunks are in open packs");
+        pack.dead += CHUNK_HEADER_LEN + location.csize;
+        self.index_file
+            .write_all(&Location::tombstone(hash))
+            .context("write to pack index")
+    }
+
+    /// Starts moving the live chunks out of the packs where deleted chunks take at least
+    /// [`MIN_DEAD_RATIO`] of the space, see [`Compaction`]. New chunks are appended to a new pack from now on.
+    pub fn start_compaction(&mut self) -> Result<Option<Compaction>> {
+        let packs: Vec<u32> = self
+            .packs
+            .iter()
+            .filter(|(_, pack)| {
+                pack.dead > 0 && pack.dead as f64 >= pack.len as f64 * MIN_DEAD_RATIO
+            })
+            .map(|(&id, _)| id)
+            .collect();
+        if packs.is_empty() {
+            return Ok(None);
+        }
+        if packs.contains(&self.current) {
+            self.new_pack()?;
+        }
+        let to_move: Vec<_> = self
+            .index
+            .iter()
+            .filter(|(_, location)| packs.contains(&location.pack))
+            .map(|(hash, _)| *hash)
+            .collect();
+        Ok(Some(Compaction {
+            packs,
+            total: to_move.len(),
+            to_move,
+        }))
+    }
+
+    /// Returns readers for the next chunks to move, about `max_bytes` in total, which can then be
+    /// read without holding any lock and passed to [`PackStore::move_chunk`].
+    pub fn next_to_move(
+        &self,
+        compaction: &mut Compaction,
+        max_bytes: u64,
+    ) -> Vec<(ChunkHash, ChunkReader)> {
+        let mut readers = Vec::new();
+        let mut bytes = 0;
+        while bytes < max_bytes
+            && let Some(hash) = compaction.to_move.pop()
+        {
+            // The chunk may have been deleted or replaced in the meantime.
+            if !self.is_in(&hash, compaction) {
+                continue;
+            }
+            let reader = self
+                .reader(&hash)
+                .expect("chunk was just checked to be in the index");
+            bytes += reader.location.csize;
+            readers.push((hash, reader));
+        }
+        readers
+    }
+
+    fn is_in(&self, hash: &ChunkHash, compaction: &Compaction) -> bool {
+        self.index
+            .get(hash)
+            .is_some_and(|location| compaction.packs.contains(&location.pack))
+    }
+
+    /// Appends a chunk read from one of the packs being compacted to the current pack, unless it
+    /// was deleted or replaced since it was read.
+    pub fn move_chunk(
+        &mut self,
+        compaction: &Compaction,
+        hash: ChunkHash,
+        data: &[u8],
+    ) -> Result<()> {
+        if !self.is_in(&hash, compaction) {
+            return Ok(());
+        }
+        let codec = self.index[&hash].codec;
+        let location = self.append(&hash, data, codec)?;
+        self.index.insert(hash, location);
+        Ok(())
+    }
+
+    /// Rewrites the index and removes the compacted packs, once all their chunks were moved.
+    pub fn finish_compaction(&mut self, compaction: Compaction) -> Result<()> {
+        let left: Vec<_> = self
+            .index
+            .keys()
+            .filter(|hash| self.is_in(hash, &compaction))
+            .copied()
+            .collect();
+        for hash in left {
+            let data = self
+                .reader(&hash)
+                .expect("chunk was just taken from the index")
+                .read()?;
+            self.move_chunk(&compaction, hash, &data)?;
+        }
+
+        // The old packs are removed only once the new index is in place, so that a crash leaves
+        // the store consistent.
+        let index: Vec<u8> = self
+            .index
+            .iter()
+            .flat_map(|(hash, location)| location.to_record(hash))
+            .collect();
+        let index_path = self.dir.join(INDEX);
+        atomic_write(&index_path, &index)?;
+        self.index_file = open_for_append(&index_path)?;
+
+        for id in compaction.packs {
+            self.packs.remove(&id);
+            let path = pack_path(&self.dir, id);
+            std::fs::remove_file(&path).with_context(|| format!("remove {}", path.display()))?;
+        }
+        Ok(())
+    }
+}
@@ -0,0 +1,114 @@
+//! Snapshot of the chunk reference counts and of the image sizes, to avoid reading all the images
+//! at startup.
+//!
+//! The snapshot is tagged with a generation number, which is also stored on its own in the
+//! `generation` file. Before any change to the images the generation file is bumped, making the
+//! snapshot stale; once the change is done a new snapshot with the new generation is written. At
+//! startup the snapshot is only used if its generation matches, that is if no change to the images
+//! was interrupted by a crash.
+
+use crate::state::{State, atomic_write, chunks_stats::ChunksStats};
+use anyhow::{Context, Result};
+use pixie_shared::{ChunkHash, ImagesStats};
+use serde_derive::{Deserialize, Serialize};
+use std::{collections::BTreeMap, io::ErrorKind, path::Path, sync::atomic::Ordering};
+
+const SNAPSHOT: &str = "snapshot";
+const GENERATION: &str = "generation";
+
+#[derive(Serialize, Deserialize)]
+pub struct Snapshot {
+    generation: u64,
+    /// size and csize of each image
+    pub images: BTreeMap<String, (u64, u64)>,
+    /// Reference counts of the chunks used by at least one image.
+    pub ref_cnts: Vec<(ChunkHash, usize)>,
+    pub deltas: BTreeMap<String, u64>,
+}
+
+/// Reads the current generation from `storage_dir`.
+pub fn load_generation(storage_dir: &Path) -> Result<u64> {
+    let path = storage_dir.join(GENERATION);
+    match std::fs::read(&path) {
+        Ok(data) => {
+            let data = data.try_into().ok().context("invalid generation file")?;
+            Ok(u64::from_le_bytes(data))
+        }
+        Err(e) if e.kind() == ErrorKind::NotFound => Ok(0),
+        Err(e) => Err(e).with_context(|| format!("read {}", path.display())),
+    }
+}
+
+/// Reads the snapshot from `storage_dir`, if it is present and up to date.
+pub fn load_snapshot(storage_dir: &Path, generation: u64) -> Option<Snapshot> {
+    let path = storage_dir.join(SNAPSHOT);
+    let data = match std::fs::read(&path) {
+        Ok(data) => data,
+        Err(e) => {
+            if e.kind() != ErrorKind::NotFound {
+                log::warn!("Failed to read {}: {e}", path.display());
+            }
+            return None;
+        }
+    };
+    match postcard::from_bytes::<Snapshot>(&data) {
+        Ok(snapshot) if snapshot.generation == generation => Some(snapshot),
+        Ok(_) => {
+            log::warn!("Snapshot is stale");
+            None
+        }
+        Err(e) => {
+            log::warn!("Failed to deserialize {}: {e}", path.display());
+            None
+        }
+    }
+}
+
+/// Writes a snapshot of the current state of the images.
+pub fn write_snapshot(
+    storage_dir: &Path,
+    generation: u64,
+    images_stats: &ImagesStats,
+    chunks_stats: &ChunksStats,
+) -> Result<()> {
+    let snapshot = Snapshot {
+        generation,
+        images: images_stats.images.clone(),
+        ref_cnts: {
+            let mut ref_cnts = Vec::new();
+            chunks_stats.for_each(|hash, stats| {
+                if stats.ref_cnt > 0 {
+                    ref_cnts.push((*hash, stats.ref_cnt));
+                }
+            });
+            ref_cnts
+        },
+        deltas: images_stats.deltas.clone(),
+    };
+    let data = postcard::to_allocvec(&snapshot).expect("failed to serialize snapshot");
+    atomic_write(&storage_dir.join(SNAPSHOT), &data).context("failed to write snapshot")
+}
+
+impl State {
+    /// Marks the snapshot as stale, to be called before changing the images.
+    pub(super) fn invalidate_snapshot(&self) -> Result<()> {
+        let generation = self.generation.fetch_add(1, Ordering::Relaxed) + 1;
+        atomic_write(
+            &self.storage_dir.join(GENERATION),
+            &generation.to_le_bytes(),
+        )
+        .context("failed to write generation")
+    }
+
+    /// Writes a new snapshot, to be called after changing the images while still holding the
+    /// images_stats lock, so that the reference counts do not change while they are read.
+    pub(super) fn update_snapshot(&self, images_stats: &ImagesStats) -> Result<()> {
+        let generation = self.generation.load(Ordering::Relaxed);
+        write_snapshot(
+            &self.storage_dir,
+            generation,
+            images_stats,
+            &self.chunks_stats,
+        )
+    }
+}
@@ -0,0 +1,28 @@
+use crate::state::State;
+use pixie_shared::{BroadcastStats, ServerStats};
+use tokio::sync::watch;
+
+impl State {
+    /// Updates the broadcast statistics, in the same order as the configured interfaces, together
+    /// with the statistics of the chunk cache.
+    pub fn update_server_stats(&self, broadcast: Vec<BroadcastStats>) {
+        let chunk_cache = self
+            .chunk_cache
+            .lock()
+            .expect("chunk_cache lock is poisoned")
+            .stats();
+        self.server_stats.send_if_modified(|stats| {
+            let new_stats = ServerStats {
+                broadcast,
+                chunk_cache,
+            };
+            let modified = *stats != new_stats;
+            *stats = new_stats;
+            modified
+        });
+    }
+
+    pub fn subscribe_server_stats(&self) -> watch::Receiver<ServerStats> {
+        self.server_stats.subscribe()
+    }
+}
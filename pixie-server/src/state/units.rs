@@ -1,10 +1,19 @@
-use crate::state::State;
-use anyhow::{Result, bail, ensure};
+use crate::state::{REGISTERED_JSON, State, atomic_write};
+use anyhow::{Context, Result, bail, ensure};
 use macaddr::MacAddr6;
 use pixie_shared::{Action, RegistrationInfo, Unit};
-use std::net::Ipv4Addr;
+use std::{collections::HashMap, net::Ipv4Addr};
 use tokio::sync::watch;
 
+/// Latest progress and ping of a unit, applied in batches by [`State::apply_unit_updates`].
+#[derive(Debug, Default)]
+pub struct UnitUpdate {
+    /// Action the progress was reported for, with the done and total amounts of work.
+    pub progress: Option<(Action, (usize, usize))>,
+    /// Time and comment of the last ping.
+    pub ping: Option<(u64, Vec<u8>)>,
+}
+
 /// A filter over units.
 pub enum UnitSelector {
     /// Selects the unit with the given mac address.
@@ -73,6 +82,13 @@ impl State {
         self.units.subscribe()
     }
 
+    /// Writes the units to `registered.json` right away, instead of waiting for the periodic
+    /// write of the changes.
+    pub fn save_units(&self) -> Result<()> {
+        let json = serde_json::to_vec(&*self.units.borrow()).context("serialize units")?;
+        atomic_write(&self.storage_dir.join(REGISTERED_JSON), &json)
+    }
+
     pub fn register_unit(&self, mac: MacAddr6, station: RegistrationInfo) -> Result<()> {
         if !self.config.images.contains(&station.image) {
             bail!("Unknown image: {}", station.image);
@@ -124,6 +140,14 @@ impl State {
         })
     }
 
+    /// Checks whether any unit is flashing an image.
+    pub fn is_any_unit_flashing(&self) -> bool {
+        self.units
+            .borrow()
+            .iter()
+            .any(|unit| unit.curr_action == Some(Action::Flash))
+    }
+
     pub fn get_unit_action(&self, peer_mac: MacAddr6) -> Action {
         let mut action = Action::Wait;
         self.units.send_if_modified(|units| {
@@ -158,25 +182,56 @@ impl State {
         action
     }
 
+    /// Applies `f` to the selected units, returning how many were selected. Subscribers are only
+    /// notified if a unit actually changed, as most updates repeat the current progress.
     fn set_unit_inner(&self, selector: UnitSelector, f: impl Fn(&mut Unit)) -> usize {
         let mut updated = 0;
         self.units.send_if_modified(|units| {
+            let mut modified = false;
             for unit in units {
                 if selector.select(unit) {
+                    let before = unit.clone();
                     f(unit);
+                    modified |= *unit != before;
                     updated += 1;
                 }
             }
-            updated > 0
+            modified
         });
         updated
     }
 
-    pub fn set_unit_ping(&self, selector: UnitSelector, time: u64, comment: &[u8]) -> usize {
-        self.set_unit_inner(selector, |unit| {
-            unit.last_ping_timestamp = time;
-            unit.last_ping_comment = comment.to_owned();
-        })
+    /// Applies the updates to the units with the given mac addresses, notifying the subscribers
+    /// at most once.
+    pub fn apply_unit_updates(&self, updates: &HashMap<MacAddr6, UnitUpdate>) {
+        if updates.is_empty() {
+            return;
+        }
+        self.units.send_if_modified(|units| {
+            let mut modified = false;
+            for unit in units {
+                let Some(update) = updates.get(&unit.mac) else {
+                    continue;
+                };
+                // The action may have been completed, and another one started, after the progress
+                // was reported.
+                if let Some((action, progress)) = update.progress
+                    && unit.curr_action == Some(action)
+                    && unit.curr_progress != Some(progress)
+                {
+                    unit.curr_progress = Some(progress);
+                    modified = true;
+                }
+                if let Some((time, comment)) = &update.ping
+                    && (unit.last_ping_timestamp != *time || unit.last_ping_comment != *comment)
+                {
+                    unit.last_ping_timestamp = *time;
+                    unit.last_ping_comment = comment.clone();
+                    modified = true;
+                }
+            }
+            modified
+        });
     }
 
     pub fn set_unit_next_action(&self, selector: UnitSelector, action: Action) -> usize {
@@ -202,16 +257,6 @@ impl State {
         }))
     }
 
-    pub fn set_unit_progress(
-        &self,
-        selector: UnitSelector,
-        progress: Option<(usize, usize)>,
-    ) -> usize {
-        self.set_unit_inner(selector, |unit| {
-            unit.curr_progress = progress;
-        })
-    }
-
     pub fn forget_unit(&self, selector: UnitSelector) -> usize {
         let mut updated = 0;
         self.units.send_if_modified(|units| {
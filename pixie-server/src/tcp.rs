@@ -1,12 +1,12 @@
 //! Handles [`TcpRequest`]
 
 use crate::{
-    find_mac,
+    neighbors::find_mac,
     state::{State, UnitSelector},
 };
-use anyhow::{Context, Result};
+use anyhow::{Context, Result, ensure};
 use macaddr::MacAddr6;
-use pixie_shared::{ACTION_PORT, TcpRequest};
+use pixie_shared::{ACTION_PORT, Image, MAX_CHUNK_SIZE, TcpRequest};
 use std::{
     io::ErrorKind,
     net::{Ipv4Addr, SocketAddr},
@@ -17,7 +17,37 @@ use tokio::{
     net::{TcpListener, TcpStream},
 };
 
-async fn handle_request(state: &State, req: TcpRequest, peer_mac: MacAddr6) -> Result<Vec<u8>> {
+/// Maximum length of a request. Clients stop adding chunks to a batch once it is 8 MiB long, so
+/// that batches are shorter than 3 chunks of the maximum size.
+const MAX_REQUEST_LEN: usize = 4 * MAX_CHUNK_SIZE;
+
+/// Maximum length of a [`TcpRequest::UploadImage`], which bounds the size of images that can be
+/// uploaded.
+const MAX_IMAGE_REQUEST_LEN: usize = 1 << 30;
+
+/// Request buffers bigger than this are released after handling the request, so that idle
+/// connections don't hold on to large buffers.
+const KEEP_BUFFER_LEN: usize = 16 << 20;
+
+/// Checks whether the serialized request in `buf` is a [`TcpRequest::UploadImage`], from its
+/// variant index.
+fn is_upload_image(buf: &[u8]) -> bool {
+    let variant = |buf: &[u8]| postcard::take_from_bytes::<u32>(buf).ok().map(|(v, _)| v);
+    let empty = TcpRequest::UploadImage(Image {
+        boot_option_id: 0,
+        boot_entry: Vec::new(),
+        disks: Vec::new(),
+    });
+    let empty = postcard::to_allocvec(&empty).expect("failed to serialize request");
+    variant(buf).is_some_and(|v| Some(v) == variant(&empty))
+}
+
+async fn handle_request(
+    state: &State,
+    req: TcpRequest<'_>,
+    peer_mac: MacAddr6,
+    scratch: &mut Vec<u8>,
+) -> Result<Vec<u8>> {
     Ok(match req {
         TcpRequest::HasChunk(hash) => {
             let has_chunk = state.has_chunk(hash);
@@ -25,7 +55,8 @@ async fn handle_request(state: &State, req: TcpRequest, peer_mac: MacAddr6) -> R
         }
         TcpRequest::GetImage => {
             let unit = state.get_unit(peer_mac).context("Unit not found")?;
-            state.get_image_serialized(&unit.image)?.unwrap()
+            let image = state.get_image(&unit.image)?.context("Image not found")?;
+            postcard::to_allocvec(&image)?
         }
         TcpRequest::Register(station) => {
             state.set_registration_hint(station.clone());
@@ -33,7 +64,7 @@ async fn handle_request(state: &State, req: TcpRequest, peer_mac: MacAddr6) -> R
             Vec::new()
         }
         TcpRequest::UploadChunk(data) => {
-            state.add_chunk(&data)?;
+            state.add_chunk(data, scratch)?;
             Vec::new()
         }
         TcpRequest::UploadImage(image) => {
@@ -49,6 +80,27 @@ async fn handle_request(state: &State, req: TcpRequest, peer_mac: MacAddr6) -> R
             state.unit_complete_action(UnitSelector::MacAddr(peer_mac));
             Vec::new()
         }
+        TcpRequest::GetStoreOptions => postcard::to_allocvec(&state.config.store)?,
+        TcpRequest::GetFlashOptions => postcard::to_allocvec(&state.config.flash)?,
+        TcpRequest::GetVersionedImage(full_name) => {
+            postcard::to_allocvec(&state.get_image(&full_name)?)?
+        }
+        TcpRequest::GetImageManifest { offset, len } => {
+            let unit = state.get_unit(peer_mac).context("Unit not found")?;
+            postcard::to_allocvec(&state.get_image_manifest(&unit.image, offset, len)?)?
+        }
+        TcpRequest::GetImageDelta(from) => {
+            let unit = state.get_unit(peer_mac).context("Unit not found")?;
+            let delta = state.get_image_delta(&unit.image, &from)?;
+            postcard::to_allocvec(&delta.as_deref())?
+        }
+        TcpRequest::HasChunks(hashes) => postcard::to_allocvec(&state.has_chunks(&hashes))?,
+        TcpRequest::UploadChunks(chunks) => {
+            for data in chunks {
+                state.add_chunk(data, scratch)?;
+            }
+            Vec::new()
+        }
     })
 }
 
@@ -65,18 +117,36 @@ async fn handle_connection(
         }
     };
 
+    // Requests borrow their chunk data from `buf`, which is reused across requests; `scratch`
+    // holds decompressed chunks.
+    let mut buf = Vec::new();
+    let mut scratch = Vec::new();
     loop {
         let len = match stream.read_u64_le().await {
             Ok(len) => len as usize,
             Err(e) if e.kind() == ErrorKind::ConnectionReset => return Ok(()),
             Err(e) => Err(e)?,
         };
-        let mut buf = vec![0; len];
+        ensure!(
+            len <= MAX_IMAGE_REQUEST_LEN,
+            "Request too long: {len} bytes"
+        );
+        buf.resize(len.min(MAX_REQUEST_LEN), 0);
         stream.read_exact(&mut buf).await?;
+        if len > buf.len() {
+            // Only images can be longer; the buffer grows once the request is known to be one.
+            ensure!(is_upload_image(&buf), "Request too long: {len} bytes");
+            let start = buf.len();
+            buf.resize(len, 0);
+            stream.read_exact(&mut buf[start..]).await?;
+        }
         let req = postcard::from_bytes(&buf)?;
-        let resp = handle_request(&state, req, peer_mac).await?;
+        let resp = handle_request(&state, req, peer_mac, &mut scratch).await?;
         stream.write_u64_le(resp.len() as u64).await?;
         stream.write_all(&resp).await?;
+        if buf.capacity() > KEEP_BUFFER_LEN {
+            buf = Vec::new();
+        }
     }
 }
 
@@ -0,0 +1,641 @@
+//! Handles [`UdpRequest`]
+
+mod scheduler;
+
+use crate::{
+    find_network,
+    ingest::Ingest,
+    neighbors::find_mac,
+    state::{State, UnitSelector},
+};
+use anyhow::{Context, Result, ensure};
+use futures::FutureExt;
+use ipnet::Ipv4Net;
+use pixie_shared::{
+    ACTION_PORT, BroadcastStats, CHUNKS_PORT, ChunkHash, HINT_PORT, HintPacket, InterfaceConfig,
+    RegistrationInfo, UDP_BODY_LEN, UdpRequest,
+    chunk_codec::{Encoder, MAX_SHARDS},
+};
+use scheduler::Scheduler;
+use std::{
+    collections::HashMap,
+    io,
+    net::{IpAddr, Ipv4Addr, SocketAddrV4},
+    os::fd::AsRawFd,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicU64, Ordering},
+    },
+    time::SystemTime,
+};
+use tokio::{
+    io::Interest,
+    net::UdpSocket,
+    sync::mpsc::{self, Receiver, Sender},
+    time::{self, Duration, Instant},
+};
+
+/// Maximum number of packets sent with a single `sendmmsg` call.
+const MAX_BURST_PACKETS: usize = 64;
+
+/// Bursts are sized so that, at the configured speed, each of them takes at most this time.
+const BURST_DURATION: Duration = Duration::from_millis(1);
+
+/// Interval between adjustments of the broadcast rate.
+const RATE_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Fraction of the packets lost above which a receiver is considered congested.
+const MAX_LOSS: f64 = 0.02;
+
+/// Number of chunks waiting to be written to disk above which a receiver is considered congested.
+const MAX_BACKLOG: u32 = 32;
+
+/// Fraction of the receivers that must be congested for the broadcast rate to be decreased, so
+/// that a single slow or badly connected receiver does not throttle all the others.
+const MAX_CONGESTED_FRACTION: f64 = 0.25;
+
+/// Time after which a receiver that stopped reporting is no longer taken into account.
+const RECEIVER_TIMEOUT: Duration = Duration::from_secs(1);
+
+/// Latest report of a receiver.
+struct ReceiverState {
+    time: Instant,
+    congested: bool,
+}
+
+/// Broadcast rate of an interface, adapted to the receiver reports: it is decreased
+/// multiplicatively when more than [`MAX_CONGESTED_FRACTION`] of the receivers are congested, and
+/// increased additively otherwise, up to the configured `broadcast_speed`.
+struct RateControl {
+    /// Current rate, in bits per second.
+    rate: AtomicU64,
+    /// Latest report of each receiver.
+    receivers: Mutex<HashMap<Ipv4Addr, ReceiverState>>,
+}
+
+impl RateControl {
+    fn new(max_rate: u32) -> Self {
+        RateControl {
+            rate: AtomicU64::new(max_rate as u64),
+            receivers: Mutex::new(HashMap::new()),
+        }
+    }
+
+    fn report(&self, receiver: Ipv4Addr, received: u32, lost: u32, backlog: u32) {
+        let total = received as f64 + lost as f64;
+        let congested = lost as f64 > MAX_LOSS * total || backlog > MAX_BACKLOG;
+        let state = ReceiverState {
+            time: Instant::now(),
+            congested,
+        };
+        self.receivers
+            .lock()
+            .expect("receivers lock is poisoned")
+            .insert(receiver, state);
+    }
+
+    /// Adjusts the rate, to be called every [`RATE_INTERVAL`]; returns the new rate.
+    fn adjust(&self, max_rate: u32) -> u32 {
+        let mut receivers = self.receivers.lock().expect("receivers lock is poisoned");
+        let now = Instant::now();
+        receivers.retain(|_, state| now.duration_since(state.time) < RECEIVER_TIMEOUT);
+        let congested = receivers.values().filter(|state| state.congested).count();
+        let congested = congested as f64 > MAX_CONGESTED_FRACTION * receivers.len() as f64;
+        if congested {
+            // Each report causes at most one decrease, the next ones need new reports.
+            for state in receivers.values_mut() {
+                state.congested = false;
+            }
+        }
+        drop(receivers);
+
+        let max_rate = max_rate as u64;
+        let min_rate = (max_rate / 32).max(1);
+        let rate = self.rate.load(Ordering::Relaxed);
+        let rate = if congested {
+            rate * 3 / 4
+        } else {
+            rate + max_rate / 50
+        }
+        .clamp(min_rate, max_rate);
+        self.rate.store(rate, Ordering::Relaxed);
+        rate as u32
+    }
+}
+
+/// Counters of the packets sent by a chunk broadcaster, reset by [`report_stats`], and state of
+/// its queue.
+#[derive(Default)]
+struct BroadcastCounters {
+    packets: AtomicU64,
+    bytes: AtomicU64,
+    queued: AtomicU64,
+    demand: AtomicU64,
+}
+
+/// Sends all the `packets` to `addr`, using as few `sendmmsg` syscalls as possible.
+async fn send_burst(socket: &UdpSocket, addr: SocketAddrV4, packets: &[&[u8]]) -> Result<()> {
+    let sockaddr = libc::sockaddr_in {
+        sin_family: libc::AF_INET as libc::sa_family_t,
+        sin_port: addr.port().to_be(),
+        sin_addr: libc::in_addr {
+            s_addr: u32::from(*addr.ip()).to_be(),
+        },
+        sin_zero: [0; 8],
+    };
+
+    let mut sent = 0;
+    while sent < packets.len() {
+        let to_send = &packets[sent..];
+        let num_sent = socket
+            .async_io(Interest::WRITABLE, || {
+                let mut iovecs: Vec<_> = to_send
+                    .iter()
+                    .map(|packet| libc::iovec {
+                        iov_base: packet.as_ptr() as *mut libc::c_void,
+                        iov_len: packet.len(),
+                    })
+                    .collect();
+                let mut msgs: Vec<_> = iovecs
+                    .iter_mut()
+                    .map(|iovec| {
+                        // SAFETY: mmsghdr is a plain C struct, for which all zeroes is valid.
+                        let mut msg: libc::mmsghdr = unsafe { std::mem::zeroed() };
+                        msg.msg_hdr.msg_name = &sockaddr as *const _ as *mut libc::c_void;
+                        msg.msg_hdr.msg_namelen = size_of::<libc::sockaddr_in>() as u32;
+                        msg.msg_hdr.msg_iov = iovec;
+                        msg.msg_hdr.msg_iovlen = 1;
+                        msg
+                    })
+                    .collect();
+                // SAFETY: all the messages point to valid buffers that outlive the call.
+                let ret = unsafe {
+                    libc::sendmmsg(
+                        socket.as_raw_fd(),
+                        msgs.as_mut_ptr(),
+                        msgs.len() as libc::c_uint,
+                        0,
+                    )
+                };
+                if ret < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+                Ok(ret as usize)
+            })
+            .await?;
+        ensure!(num_sent > 0, "Could not send packet");
+        sent += num_sent;
+    }
+    Ok(())
+}
+
+/// A chunk to be broadcast, with its compressed data.
+type ChunkData = (ChunkHash, Arc<[u8]>);
+/// Chunks requested by the client with the given address.
+type ChunkRequest = (Ipv4Addr, Vec<ChunkHash>);
+
+/// Creates a socket to broadcast on the network interface `device`, bound to it so that each
+/// interface is served by its own sockets.
+fn bind_broadcast_socket(device: &str) -> Result<UdpSocket> {
+    let socket = std::net::UdpSocket::bind((Ipv4Addr::UNSPECIFIED, 0))?;
+    socket.set_broadcast(true)?;
+    // SAFETY: the option value points to `device`, which is valid for the given length.
+    let ret = unsafe {
+        libc::setsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_BINDTODEVICE,
+            device.as_ptr() as *const libc::c_void,
+            device.len() as libc::socklen_t,
+        )
+    };
+    if ret < 0 {
+        return Err(io::Error::last_os_error()).with_context(|| format!("bind socket to {device}"));
+    }
+    socket.set_nonblocking(true)?;
+    Ok(UdpSocket::from_std(socket)?)
+}
+
+/// Picks the requested chunks to broadcast on an interface, and hands each of them to all the
+/// workers of the interface.
+async fn schedule_chunks(
+    state: Arc<State>,
+    counters: Arc<BroadcastCounters>,
+    mut rx: Receiver<ChunkRequest>,
+    workers: Vec<Sender<ChunkData>>,
+) -> Result<()> {
+    let mut scheduler = Scheduler::default();
+
+    loop {
+        let get_index = async {
+            loop {
+                while let Ok((client, chunks)) = rx.try_recv() {
+                    for hash in chunks {
+                        scheduler.request(client, hash);
+                    }
+                }
+                counters
+                    .queued
+                    .store(scheduler.queued() as u64, Ordering::Relaxed);
+                counters
+                    .demand
+                    .store(scheduler.total_demand() as u64, Ordering::Relaxed);
+
+                if let Some(hash) = scheduler.pop() {
+                    return Some(hash);
+                }
+                let (client, chunks) = rx.recv().await?;
+                for hash in chunks {
+                    scheduler.request(client, hash);
+                }
+            }
+        };
+
+        let index = tokio::select! {
+            hash = get_index => {
+                let Some(hash) = hash else {
+                    break;
+                };
+                hash
+            }
+            _ = state.cancel_token.cancelled() => break,
+        };
+
+        let Some(cdata) = state
+            .get_chunk_cdata(index)
+            .with_context(|| format!("get chunk {}", hex::encode(index)))?
+        else {
+            log::warn!("Chunk {} not found", hex::encode(index));
+            continue;
+        };
+
+        for worker in &workers {
+            if worker.send((index, cdata.clone())).await.is_err() {
+                // The worker failed, its error is reported by its own task.
+                return Ok(());
+            }
+        }
+    }
+
+    Ok(())
+}
+
+/// Broadcasts the packets of shard `shard` of the chunks it receives, at its share of the rate of
+/// the interface.
+async fn send_chunks(
+    socket: UdpSocket,
+    iface: InterfaceConfig,
+    shard: usize,
+    counters: Arc<BroadcastCounters>,
+    rate_control: Arc<RateControl>,
+    mut rx: Receiver<ChunkData>,
+) -> Result<()> {
+    let shards = iface.broadcast_workers;
+    let chunks_addr = SocketAddrV4::new(iface.network.broadcast(), CHUNKS_PORT);
+    let mut write_bufs = vec![[0; UDP_BODY_LEN]; MAX_BURST_PACKETS];
+    let mut wait_for = Instant::now();
+    let mut rate = rate_control.rate.load(Ordering::Relaxed) as u32;
+    let mut next_adjust = Instant::now() + RATE_INTERVAL;
+
+    loop {
+        let (index, cdata) = match rx.try_recv() {
+            Ok(chunk) => chunk,
+            Err(_) => {
+                let Some(chunk) = rx.recv().await else {
+                    break;
+                };
+                wait_for = wait_for.max(Instant::now());
+                chunk
+            }
+        };
+
+        let mut encoder = Encoder::with_fec(&cdata, iface.fec).sharded(shard, shards);
+        for write_buf in &mut write_bufs {
+            write_buf[..32].clone_from_slice(&index);
+        }
+        loop {
+            if Instant::now() >= next_adjust {
+                // The rate is shared by all the workers, and adjusted by the first one.
+                rate = if shard == 0 {
+                    rate_control.adjust(iface.broadcast_speed)
+                } else {
+                    rate_control.rate.load(Ordering::Relaxed) as u32
+                };
+                next_adjust = Instant::now() + RATE_INTERVAL;
+            }
+            let worker_rate = (rate / shards as u32).max(1);
+            let burst_packets = (BURST_DURATION.as_secs_f64() * worker_rate as f64
+                / (8 * UDP_BODY_LEN) as f64) as usize;
+            let burst_packets = burst_packets.clamp(1, MAX_BURST_PACKETS);
+
+            let mut lens = [0; MAX_BURST_PACKETS];
+            let mut num_packets = 0;
+            while num_packets < burst_packets
+                && let Some(len) = encoder.next_packet(&mut write_bufs[num_packets][32..])
+            {
+                lens[num_packets] = 32 + len;
+                num_packets += 1;
+            }
+            if num_packets == 0 {
+                break;
+            }
+
+            let packets: Vec<&[u8]> = write_bufs
+                .iter()
+                .zip(&lens[..num_packets])
+                .map(|(buf, &len)| &buf[..len])
+                .collect();
+            let burst_len: usize = lens.iter().sum();
+
+            time::sleep_until(wait_for).await;
+            send_burst(&socket, chunks_addr, &packets).await?;
+            wait_for += 8 * (burst_len as u32) * Duration::from_secs(1) / worker_rate;
+
+            counters
+                .packets
+                .fetch_add(num_packets as u64, Ordering::Relaxed);
+            counters
+                .bytes
+                .fetch_add(burst_len as u64, Ordering::Relaxed);
+        }
+    }
+
+    Ok(())
+}
+
+/// Publishes the throughput of the chunk broadcasters and the cache statistics every second.
+async fn report_stats(
+    state: &State,
+    counters: &[Arc<BroadcastCounters>],
+    rate_controls: &[Arc<RateControl>],
+) -> Result<()> {
+    let mut interval = time::interval(Duration::from_secs(1));
+    let mut last_tick = interval.tick().await;
+    loop {
+        let tick = tokio::select! {
+            tick = interval.tick() => tick,
+            _ = state.cancel_token.cancelled() => break,
+        };
+        let elapsed = (tick - last_tick).as_secs_f64();
+        last_tick = tick;
+        let stats = counters
+            .iter()
+            .zip(rate_controls)
+            .map(|(counters, rate_control)| BroadcastStats {
+                packets_per_sec: (counters.packets.swap(0, Ordering::Relaxed) as f64 / elapsed)
+                    as u64,
+                bytes_per_sec: (counters.bytes.swap(0, Ordering::Relaxed) as f64 / elapsed) as u64,
+                rate: rate_control.rate.load(Ordering::Relaxed),
+                queued: counters.queued.load(Ordering::Relaxed),
+                demand: counters.demand.load(Ordering::Relaxed),
+            })
+            .collect();
+        state.update_server_stats(stats);
+    }
+    Ok(())
+}
+
+fn compute_hint(state: &State) -> Result<RegistrationInfo> {
+    let Some(mut last) = state.get_registration_hint() else {
+        return Ok(RegistrationInfo {
+            group: state
+                .config
+                .groups
+                .iter()
+                .next()
+                .context("there should be at least one group")?
+                .0
+                .clone(),
+            row: 1,
+            col: 1,
+            image: state
+                .config
+                .images
+                .first()
+                .context("there should be at least one image")?
+                .clone(),
+        });
+    };
+
+    let units = state.get_units(UnitSelector::Group(
+        *state.config.groups.get_by_first(&last.group).unwrap(),
+    ));
+    let positions = units
+        .into_iter()
+        .map(|unit| (unit.row, unit.col))
+        .collect::<Vec<_>>();
+
+    if last.row == 0
+        && let Some(&(r, c)) = positions.iter().max()
+    {
+        last.row = r;
+        last.col = c;
+    }
+
+    let (mrow, mcol) = positions
+        .iter()
+        .fold((0, 0), |(r1, c1), &(r2, c2)| (r1.max(r2), c1.max(c2)));
+
+    let (row, col) = match mrow {
+        0 => (1, 1),
+        1 => (1, mcol + 1),
+        _ => (last.row + last.col / mcol, last.col % mcol + 1),
+    };
+
+    Ok(RegistrationInfo {
+        group: last.group.clone(),
+        row,
+        col,
+        image: last.image.clone(),
+    })
+}
+
+async fn broadcast_hint(state: &State, socket: UdpSocket, ip: Ipv4Addr) -> Result<()> {
+    loop {
+        tokio::select! {
+            _ = time::sleep(Duration::from_secs(1)) => {}
+            _ = state.cancel_token.cancelled() => break,
+        }
+        let hint = HintPacket {
+            station: compute_hint(state)?,
+            images: state.config.images.clone(),
+            groups: state.config.groups.clone(),
+        };
+        let data = postcard::to_allocvec(&hint)?;
+        let hint_addr = SocketAddrV4::new(ip, HINT_PORT);
+        socket.send_to(&data, hint_addr).await?;
+    }
+    Ok(())
+}
+
+async fn handle_requests(
+    state: &State,
+    ingest: &Ingest,
+    socket: &UdpSocket,
+    net_tx: Vec<(Ipv4Net, Sender<ChunkRequest>)>,
+    rate_controls: &[Arc<RateControl>],
+) -> Result<()> {
+    let mut buf = [0; UDP_BODY_LEN];
+    loop {
+        let (len, peer_addr) = tokio::select! {
+            x = socket.recv_from(&mut buf) => x?,
+            _ = state.cancel_token.cancelled() => break,
+        };
+        let peer_ip = match peer_addr.ip() {
+            IpAddr::V4(ip) => ip,
+            _ => panic!(),
+        };
+        let Some(iface) = net_tx.iter().position(|(net, _)| net.contains(&peer_ip)) else {
+            continue;
+        };
+        let tx = &net_tx[iface].1;
+        let req: postcard::Result<UdpRequest> = postcard::from_bytes(&buf[..len]);
+        match req {
+            Ok(UdpRequest::Discover) => {
+                socket.send_to(&[], peer_addr).await?;
+            }
+            Ok(UdpRequest::ActionProgress(action, frac, tot)) => {
+                ingest.progress(peer_addr.ip(), action, (frac, tot));
+            }
+            Ok(UdpRequest::RequestChunks(chunks)) => {
+                tx.send((peer_ip, chunks)).await?;
+            }
+            Ok(UdpRequest::ReceiverReport {
+                received,
+                lost,
+                backlog,
+            }) => {
+                rate_controls[iface].report(peer_ip, received, lost, backlog);
+            }
+            Ok(UdpRequest::Metrics(metrics)) => match find_mac(peer_addr.ip()) {
+                Ok(peer_mac) => {
+                    let time = SystemTime::now()
+                        .duration_since(std::time::UNIX_EPOCH)
+                        .unwrap()
+                        .as_secs();
+                    state.set_unit_metrics(peer_mac, time, metrics);
+                }
+                Err(err) => {
+                    log::error!("Error handling udp packet: {err}");
+                }
+            },
+            Err(e) => {
+                log::warn!("Invalid request from {peer_addr}: {e}");
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Runs `task` on its own tokio task, so that it can make progress in parallel with the others.
+async fn spawn(task: impl Future<Output = Result<()>> + Send + 'static) -> Result<()> {
+    tokio::spawn(task).await?
+}
+
+pub async fn main(state: Arc<State>, ingest: Arc<Ingest>) -> Result<()> {
+    let (net_tx, net_rx): (_, Vec<_>) = state
+        .config
+        .hosts
+        .interfaces
+        .iter()
+        .map(|iface| {
+            let (tx, rx) = mpsc::channel(128);
+            ((iface.network, tx), (iface, rx))
+        })
+        .unzip();
+
+    let socket = UdpSocket::bind((Ipv4Addr::UNSPECIFIED, ACTION_PORT)).await?;
+    log::info!("Listening on {}", socket.local_addr()?);
+
+    let counters: Vec<Arc<BroadcastCounters>> = net_rx.iter().map(|_| Default::default()).collect();
+    let rate_controls: Vec<Arc<RateControl>> = net_rx
+        .iter()
+        .map(|(iface, _)| Arc::new(RateControl::new(iface.broadcast_speed)))
+        .collect();
+
+    let mut tasks = vec![
+        handle_requests(&state, &ingest, &socket, net_tx, &rate_controls).boxed(),
+        report_stats(&state, &counters, &rate_controls).boxed(),
+    ];
+
+    for (((iface, rx), counters), rate_control) in
+        net_rx.into_iter().zip(&counters).zip(&rate_controls)
+    {
+        let device = find_network(iface.network.addr())?.0;
+        let shards = iface.broadcast_workers;
+        ensure!(
+            shards > 0 && MAX_SHARDS.is_multiple_of(shards),
+            "broadcast_workers must be a divisor of {MAX_SHARDS}"
+        );
+        log::info!("Broadcasting on {device} with {shards} workers");
+
+        let mut workers = Vec::with_capacity(shards);
+        for shard in 0..shards {
+            let (tx, worker_rx) = mpsc::channel(1);
+            workers.push(tx);
+            let socket = bind_broadcast_socket(&device)?;
+            tasks.push(
+                spawn(send_chunks(
+                    socket,
+                    iface.clone(),
+                    shard,
+                    counters.clone(),
+                    rate_control.clone(),
+                    worker_rx,
+                ))
+                .boxed(),
+            );
+        }
+        tasks.push(
+            spawn(schedule_chunks(
+                state.clone(),
+                counters.clone(),
+                rx,
+                workers,
+            ))
+            .boxed(),
+        );
+
+        let socket = bind_broadcast_socket(&device)?;
+        tasks.push(broadcast_hint(&state, socket, iface.network.broadcast()).boxed());
+    }
+
+    futures::future::try_join_all(tasks).await?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MAX_RATE: u32 = 1_000_000_000;
+
+    fn receiver(i: u8) -> Ipv4Addr {
+        Ipv4Addr::new(10, 0, 0, i)
+    }
+
+    #[test]
+    fn test_single_congested_receiver() {
+        let rate_control = RateControl::new(MAX_RATE);
+        for _ in 0..10 {
+            rate_control.report(receiver(0), 100, 50, 100);
+            for i in 1..10 {
+                rate_control.report(receiver(i), 1000, 0, 0);
+            }
+            assert_eq!(rate_control.adjust(MAX_RATE), MAX_RATE);
+        }
+    }
+
+    #[test]
+    fn test_congested_receivers() {
+        let rate_control = RateControl::new(MAX_RATE);
+        for i in 0..10 {
+            rate_control.report(receiver(i), 100, i.into(), 0);
+        }
+        let rate = rate_control.adjust(MAX_RATE);
+        assert!(rate < MAX_RATE);
+        // The same reports are not counted twice.
+        assert!(rate_control.adjust(MAX_RATE) > rate);
+    }
+}
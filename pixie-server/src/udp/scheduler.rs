@@ -0,0 +1,90 @@
+//! Order in which the requested chunks are broadcast.
+//!
+//! Chunks requested by more clients are sent first, as a single broadcast serves all of them.
+//! To avoid starving the chunks that only a few clients still need, which are the ones holding
+//! back the stragglers, priority also grows with the time since a chunk was first requested:
+//! each additional client is worth [`CLIENT_WEIGHT`] of waiting.
+//!
+//! Clients are identified by their IP address, which is unique within an interface network and,
+//! unlike the MAC address, does not need a lookup in the DHCP leases.
+
+use pixie_shared::ChunkHash;
+use std::{
+    collections::{BTreeSet, HashMap},
+    net::Ipv4Addr,
+};
+use tokio::time::{Duration, Instant};
+
+/// Waiting time equivalent to one more client requesting a chunk.
+const CLIENT_WEIGHT: Duration = Duration::from_millis(500);
+
+struct Demand {
+    clients: BTreeSet<Ipv4Addr>,
+    /// Time of the first request, in microseconds since the start of the scheduler.
+    first_request: i64,
+}
+
+impl Demand {
+    /// Lower is sent first.
+    fn priority(&self) -> i64 {
+        self.first_request - self.clients.len() as i64 * CLIENT_WEIGHT.as_micros() as i64
+    }
+}
+
+pub struct Scheduler {
+    start: Instant,
+    demand: HashMap<ChunkHash, Demand>,
+    queue: BTreeSet<(i64, ChunkHash)>,
+    /// Sum over all the queued chunks of the number of clients requesting them.
+    total_demand: usize,
+}
+
+impl Default for Scheduler {
+    fn default() -> Self {
+        Self {
+            start: Instant::now(),
+            demand: HashMap::new(),
+            queue: BTreeSet::new(),
+            total_demand: 0,
+        }
+    }
+}
+
+impl Scheduler {
+    /// Records that `client` requested `hash`; repeated requests from the same client are ignored
+    /// until the chunk is sent.
+    pub fn request(&mut self, client: Ipv4Addr, hash: ChunkHash) {
+        let now = self.start.elapsed().as_micros() as i64;
+        let demand = self.demand.entry(hash).or_insert_with(|| Demand {
+            clients: BTreeSet::new(),
+            first_request: now,
+        });
+        let old_priority = demand.priority();
+        if !demand.clients.insert(client) {
+            return;
+        }
+        self.total_demand += 1;
+        self.queue.remove(&(old_priority, hash));
+        self.queue.insert((demand.priority(), hash));
+    }
+
+    /// Removes and returns the chunk with the highest priority.
+    pub fn pop(&mut self) -> Option<ChunkHash> {
+        let (_, hash) = self.queue.pop_first()?;
+        let demand = self
+            .demand
+            .remove(&hash)
+            .expect("every queued chunk has a demand");
+        self.total_demand -= demand.clients.len();
+        Some(hash)
+    }
+
+    /// Number of chunks waiting to be sent.
+    pub fn queued(&self) -> usize {
+        self.queue.len()
+    }
+
+    pub fn total_demand(&self) -> usize {
+        self.total_demand
+    }
+}
@@ -0,0 +1,81 @@
+//! Throughput of the chunk codec, as used by the server; run with `cargo bench --features std`, so
+//! that the xor kernel is selected at runtime as it is there.
+
+use criterion::{BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use pixie_shared::{
+    MAX_CHUNK_SIZE, UDP_BODY_LEN,
+    chunk_codec::{Decoder, Encoder, FecMode},
+};
+use std::hint::black_box;
+
+const MODES: [FecMode; 3] = [FecMode::Xor, FecMode::Rs(5), FecMode::Rs(20)];
+
+fn chunk() -> Vec<u8> {
+    let mut val = u64::MAX / 5;
+    (0..MAX_CHUNK_SIZE)
+        .map(|_| {
+            val = val.wrapping_mul(0x5DEECE66D).wrapping_add(0xB);
+            val.to_be_bytes()[0]
+        })
+        .collect()
+}
+
+fn encode(chunk: &[u8], fec: FecMode) -> Vec<Vec<u8>> {
+    let mut encoder = Encoder::with_fec(chunk, fec);
+    let mut packets = Vec::new();
+    let mut buf = [0u8; UDP_BODY_LEN];
+    while let Some(len) = encoder.next_packet(&mut buf) {
+        packets.push(buf[..len].to_vec());
+    }
+    packets
+}
+
+fn bench_encode(c: &mut Criterion) {
+    let chunk = chunk();
+    let mut group = c.benchmark_group("encode");
+    group.throughput(Throughput::Bytes(chunk.len() as u64));
+    for fec in MODES {
+        group.bench_with_input(
+            BenchmarkId::from_parameter(format!("{fec:?}")),
+            &fec,
+            |b, &fec| {
+                let mut buf = [0u8; UDP_BODY_LEN];
+                b.iter(|| {
+                    let mut encoder = Encoder::with_fec(&chunk, fec);
+                    while let Some(len) = encoder.next_packet(&mut buf) {
+                        black_box(&buf[..len]);
+                    }
+                });
+            },
+        );
+    }
+    group.finish();
+}
+
+/// Decodes a chunk after losing the first packet of each group, so that every group has to be
+/// recovered from parity.
+fn bench_decode(c: &mut Criterion) {
+    let chunk = chunk();
+    let mut group = c.benchmark_group("decode");
+    group.throughput(Throughput::Bytes(chunk.len() as u64));
+    for fec in MODES {
+        let packets = encode(&chunk, fec);
+        group.bench_with_input(
+            BenchmarkId::from_parameter(format!("{fec:?}")),
+            &fec,
+            |b, _| {
+                b.iter(|| {
+                    let mut decoder = Decoder::new(chunk.len());
+                    for packet in &packets[32..] {
+                        decoder.add_packet(packet).unwrap();
+                    }
+                    black_box(decoder.finish().unwrap());
+                });
+            },
+        );
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_encode, bench_decode);
+criterion_main!(benches);
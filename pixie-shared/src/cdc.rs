@@ -0,0 +1,177 @@
+//! Content-defined chunking, based on FastCDC.
+//!
+//! A gear rolling hash is computed over the data, and a chunk ends where enough of its top bits
+//! are zero; normalized chunking uses a stricter condition before the average size and a looser
+//! one after it. Since the hash only depends on the last 64 bytes, inserting or removing data
+//! only changes the chunks around the modification.
+//!
+//! Cut points are only considered at disk offsets multiple of [`ALIGN`]: files are moved around by
+//! filesystems in whole blocks, so this does not affect deduplication, while keeping disk reads
+//! and writes aligned.
+
+use crate::{Chunking, MAX_CHUNK_SIZE};
+
+/// Alignment of the chunk boundaries.
+pub const ALIGN: usize = 4096;
+
+const fn gear_table() -> [u64; 256] {
+    // splitmix64
+    let mut table = [0; 256];
+    let mut state: u64 = 0x5049_5849_4543_4443;
+    let mut i = 0;
+    while i < 256 {
+        state = state.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        let mut z = state;
+        z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        table[i] = z ^ (z >> 31);
+        i += 1;
+    }
+    table
+}
+
+const GEAR: [u64; 256] = gear_table();
+
+/// Mask selecting the `bits` most significant bits.
+fn mask(bits: u32) -> u64 {
+    match bits {
+        0 => 0,
+        bits => !0 << (64 - bits.min(64)),
+    }
+}
+
+impl Chunking {
+    /// Checks that the chunk sizes are consistent and not bigger than [`MAX_CHUNK_SIZE`].
+    pub fn is_valid(&self) -> bool {
+        match *self {
+            Chunking::Fixed => true,
+            Chunking::Cdc { min, avg, max } => {
+                0 < min && min <= avg && avg <= max && max <= MAX_CHUNK_SIZE
+            }
+        }
+    }
+
+    /// Returns the length of the chunk starting at the beginning of `data`, which is located at
+    /// `offset` on the disk. `data` should contain all the data up to the maximum chunk size or
+    /// to the end of the disk range being chunked.
+    pub fn cut(&self, offset: usize, data: &[u8]) -> usize {
+        let Chunking::Cdc { min, avg, max } = *self else {
+            let split = (offset + 1).next_multiple_of(MAX_CHUNK_SIZE);
+            return (split - offset).min(data.len());
+        };
+
+        let max = max.min(data.len());
+        if max <= min {
+            return max;
+        }
+
+        let bits = (avg / ALIGN).max(1).ilog2();
+        let mask_small = mask(bits + 1);
+        let mask_large = mask(bits.saturating_sub(1));
+
+        // Only the last 64 bytes affect the hash, so nothing before can influence the cut point.
+        let mut hash = 0u64;
+        for (i, &byte) in data
+            .iter()
+            .enumerate()
+            .take(max)
+            .skip(min.saturating_sub(64))
+        {
+            hash = (hash << 1).wrapping_add(GEAR[byte as usize]);
+            let len = i + 1;
+            if len < min || !(offset + len).is_multiple_of(ALIGN) {
+                continue;
+            }
+            let mask = if len < avg { mask_small } else { mask_large };
+            if hash & mask == 0 {
+                return len;
+            }
+        }
+        max
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use alloc::{vec, vec::Vec};
+
+    const CDC: Chunking = Chunking::Cdc {
+        min: 64 << 10,
+        avg: 256 << 10,
+        max: 1 << 20,
+    };
+
+    fn random_data(len: usize, seed: u64) -> Vec<u8> {
+        let mut val = seed;
+        (0..len)
+            .map(|_| {
+                val = val.wrapping_mul(0x5DEECE66D).wrapping_add(0xB);
+                val.to_be_bytes()[0]
+            })
+            .collect()
+    }
+
+    fn chunks(chunking: Chunking, offset: usize, data: &[u8]) -> Vec<(usize, usize)> {
+        let mut chunks = Vec::new();
+        let mut pos = 0;
+        while pos < data.len() {
+            let len = chunking.cut(offset + pos, &data[pos..]);
+            chunks.push((offset + pos, len));
+            pos += len;
+        }
+        chunks
+    }
+
+    #[test]
+    fn test_fixed() {
+        let data = vec![0; 3 * MAX_CHUNK_SIZE];
+        let lens: Vec<_> = chunks(Chunking::Fixed, 1000, &data)
+            .into_iter()
+            .map(|(_, len)| len)
+            .collect();
+        assert_eq!(
+            lens,
+            [MAX_CHUNK_SIZE - 1000, MAX_CHUNK_SIZE, MAX_CHUNK_SIZE, 1000]
+        );
+    }
+
+    #[test]
+    fn test_cdc_sizes() {
+        let data = random_data(16 << 20, 1);
+        let chunks = chunks(CDC, 0, &data);
+        let (_, last) = chunks[chunks.len() - 1];
+        for &(start, len) in &chunks[..chunks.len() - 1] {
+            assert!((64 << 10..=1 << 20).contains(&len), "bad chunk size {len}");
+            assert!((start + len).is_multiple_of(ALIGN));
+        }
+        assert!(last <= 1 << 20);
+        let avg = data.len() / chunks.len();
+        assert!(
+            (128 << 10..512 << 10).contains(&avg),
+            "bad average size {avg}"
+        );
+    }
+
+    #[test]
+    fn test_cdc_shift() {
+        let data = random_data(16 << 20, 2);
+        let mut shifted = random_data(3 * ALIGN, 3);
+        shifted.extend_from_slice(&data);
+
+        let hashes = |data: &[u8]| -> Vec<_> {
+            chunks(CDC, 0, data)
+                .into_iter()
+                .map(|(start, len)| blake3::hash(&data[start..start + len]))
+                .collect()
+        };
+        let original = hashes(&data);
+        let shifted = hashes(&shifted);
+        let common = original.iter().filter(|h| shifted.contains(h)).count();
+        assert!(
+            common + 2 >= original.len(),
+            "only {common} of {} chunks are preserved",
+            original.len()
+        );
+    }
+}
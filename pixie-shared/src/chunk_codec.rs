@@ -1,5 +1,22 @@
+//! Forward error correction for chunks broadcast over udp.
+//!
+//! A chunk is split in packets of [`BODY_LEN`] bytes, which are interleaved in 32 groups (packet
+//! `i` belongs to group `i & 31`). For every group the encoder emits one or more parity packets
+//! after the data packets, so that a receiver can rebuild a group as soon as it has received as
+//! many packets of that group (data or parity) as there are data packets in it.
+//!
+//! Parity packets are computed with a systematic Reed-Solomon code over GF(2^8), built from a
+//! Cauchy matrix normalized so that the first parity packet of each group is the plain xor of its
+//! data packets.
+//!
+//! Each packet starts with a 2-byte little-endian index: data packets use their position in the
+//! chunk, while parity packet `row` of group `group` uses `group - 32 * (row + 1)` (mod 2^16).
+//! The decoder thus needs no out-of-band information about the amount of redundancy used by the
+//! sender.
+
 use crate::UDP_BODY_LEN;
 use alloc::{vec, vec::Vec};
+use serde::{Deserialize, Serialize};
 use thiserror::Error;
 
 const PACKET_LEN: usize = UDP_BODY_LEN - 32;
@@ -9,6 +26,235 @@ const BODY_LEN: usize = PACKET_LEN - HEADER_LEN;
 const MIN_SIZE: usize = HEADER_LEN;
 const MAX_SIZE: usize = PACKET_LEN;
 
+/// Number of groups in which packets are interleaved.
+const GROUPS: usize = 32;
+
+/// The number of shards of a sharded [`Encoder`] must divide this, so that all the data packets
+/// of a group are sent by the same shard and the decoder can estimate the losses of each group.
+pub const MAX_SHARDS: usize = GROUPS;
+
+/// Reed-Solomon codes over GF(2^8) support at most this many packets (data and parity) per group.
+const MAX_GROUP_PACKETS: usize = 256;
+
+/// Forward error correction scheme used when broadcasting chunks.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum FecMode {
+    /// One xor parity packet for each group of interleaved packets.
+    #[default]
+    Xor,
+    /// Reed-Solomon parity packets; the value is the redundancy as a percentage of the number of
+    /// data packets in each group.
+    Rs(u8),
+}
+
+const fn gf_tables() -> ([u8; 512], [u8; 256]) {
+    let mut exp = [0; 512];
+    let mut log = [0; 256];
+    let mut x: u16 = 1;
+    let mut i = 0;
+    while i < 255 {
+        exp[i] = x as u8;
+        exp[i + 255] = x as u8;
+        log[x as usize] = i as u8;
+        x <<= 1;
+        if x & 0x100 != 0 {
+            x ^= 0x11D;
+        }
+        i += 1;
+    }
+    (exp, log)
+}
+
+const GF_EXP: [u8; 512] = gf_tables().0;
+const GF_LOG: [u8; 256] = gf_tables().1;
+
+const fn gf_mul_table() -> [[u8; 256]; 256] {
+    let mut table = [[0; 256]; 256];
+    let mut a = 1;
+    while a < 256 {
+        let mut b = 1;
+        while b < 256 {
+            table[a][b] = GF_EXP[GF_LOG[a] as usize + GF_LOG[b] as usize];
+            b += 1;
+        }
+        a += 1;
+    }
+    table
+}
+
+/// Products in GF(2^8): row `c` is the multiplication table by `c`, as used by [`mul_add`].
+static GF_MUL: [[u8; 256]; 256] = gf_mul_table();
+
+fn gf_mul(a: u8, b: u8) -> u8 {
+    if a == 0 || b == 0 {
+        0
+    } else {
+        GF_EXP[GF_LOG[a as usize] as usize + GF_LOG[b as usize] as usize]
+    }
+}
+
+fn gf_inv(a: u8) -> u8 {
+    debug_assert_ne!(a, 0);
+    GF_EXP[255 - GF_LOG[a as usize] as usize]
+}
+
+/// Coefficient of the `col`-th data packet of a group in its `row`-th parity packet.
+///
+/// This is the Cauchy matrix `1 / (x_row + y_col)` with `x_row = 255 - row` and `y_col = col`,
+/// with each column scaled so that row 0 is made of ones. It is MDS as long as the number of data
+/// and parity packets in the group does not exceed [`MAX_GROUP_PACKETS`].
+fn coefficient(row: usize, col: usize) -> u8 {
+    if row == 0 {
+        return 1;
+    }
+    let col = col as u8;
+    gf_mul(255 ^ col, gf_inv((255 - row as u8) ^ col))
+}
+
+/// `dst ^= src`, using the widest vector instructions available.
+///
+/// AVX2 is detected at runtime, which needs `std`; SSE2 is used when it is enabled at compile
+/// time, as on every std x86_64 target. Without `std` the portable version is used on the UEFI
+/// target, whose ABI has SSE disabled: enabling it with `#[target_feature]` is not sound there.
+fn xor(dst: &mut [u8], src: &[u8]) {
+    let len = dst.len().min(src.len());
+    let (dst, src) = (&mut dst[..len], &src[..len]);
+
+    #[cfg(all(target_arch = "x86_64", feature = "std"))]
+    if std::is_x86_feature_detected!("avx2") {
+        // SAFETY: avx2 support was just checked.
+        return unsafe { xor_avx2(dst, src) };
+    }
+
+    #[cfg(all(target_arch = "x86_64", target_feature = "sse2"))]
+    {
+        // SAFETY: sse2 is enabled at compile time.
+        unsafe { xor_sse2(dst, src) }
+    }
+
+    #[cfg(not(all(target_arch = "x86_64", target_feature = "sse2")))]
+    xor_words(dst, src);
+}
+
+/// Portable fallback of [`xor`] working on 8 bytes at a time.
+#[cfg_attr(all(target_arch = "x86_64", target_feature = "sse2"), allow(dead_code))]
+fn xor_words(dst: &mut [u8], src: &[u8]) {
+    let mut dst_words = dst.chunks_exact_mut(8);
+    let mut src_words = src.chunks_exact(8);
+    for (a, b) in (&mut dst_words).zip(&mut src_words) {
+        let x = u64::from_ne_bytes((*a).try_into().unwrap());
+        let y = u64::from_ne_bytes(b.try_into().unwrap());
+        a.copy_from_slice(&(x ^ y).to_ne_bytes());
+    }
+    xor_tail(dst_words.into_remainder(), src_words.remainder());
+}
+
+fn xor_tail(dst: &mut [u8], src: &[u8]) {
+    dst.iter_mut().zip(src).for_each(|(a, b)| *a ^= *b);
+}
+
+#[cfg(all(target_arch = "x86_64", target_feature = "sse2"))]
+#[target_feature(enable = "sse2")]
+unsafe fn xor_sse2(dst: &mut [u8], src: &[u8]) {
+    use core::arch::x86_64::{__m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_xor_si128};
+
+    let mut dst_blocks = dst.chunks_exact_mut(16);
+    let mut src_blocks = src.chunks_exact(16);
+    for (a, b) in (&mut dst_blocks).zip(&mut src_blocks) {
+        let a = a.as_mut_ptr() as *mut __m128i;
+        let b = b.as_ptr() as *const __m128i;
+        // SAFETY: both blocks are 16 bytes long, and unaligned loads and stores are used.
+        unsafe { _mm_storeu_si128(a, _mm_xor_si128(_mm_loadu_si128(a), _mm_loadu_si128(b))) };
+    }
+    xor_tail(dst_blocks.into_remainder(), src_blocks.remainder());
+}
+
+#[cfg(all(target_arch = "x86_64", feature = "std"))]
+#[target_feature(enable = "avx2")]
+unsafe fn xor_avx2(dst: &mut [u8], src: &[u8]) {
+    use core::arch::x86_64::{__m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_xor_si256};
+
+    let mut dst_blocks = dst.chunks_exact_mut(32);
+    let mut src_blocks = src.chunks_exact(32);
+    for (a, b) in (&mut dst_blocks).zip(&mut src_blocks) {
+        let a = a.as_mut_ptr() as *mut __m256i;
+        let b = b.as_ptr() as *const __m256i;
+        // SAFETY: both blocks are 32 bytes long, and unaligned loads and stores are used.
+        unsafe {
+            _mm256_storeu_si256(
+                a,
+                _mm256_xor_si256(_mm256_loadu_si256(a), _mm256_loadu_si256(b)),
+            )
+        };
+    }
+    xor_tail(dst_blocks.into_remainder(), src_blocks.remainder());
+}
+
+/// `dst ^= c * src`, element-wise in GF(2^8).
+fn mul_add(dst: &mut [u8], src: &[u8], c: u8) {
+    match c {
+        0 => {}
+        1 => xor(dst, src),
+        c => {
+            let table = &GF_MUL[c as usize];
+            dst.iter_mut()
+                .zip(src)
+                .for_each(|(a, b)| *a ^= table[*b as usize]);
+        }
+    }
+}
+
+/// Inverts the `n * n` row-major matrix `a` over GF(2^8).
+fn invert(mut a: Vec<u8>, n: usize) -> Vec<u8> {
+    let mut inv = vec![0; n * n];
+    for i in 0..n {
+        inv[i * n + i] = 1;
+    }
+    for col in 0..n {
+        let pivot = (col..n)
+            .find(|&row| a[row * n + col] != 0)
+            .expect("parity matrix should be invertible");
+        for i in 0..n {
+            a.swap(pivot * n + i, col * n + i);
+            inv.swap(pivot * n + i, col * n + i);
+        }
+        let f = gf_inv(a[col * n + col]);
+        for i in 0..n {
+            a[col * n + i] = gf_mul(a[col * n + i], f);
+            inv[col * n + i] = gf_mul(inv[col * n + i], f);
+        }
+        for row in 0..n {
+            let f = a[row * n + col];
+            if row == col || f == 0 {
+                continue;
+            }
+            for i in 0..n {
+                a[row * n + i] ^= gf_mul(a[col * n + i], f);
+                inv[row * n + i] ^= gf_mul(inv[col * n + i], f);
+            }
+        }
+    }
+    inv
+}
+
+/// Number of data packets in each group for a chunk of `num_packets` packets.
+fn group_len(num_packets: usize, group: usize) -> usize {
+    (num_packets + GROUPS - 1 - group) / GROUPS
+}
+
+/// Packet index of the `row`-th parity packet of `group`.
+fn parity_index(row: usize, group: usize) -> u16 {
+    (group as u16).wrapping_sub((GROUPS * (row + 1)) as u16)
+}
+
+/// Inverse of [`parity_index`]: returns `(row, group)`.
+fn parity_row_group(index: u16) -> (usize, usize) {
+    let neg = 0x10000 - index as usize;
+    let row = (neg - 1) / GROUPS;
+    (row, GROUPS * (row + 1) - neg)
+}
+
 #[derive(Error, Debug)]
 pub enum DecoderError {
     #[error("Packet too small; got {0} bytes, expected at least {MIN_SIZE} bytes")]
@@ -19,33 +265,129 @@ pub enum DecoderError {
     InvalidIndex(u16),
 }
 
+/// Decoder of a single chunk.
+///
+/// Decoders can be reused for other chunks with [`Decoder::reset`], keeping their allocations;
+/// the packet data can be moved out with [`Decoder::spill`] when memory is tight, and put back
+/// with [`Decoder::restore`] before adding more packets.
 pub struct Decoder {
+    size: usize,
+    num_packets: usize,
     data: Vec<u8>,
-    missing_packet: Vec<bool>,
-    missing_packets_per_group: [u16; 32],
+    spilled: bool,
+    /// Bitset of the data packets not received yet.
+    missing_packet: Vec<u64>,
+    /// Number of packets (data or parity) still needed to recover each group.
+    missing_packets_per_group: [u16; GROUPS],
     missing_groups: u16,
+    /// Parity packets received for groups that were not complete yet.
+    parity: Vec<(u16, Vec<u8>)>,
+    /// Whether the chunk was already returned by [`Decoder::finish`].
+    finished: bool,
+    /// Index of the last data packet received in each group.
+    last_index: [Option<u16>; GROUPS],
+    lost_packets: usize,
 }
 
 impl Decoder {
     pub fn new(size: usize) -> Self {
+        let mut decoder = Decoder {
+            size: 0,
+            num_packets: 0,
+            data: Vec::new(),
+            spilled: false,
+            missing_packet: Vec::new(),
+            missing_packets_per_group: [0; GROUPS],
+            missing_groups: 0,
+            parity: Vec::new(),
+            finished: false,
+            last_index: [None; GROUPS],
+            lost_packets: 0,
+        };
+        decoder.reset(size);
+        decoder
+    }
+
+    /// Prepares the decoder for a new chunk of `size` bytes.
+    pub fn reset(&mut self, size: usize) {
         let num_packets = size.div_ceil(BODY_LEN);
-        let data = vec![0; 32 * BODY_LEN + size];
-        let missing_packet = vec![true; 32 + num_packets];
-        let missing_packets_per_group: [u16; 32] = (0..32)
-            .map(|i| ((num_packets + 31 - i) / 32) as u16)
-            .collect::<Vec<_>>()
-            .try_into()
-            .unwrap();
-        let missing_groups = missing_packets_per_group
+        self.size = size;
+        self.num_packets = num_packets;
+        self.data.clear();
+        self.data.resize(num_packets * BODY_LEN, 0);
+        self.spilled = false;
+        self.missing_packet.clear();
+        self.missing_packet.resize(num_packets.div_ceil(64), !0);
+        if !num_packets.is_multiple_of(64) {
+            *self.missing_packet.last_mut().unwrap() = (1 << (num_packets % 64)) - 1;
+        }
+        self.parity.clear();
+        self.finished = false;
+        self.last_index = [None; GROUPS];
+        self.lost_packets = 0;
+        self.count_missing();
+    }
+
+    fn is_missing(&self, index: usize) -> bool {
+        self.missing_packet[index / 64] & (1 << (index % 64)) != 0
+    }
+
+    fn set_received(&mut self, index: usize) {
+        self.missing_packet[index / 64] &= !(1 << (index % 64));
+    }
+
+    /// Computes the number of packets needed by each group from the missing data packets,
+    /// ignoring the parity packets.
+    fn count_missing(&mut self) {
+        self.missing_packets_per_group = [0; GROUPS];
+        for (word_index, &word) in self.missing_packet.iter().enumerate() {
+            let mut word = word;
+            while word != 0 {
+                let index = word_index * 64 + word.trailing_zeros() as usize;
+                self.missing_packets_per_group[index & (GROUPS - 1)] += 1;
+                word &= word - 1;
+            }
+        }
+        self.missing_groups = self
+            .missing_packets_per_group
             .iter()
             .map(|&x| (x != 0) as u16)
             .sum();
-        Decoder {
-            data,
-            missing_packet,
-            missing_packets_per_group,
-            missing_groups,
-        }
+    }
+
+    /// Size of the buffer holding the packet data, as returned by [`Decoder::spill`].
+    pub fn buffer_len(&self) -> usize {
+        self.num_packets * BODY_LEN
+    }
+
+    pub fn is_spilled(&self) -> bool {
+        self.spilled
+    }
+
+    /// Moves the data of the packets received so far out of the decoder, only keeping track of
+    /// which data packets were received. Parity packets are dropped.
+    pub fn spill(&mut self) -> Vec<u8> {
+        assert!(!self.spilled, "decoder already spilled");
+        self.spilled = true;
+        self.parity = Vec::new();
+        self.count_missing();
+        core::mem::take(&mut self.data)
+    }
+
+    /// Gives back to the decoder the buffer returned by [`Decoder::spill`].
+    pub fn restore(&mut self, data: Vec<u8>) {
+        assert!(self.spilled, "decoder not spilled");
+        assert_eq!(data.len(), self.buffer_len());
+        self.data = data;
+        self.spilled = false;
+    }
+
+    /// Estimate of the number of packets lost so far, as the data packets of each group are sent in
+    /// order: this is the number of data packets skipped between two consecutive received ones of
+    /// the same group. Packets of different groups may be reordered, as happens with a sharded
+    /// [`Encoder`].
+    pub fn lost_packets(&self) -> usize {
+        self.lost_packets
     }
 
     pub fn add_packet(&mut self, buf: &[u8]) -> Result<(), DecoderError> {
@@ -56,23 +398,45 @@ impl Decoder {
             return Err(DecoderError::PacketTooBig(buf.len()));
         }
 
+        assert!(!self.spilled, "packet added to a spilled decoder");
+
         let index = u16::from_le_bytes(buf[..2].try_into().unwrap());
+        let num_packets = self.num_packets;
 
-        let rot_index = index.wrapping_add(32) as usize;
-        let missing = self
-            .missing_packet
-            .get_mut(rot_index)
-            .ok_or(DecoderError::InvalidIndex(index))?;
-        match missing {
-            false => return Ok(()),
-            x @ true => *x = false,
-        }
+        let group = if (index as usize) < num_packets {
+            let last_index = &mut self.last_index[index as usize & (GROUPS - 1)];
+            if let Some(last) = *last_index
+                && index > last
+            {
+                self.lost_packets += (index - last) as usize / GROUPS - 1;
+            }
+            *last_index = Some(index);
+            let index = index as usize;
 
-        let start = rot_index * BODY_LEN;
-        self.data[start..start + buf.len() - 2].clone_from_slice(&buf[2..]);
+            if !self.is_missing(index) {
+                return Ok(());
+            }
+            self.set_received(index);
 
-        let group = index & 31;
-        match &mut self.missing_packets_per_group[group as usize] {
+            let start = index * BODY_LEN;
+            self.data[start..start + buf.len() - 2].clone_from_slice(&buf[2..]);
+            index & (GROUPS - 1)
+        } else {
+            let (row, group) = parity_row_group(index);
+            let len = group_len(num_packets, group);
+            if len == 0 || (row > 0 && len + row >= MAX_GROUP_PACKETS) {
+                return Err(DecoderError::InvalidIndex(index));
+            }
+            if self.missing_packets_per_group[group] == 0
+                || self.parity.iter().any(|(i, _)| *i == index)
+            {
+                return Ok(());
+            }
+            self.parity.push((index, buf[2..].to_vec()));
+            group
+        };
+
+        match &mut self.missing_packets_per_group[group] {
             0 => return Ok(()),
             x @ 1 => *x = 0,
             x @ 2.. => {
@@ -89,48 +453,142 @@ impl Decoder {
         Ok(())
     }
 
+    /// Returns the chunk if enough packets have been received to rebuild it.
+    ///
+    /// The decoded buffer is moved out of the decoder, which should be reset or dropped
+    /// afterwards: later calls return `None`.
     pub fn finish(&mut self) -> Option<Vec<u8>> {
-        if self.missing_groups != 0 {
+        if self.spilled || self.finished || self.missing_groups != 0 {
             return None;
         }
+        self.finished = true;
 
-        let mut xor = [[0; BODY_LEN]; 32];
-        for packet in 0..self.missing_packet.len() {
-            if !self.missing_packet[packet] {
-                let group = packet & 31;
-                self.data[BODY_LEN * packet..]
-                    .iter()
-                    .zip(xor[group].iter_mut())
-                    .for_each(|(a, b)| *b ^= a);
+        let num_packets = self.num_packets;
+        for group in 0..num_packets.min(GROUPS) {
+            let missing: Vec<_> = (group..num_packets)
+                .step_by(GROUPS)
+                .filter(|&packet| self.is_missing(packet))
+                .collect();
+            if missing.is_empty() {
+                continue;
             }
-        }
-        for packet in 0..self.missing_packet.len() {
-            if self.missing_packet[packet] {
-                let group = packet & 31;
-                self.data[BODY_LEN * packet..]
-                    .iter_mut()
-                    .zip(xor[group].iter())
-                    .for_each(|(a, b)| *a = *b);
+            let parity: Vec<_> = self
+                .parity
+                .iter()
+                .filter_map(|(index, body)| {
+                    let (row, g) = parity_row_group(*index);
+                    (g == group).then_some((row, body))
+                })
+                .take(missing.len())
+                .collect();
+            let n = missing.len();
+            assert_eq!(parity.len(), n, "not enough parity packets");
+
+            // Remove the contribution of the received data packets from the parity packets.
+            let mut syndromes = vec![0; n * BODY_LEN];
+            for ((row, body), syndrome) in parity.iter().zip(syndromes.chunks_exact_mut(BODY_LEN)) {
+                syndrome[..body.len()].copy_from_slice(body);
+                for packet in (group..num_packets).step_by(GROUPS) {
+                    if !self.is_missing(packet) {
+                        let start = packet * BODY_LEN;
+                        let c = coefficient(*row, packet / GROUPS);
+                        mul_add(syndrome, &self.data[start..start + BODY_LEN], c);
+                    }
+                }
+            }
+
+            let matrix = parity
+                .iter()
+                .flat_map(|(row, _)| missing.iter().map(|p| coefficient(*row, p / GROUPS)))
+                .collect();
+            let inv = invert(matrix, n);
+
+            for (i, &packet) in missing.iter().enumerate() {
+                let start = packet * BODY_LEN;
+                let out = &mut self.data[start..start + BODY_LEN];
+                for (j, syndrome) in syndromes.chunks_exact(BODY_LEN).enumerate() {
+                    mul_add(out, syndrome, inv[i * n + j]);
+                }
+                self.set_received(packet);
             }
         }
-        Some(self.data[32 * BODY_LEN..].to_vec())
+        let mut data = core::mem::take(&mut self.data);
+        data.truncate(self.size);
+        Some(data)
     }
 }
 
-pub struct Encoder {
-    data: Vec<u8>,
+pub struct Encoder<'a> {
+    data: &'a [u8],
     groups: usize,
+    parity: usize,
     idx: usize,
+    parity_idx: usize,
+    /// Number of packets to skip after each emitted one, see [`Encoder::sharded`].
+    stride: usize,
+    /// Number of packets to skip before the next emitted one.
+    skip: usize,
 }
 
-impl Encoder {
-    pub fn new(data: Vec<u8>) -> Self {
-        let idx = 0;
-        let groups = data.len().div_ceil(BODY_LEN).min(32);
-        Encoder { data, groups, idx }
+impl<'a> Encoder<'a> {
+    /// Creates an encoder that emits one xor parity packet per group.
+    pub fn new(data: &'a [u8]) -> Self {
+        Self::with_fec(data, FecMode::Xor)
+    }
+
+    /// Creates an encoder that emits parity packets according to `fec`.
+    pub fn with_fec(data: &'a [u8], fec: FecMode) -> Self {
+        let num_packets = data.len().div_ceil(BODY_LEN);
+        let groups = num_packets.min(GROUPS);
+        let max_len = group_len(num_packets, 0);
+        let parity = match fec {
+            FecMode::Xor => 1,
+            FecMode::Rs(redundancy) => (max_len * redundancy as usize)
+                .div_ceil(100)
+                .clamp(1, MAX_GROUP_PACKETS.saturating_sub(max_len).max(1)),
+        };
+        Encoder {
+            data,
+            groups,
+            parity,
+            idx: 0,
+            parity_idx: 0,
+            stride: 0,
+            skip: 0,
+        }
+    }
+
+    /// Makes the encoder only emit the packets whose position in the stream is `shard` modulo
+    /// `shards`, so that `shards` encoders of the same chunk emit all its packets between them.
+    /// Skipped parity packets are not computed. `shards` must divide [`MAX_SHARDS`].
+    pub fn sharded(mut self, shard: usize, shards: usize) -> Self {
+        assert!(shard < shards, "invalid shard {shard} of {shards}");
+        assert!(
+            MAX_SHARDS.is_multiple_of(shards),
+            "{shards} shards do not divide {MAX_SHARDS}"
+        );
+        self.stride = shards - 1;
+        self.skip = shard;
+        self
+    }
+
+    /// Moves past the next packet without emitting it; returns `None` at the end of the stream.
+    fn skip_packet(&mut self) -> Option<()> {
+        if self.idx * BODY_LEN < self.data.len() {
+            self.idx += 1;
+        } else if self.parity_idx < self.parity * self.groups {
+            self.parity_idx += 1;
+        } else {
+            return None;
+        }
+        Some(())
     }
 
     pub fn next_packet(&mut self, out_buf: &mut [u8]) -> Option<usize> {
+        for _ in 0..self.skip {
+            self.skip_packet()?;
+        }
+        self.skip = self.stride;
         let start = self.idx * BODY_LEN;
         if start < self.data.len() {
             let end = self.data.len().min(start + BODY_LEN);
@@ -139,21 +597,26 @@ impl Encoder {
             out_buf[2..2 + len].copy_from_slice(&self.data[start..end]);
             self.idx += 1;
             Some(2 + len)
-        } else if self.groups > 0 {
-            self.groups -= 1;
-            out_buf[0..2].copy_from_slice(&(self.groups as u16).wrapping_sub(32).to_le_bytes());
-            out_buf[2..].fill(0);
+        } else if self.parity_idx < self.parity * self.groups {
+            let row = self.parity_idx / self.groups;
+            let group = self.groups - 1 - self.parity_idx % self.groups;
+            self.parity_idx += 1;
+            let len = BODY_LEN.min(self.data.len() - group * BODY_LEN);
+            out_buf[0..2].copy_from_slice(&parity_index(row, group).to_le_bytes());
+            out_buf[2..2 + len].fill(0);
             (0..)
-                .map(|x| (x * 32 + self.groups) * BODY_LEN)
+                .map(|x| (x * GROUPS + group) * BODY_LEN)
                 .take_while(|x| *x < self.data.len())
-                .for_each(|start| {
+                .enumerate()
+                .for_each(|(col, start)| {
                     let end = self.data.len().min(start + BODY_LEN);
-                    out_buf[2..2 + end - start]
-                        .iter_mut()
-                        .zip(self.data[start..end].iter())
-                        .for_each(|(a, b)| *a ^= *b);
+                    mul_add(
+                        &mut out_buf[2..2 + end - start],
+                        &self.data[start..end],
+                        coefficient(row, col),
+                    );
                 });
-            Some(2 + BODY_LEN.min(self.data.len() - self.groups * BODY_LEN))
+            Some(2 + len)
         } else {
             None
         }
@@ -165,13 +628,28 @@ mod tests {
     use super::*;
     use crate::UDP_BODY_LEN;
 
-    fn test_chunk_skip_packet(chunk: &[u8]) {
-        let mut encoder = Encoder::new(chunk.to_vec());
+    fn encode(chunk: &[u8], fec: FecMode) -> Vec<Vec<u8>> {
+        let mut encoder = Encoder::with_fec(chunk, fec);
         let mut packets = Vec::new();
         let mut buf = [0u8; UDP_BODY_LEN];
         while let Some(len) = encoder.next_packet(&mut buf) {
             packets.push(buf[..len].to_vec());
         }
+        packets
+    }
+
+    fn random_chunk(len: usize) -> Vec<u8> {
+        let mut chunk = vec![0u8; len];
+        let mut val = u64::MAX / 5;
+        for x in &mut chunk {
+            val = val.wrapping_mul(0x5DEECE66D).wrapping_add(0xB);
+            *x = val.to_be_bytes()[0];
+        }
+        chunk
+    }
+
+    fn test_chunk_skip_packet(chunk: &[u8]) {
+        let mut packets = encode(chunk, FecMode::Xor);
 
         packets.sort_by_key(|p| {
             p.iter().take(6).fold(0u64, |acc, &x| {
@@ -201,27 +679,188 @@ mod tests {
         }
         let decoded = decoder.finish().expect("Failed to decode chunk");
         assert_eq!(decoded, chunk, "Failed to decode chunk with multiple skips");
+        assert!(decoder.finish().is_none());
+    }
+
+    /// Drops bursts of `burst` consecutive packets every `period` packets.
+    fn test_chunk_bursts(chunk: &[u8], fec: FecMode, burst: usize, period: usize) {
+        let packets = encode(chunk, fec);
+        let mut decoder = Decoder::new(chunk.len());
+        for (idx, packet) in packets.iter().enumerate() {
+            if idx % period >= burst {
+                decoder.add_packet(packet).expect("Failed to add packet");
+            }
+        }
+        let decoded = decoder.finish().expect("Failed to decode chunk");
+        assert_eq!(
+            decoded, chunk,
+            "Failed to decode chunk with bursts of {burst}"
+        );
     }
 
     #[test]
     fn test_small_chunk() {
-        let mut chunk = vec![0u8; 20];
-        let mut val = u64::MAX / 5;
-        for x in &mut chunk {
-            val = val.wrapping_mul(0x5DEECE66D).wrapping_add(0xB);
-            *x = val.to_be_bytes()[0];
-        }
-        test_chunk_skip_packet(&chunk);
+        test_chunk_skip_packet(&random_chunk(20));
     }
 
     #[test]
     fn test_big_chunk() {
-        let mut chunk = vec![0u8; 200 << 10];
-        let mut val = u64::MAX / 5;
-        for x in &mut chunk {
-            val = val.wrapping_mul(0x5DEECE66D).wrapping_add(0xB);
-            *x = val.to_be_bytes()[0];
+        test_chunk_skip_packet(&random_chunk(200 << 10));
+    }
+
+    #[test]
+    fn test_rs_bursts() {
+        let chunk = random_chunk(1 << 20);
+        // ~24 data packets and 5 parity packets per group: a burst of 5 * 32 consecutive packets
+        // loses 5 packets from each group.
+        test_chunk_bursts(&chunk, FecMode::Rs(20), 160, 2048);
+        test_chunk_bursts(&chunk, FecMode::Xor, 32, 2048);
+    }
+
+    #[test]
+    fn test_sharded() {
+        let chunk = random_chunk(300 << 10);
+        let fec = FecMode::Rs(10);
+        let packets = encode(&chunk, fec);
+        let shards = 8;
+        let mut sharded = vec![Vec::new(); packets.len()];
+        for shard in 0..shards {
+            let mut encoder = Encoder::with_fec(&chunk, fec).sharded(shard, shards);
+            let mut buf = [0u8; UDP_BODY_LEN];
+            let mut idx = shard;
+            while let Some(len) = encoder.next_packet(&mut buf) {
+                sharded[idx] = buf[..len].to_vec();
+                idx += shards;
+            }
+            assert!(idx >= packets.len(), "shard {shard} stopped early");
+        }
+        assert_eq!(sharded, packets);
+    }
+
+    #[test]
+    fn test_rs_parity_only() {
+        let chunk = random_chunk(100 << 10);
+        let packets = encode(&chunk, FecMode::Rs(100));
+        let num_data = chunk.len().div_ceil(BODY_LEN);
+        let mut decoder = Decoder::new(chunk.len());
+        // Only parity packets, plus the data packets of the groups having fewer parity packets.
+        for packet in &packets[num_data..] {
+            decoder.add_packet(packet).expect("Failed to add packet");
         }
-        test_chunk_skip_packet(&chunk);
+        let mut data_packets = packets[..num_data].iter();
+        let decoded = loop {
+            if let Some(decoded) = decoder.finish() {
+                break decoded;
+            }
+            let packet = data_packets.next().expect("Failed to decode chunk");
+            decoder.add_packet(packet).expect("Failed to add packet");
+        };
+        assert_eq!(decoded, chunk);
+    }
+
+    /// Number of data packets missing between two received ones of the same group.
+    fn skipped_packets(num_data: usize, received: impl Fn(usize) -> bool) -> usize {
+        (0..GROUPS)
+            .map(|group| {
+                let indices: Vec<_> = (group..num_data).step_by(GROUPS).collect();
+                let first = indices.iter().position(|&idx| received(idx));
+                let last = indices.iter().rposition(|&idx| received(idx));
+                match (first, last) {
+                    (Some(first), Some(last)) => indices[first..last]
+                        .iter()
+                        .filter(|&&idx| !received(idx))
+                        .count(),
+                    _ => 0,
+                }
+            })
+            .sum()
+    }
+
+    #[test]
+    fn test_lost_packets() {
+        let chunk = random_chunk(400 << 10);
+        let packets = encode(&chunk, FecMode::Xor);
+        let mut decoder = Decoder::new(chunk.len());
+        // Starting in the middle of a chunk does not count as a loss.
+        for (idx, packet) in packets.iter().enumerate().skip(10) {
+            if !idx.is_multiple_of(7) {
+                decoder.add_packet(packet).expect("Failed to add packet");
+            }
+        }
+        let num_data = chunk.len().div_ceil(BODY_LEN);
+        let skipped = skipped_packets(num_data, |idx| idx >= 10 && !idx.is_multiple_of(7));
+        assert!(skipped > 0);
+        assert_eq!(decoder.lost_packets(), skipped);
+    }
+
+    #[test]
+    fn test_sharded_lost_packets() {
+        let chunk = random_chunk(300 << 10);
+        let num_data = chunk.len().div_ceil(BODY_LEN);
+        let shards = 4;
+        let received = |idx: usize| idx % 5 != 2;
+        // The shards are fed one after the other, the worst case of workers drifting apart.
+        for lossy in [false, true] {
+            let mut decoder = Decoder::new(chunk.len());
+            for shard in 0..shards {
+                let mut encoder = Encoder::with_fec(&chunk, FecMode::Rs(20)).sharded(shard, shards);
+                let mut buf = [0u8; UDP_BODY_LEN];
+                while let Some(len) = encoder.next_packet(&mut buf) {
+                    let index = u16::from_le_bytes([buf[0], buf[1]]) as usize;
+                    if !lossy || index >= num_data || received(index) {
+                        decoder
+                            .add_packet(&buf[..len])
+                            .expect("Failed to add packet");
+                    }
+                }
+            }
+            let expected = if lossy {
+                skipped_packets(num_data, received)
+            } else {
+                0
+            };
+            assert_eq!(decoder.lost_packets(), expected);
+            assert_eq!(decoder.finish().expect("Failed to decode chunk"), chunk);
+        }
+    }
+
+    #[test]
+    fn test_rs_invalid_index() {
+        let mut decoder = Decoder::new(3 * BODY_LEN);
+        assert!(matches!(
+            decoder.add_packet(&parity_index(0, 5).to_le_bytes()),
+            Err(DecoderError::InvalidIndex(_))
+        ));
+    }
+
+    #[test]
+    fn test_spill() {
+        let chunk = random_chunk(200 << 10);
+        let packets = encode(&chunk, FecMode::Rs(20));
+        let mut decoder = Decoder::new(1000);
+        decoder.reset(chunk.len());
+        // Parity packets received before spilling are lost, so the first loss of each group must
+        // be recovered with those received afterwards.
+        let (before, after) = packets.split_at(packets.len() / 2);
+        for (idx, packet) in before.iter().enumerate() {
+            if idx % 50 != 3 {
+                decoder.add_packet(packet).expect("Failed to add packet");
+            }
+        }
+        let data = decoder.spill();
+        assert_eq!(data.len(), decoder.buffer_len());
+        assert!(decoder.finish().is_none());
+        decoder.restore(data);
+        let mut after = after.iter().enumerate();
+        let decoded = loop {
+            if let Some(decoded) = decoder.finish() {
+                break decoded;
+            }
+            let (idx, packet) = after.next().expect("Failed to decode chunk");
+            if idx % 50 != 3 {
+                decoder.add_packet(packet).expect("Failed to add packet");
+            }
+        };
+        assert_eq!(decoded, chunk);
     }
 }
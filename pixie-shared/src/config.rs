@@ -1,4 +1,4 @@
-use crate::{Action, Bijection};
+use crate::{Action, Bijection, FlashOptions, StoreOptions, chunk_codec::FecMode};
 use alloc::{string::String, vec::Vec};
 use ipnet::Ipv4Net;
 use macaddr::MacAddr6;
@@ -24,6 +24,18 @@ pub struct InterfaceConfig {
     pub dhcp: DhcpMode,
     /// Speed in bytes/second used to broadcast chunks.
     pub broadcast_speed: u32,
+    /// Forward error correction used when broadcasting chunks.
+    #[serde(default)]
+    pub fec: FecMode,
+    /// Number of tasks, each with its own socket, between which the packets of every chunk are
+    /// split when broadcasting; `broadcast_speed` is shared between them. Must divide
+    /// [`MAX_SHARDS`](crate::chunk_codec::MAX_SHARDS).
+    #[serde(default = "default_broadcast_workers")]
+    pub broadcast_workers: usize,
+}
+
+fn default_broadcast_workers() -> usize {
+    1
 }
 
 /// Registered clients will always be assigned an IP in the form
@@ -50,6 +62,23 @@ pub struct Config {
     pub http: HttpConfig,
     pub groups: Bijection<String, u8>,
     pub images: Vec<String>,
+    /// Maximum size in bytes of the in-memory cache of compressed chunks to broadcast.
+    #[serde(default = "default_chunk_cache_size")]
+    pub chunk_cache_size: u64,
+    /// If set, stored chunks are recompressed with zstd at this level in the background, which
+    /// makes them faster to broadcast at the cost of slower decompression on the clients.
+    #[serde(default)]
+    pub zstd_level: Option<i32>,
+    /// Options sent to clients storing an image.
+    #[serde(default)]
+    pub store: StoreOptions,
+    /// Options sent to clients flashing an image.
+    #[serde(default)]
+    pub flash: FlashOptions,
+}
+
+fn default_chunk_cache_size() -> u64 {
+    512 << 20
 }
 
 #[derive(Debug, Serialize, Deserialize, Clone, PartialEq, Eq)]
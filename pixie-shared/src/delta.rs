@@ -0,0 +1,132 @@
+//! Differences between versions of an image.
+//!
+//! A client that knows which version is on its disks only needs to check the chunks that are not
+//! at the same position in the new version; the server computes that for it, so that the client
+//! does not have to download the chunk list of the old version.
+
+use crate::{Chunk, ChunkHash, Image, ImageDelta};
+use alloc::{collections::BTreeSet, vec::Vec};
+
+impl Image {
+    /// Hash of the position, size and content of all the chunks, which identifies the data of the
+    /// image independently of how its chunks are compressed.
+    pub fn layout_hash(&self) -> ChunkHash {
+        let mut hasher = blake3::Hasher::new();
+        for (index, disk) in self.disks.iter().enumerate() {
+            hasher.update(&(index as u64).to_le_bytes());
+            hasher.update(&disk.size.to_le_bytes());
+            for chunk in &disk.chunks {
+                hasher.update(&(chunk.start as u64).to_le_bytes());
+                hasher.update(&(chunk.size as u64).to_le_bytes());
+                hasher.update(&chunk.hash);
+            }
+        }
+        *hasher.finalize().as_bytes()
+    }
+
+    /// Computes the changes from `old` to this image.
+    pub fn delta(&self, old: &Image) -> ImageDelta {
+        let position = |index: usize, chunk: &Chunk| (index, chunk.start, chunk.size, chunk.hash);
+        let old_positions: BTreeSet<_> = old
+            .disks
+            .iter()
+            .enumerate()
+            .flat_map(|(index, disk)| disk.chunks.iter().map(move |chunk| position(index, chunk)))
+            .collect();
+        let old_hashes: BTreeSet<ChunkHash> = old.chunks().map(|chunk| chunk.hash).collect();
+
+        let mut new_hashes = BTreeSet::new();
+        let mut delta = ImageDelta {
+            layout_hash: self.layout_hash(),
+            added: Vec::new(),
+            moved: Vec::new(),
+            removed: Vec::new(),
+            added_size: 0,
+            added_csize: 0,
+        };
+        for (index, disk) in self.disks.iter().enumerate() {
+            for chunk in &disk.chunks {
+                let first = new_hashes.insert(chunk.hash);
+                if old_positions.contains(&position(index, chunk)) {
+                    continue;
+                }
+                if old_hashes.contains(&chunk.hash) {
+                    delta.moved.push((index, *chunk));
+                } else {
+                    delta.added.push((index, *chunk));
+                    if first {
+                        delta.added_size += chunk.size as u64;
+                        delta.added_csize += chunk.csize as u64;
+                    }
+                }
+            }
+        }
+        delta.removed = old_hashes.difference(&new_hashes).copied().collect();
+        delta
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{Codec, ImageDisk};
+    use alloc::vec;
+
+    fn chunk(id: u8, start: usize) -> Chunk {
+        Chunk {
+            hash: [id; 32],
+            start,
+            size: 100,
+            csize: 10,
+            codec: Codec::Lz4,
+        }
+    }
+
+    fn image(disks: Vec<Vec<Chunk>>) -> Image {
+        Image {
+            boot_option_id: 0,
+            boot_entry: Vec::new(),
+            disks: disks
+                .into_iter()
+                .map(|chunks| ImageDisk { size: 1000, chunks })
+                .collect(),
+        }
+    }
+
+    #[test]
+    fn test_delta() {
+        let old = image(vec![
+            vec![chunk(1, 0), chunk(2, 100), chunk(3, 200)],
+            vec![chunk(4, 0)],
+        ]);
+        let new = image(vec![
+            vec![chunk(1, 0), chunk(3, 100), chunk(5, 200), chunk(5, 300)],
+            vec![chunk(4, 0), chunk(1, 100)],
+        ]);
+        let delta = new.delta(&old);
+        let ids = |chunks: &[(usize, Chunk)]| -> Vec<_> {
+            chunks
+                .iter()
+                .map(|(index, chunk)| (*index, chunk.hash[0], chunk.start))
+                .collect()
+        };
+        assert_eq!(ids(&delta.added), [(0, 5, 200), (0, 5, 300)]);
+        assert_eq!(ids(&delta.moved), [(0, 3, 100), (1, 1, 100)]);
+        assert_eq!(delta.removed, [[2; 32]]);
+        assert_eq!((delta.added_size, delta.added_csize), (100, 10));
+        assert_eq!(delta.layout_hash, new.layout_hash());
+    }
+
+    #[test]
+    fn test_layout_hash() {
+        let a = image(vec![vec![chunk(1, 0)], vec![chunk(2, 0)]]);
+        let b = image(vec![vec![chunk(1, 0), chunk(2, 0)]]);
+        assert_ne!(a.layout_hash(), b.layout_hash());
+
+        let mut c = a.clone();
+        c.disks[0].chunks[0].csize = 20;
+        c.disks[0].chunks[0].codec = Codec::Zstd;
+        assert_eq!(a.layout_hash(), c.layout_hash());
+        assert!(a.delta(&c).added.is_empty());
+    }
+}
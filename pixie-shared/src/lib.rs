@@ -3,9 +3,12 @@
 extern crate alloc;
 
 pub mod bijection;
+pub mod cdc;
 pub mod chunk_codec;
 #[cfg(feature = "std")]
 pub mod config;
+pub mod delta;
+pub mod manifest;
 pub mod util;
 
 use alloc::{collections::BTreeMap, string::String, vec::Vec};
@@ -38,6 +41,18 @@ pub type ChunkHash = [u8; OUT_LEN];
 /// The offset of the chunk of a disk.
 pub type Offset = usize;
 
+/// Compression format of the data of a chunk. The hash of a chunk is always computed over its
+/// uncompressed data, so it does not depend on the codec.
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize, PartialEq, Eq)]
+#[serde(rename_all = "lowercase")]
+pub enum Codec {
+    /// An LZ4 block, as uploaded by the clients.
+    #[default]
+    Lz4,
+    /// A zstd frame, used by the server when recompressing chunks.
+    Zstd,
+}
+
 /// Describes one chunk from a disk.
 #[derive(Debug, Clone, Copy, Serialize, Deserialize, Default)]
 pub struct Chunk {
@@ -46,23 +61,39 @@ pub struct Chunk {
     pub size: usize,
     /// Compressed size
     pub csize: usize,
+    pub codec: Codec,
 }
 
-/// An image is given by the list of chunks of the disk, the index of the boot entry that boots it,
-/// and the contents of that boot entry.
+/// The content of one of the disks of an image.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ImageDisk {
+    /// Size in bytes of the disk the image was taken from. When flashing, disks are matched by
+    /// their order by decreasing size, and must be at least this big.
+    pub size: u64,
+    pub chunks: Vec<Chunk>,
+}
+
+/// An image is given by the list of chunks of each disk, the index of the boot entry that boots
+/// it, and the contents of that boot entry.
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct Image {
     pub boot_option_id: u16,
     pub boot_entry: Vec<u8>,
-    pub disk: Vec<Chunk>,
+    /// The disks, from the biggest to the smallest.
+    pub disks: Vec<ImageDisk>,
 }
 
 impl Image {
+    /// Iterates over the chunks of all the disks.
+    pub fn chunks(&self) -> impl Iterator<Item = &Chunk> {
+        self.disks.iter().flat_map(|disk| &disk.chunks)
+    }
+
     /// Computes the size in bytes of an image.
     ///
     /// Repeated chunks are counted many times.
     pub fn size(&self) -> u64 {
-        self.disk.iter().map(|chunk| chunk.size as u64).sum()
+        self.chunks().map(|chunk| chunk.size as u64).sum()
     }
 
     /// Computes the compressed size in bytes of an image.
@@ -70,8 +101,7 @@ impl Image {
     /// Repeated chunks are counted once.
     pub fn csize(&self) -> u64 {
         let mut chunks: Vec<_> = self
-            .disk
-            .iter()
+            .chunks()
             .map(|chunk| (chunk.hash, chunk.csize))
             .collect();
         chunks.sort_unstable_by_key(|(hash, _)| *hash);
@@ -80,21 +110,135 @@ impl Image {
     }
 }
 
+/// Differences between two versions of an image, see [`Image::delta`]. Chunks of the new version
+/// that are in neither `added` nor `moved` are at the same position in both versions.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ImageDelta {
+    /// [`Image::layout_hash`] of the new version.
+    pub layout_hash: ChunkHash,
+    /// Chunks of the new version whose content is not in the old one, with the index of their
+    /// disk.
+    pub added: Vec<(usize, Chunk)>,
+    /// Chunks of the new version whose content is in the old one, but at a different position.
+    pub moved: Vec<(usize, Chunk)>,
+    /// Chunks of the old version that are not used by the new one.
+    pub removed: Vec<ChunkHash>,
+    /// Size and compressed size of the data that is only in the new version; repeated chunks are
+    /// counted once.
+    pub added_size: u64,
+    pub added_csize: u64,
+}
+
+/// A range of the [`manifest`] of an image.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct ManifestPart {
+    /// [`Image::layout_hash`] of the image, which changes if the image is replaced while its
+    /// manifest is being downloaded.
+    pub layout_hash: ChunkHash,
+    /// Full name (`name@version`) of the version with the content described by the manifest, or
+    /// `None` if that version was deleted.
+    pub version: Option<String>,
+    /// Length of the whole manifest.
+    pub total_len: u64,
+    pub data: Vec<u8>,
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize, PartialEq, Eq)]
 pub struct ImagesStats {
     pub total_csize: u64,
     pub reclaimable: u64,
     /// size and csize
     pub images: BTreeMap<String, (u64, u64)>,
+    /// Compressed size of the data of each version (`name@version`) that is not in the previous
+    /// version of the same image.
+    pub deltas: BTreeMap<String, u64>,
 }
 
-#[derive(Debug, Clone, Serialize, Deserialize)]
+#[derive(Debug, Clone, Copy, Serialize, Deserialize)]
 pub struct ChunkStats {
     pub csize: u64,
+    pub codec: Codec,
     pub ref_cnt: usize,
 }
 
-pub type ChunksStats = BTreeMap<ChunkHash, ChunkStats>;
+/// Progress of a garbage collection of the chunks.
+#[derive(Debug, Clone, Copy, Serialize, Deserialize, PartialEq, Eq)]
+pub enum GcProgress {
+    /// Deleting the chunks not used by any image.
+    Deleting { done: u64, total: u64 },
+    /// Moving the remaining chunks out of the packs containing deleted ones.
+    Compacting { done: u64, total: u64 },
+}
+
+/// Throughput achieved by the chunk broadcaster of an interface over the last second.
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct BroadcastStats {
+    pub packets_per_sec: u64,
+    pub bytes_per_sec: u64,
+    /// Current broadcast rate in bits per second, adapted to the receiver reports.
+    pub rate: u64,
+    /// Number of chunks waiting to be broadcast.
+    pub queued: u64,
+    /// Number of pending requests for the queued chunks, counting each client once per chunk.
+    pub demand: u64,
+}
+
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct ChunkCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    /// Total size in bytes of the cached chunks.
+    pub size: u64,
+    pub chunks: u64,
+}
+
+#[derive(Debug, Clone, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct ServerStats {
+    /// Broadcast statistics, in the same order as the interfaces in the config.
+    pub broadcast: Vec<BroadcastStats>,
+    pub chunk_cache: ChunkCacheStats,
+}
+
+/// Counters of a task of the client executor, since the client started.
+#[derive(Debug, Clone, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct TaskMetrics {
+    pub name: String,
+    pub polls: u64,
+    /// Total time spent polling the task.
+    pub busy_micros: u64,
+    /// Total time between the task being woken up and being polled.
+    pub wake_latency_micros: u64,
+    pub max_wake_latency_micros: u64,
+}
+
+/// Metrics periodically reported by clients; counters are totals since the client started.
+#[derive(Debug, Clone, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct ClientMetrics {
+    pub uptime_micros: u64,
+    /// The tasks that were busy for the longest time.
+    pub tasks: Vec<TaskMetrics>,
+    /// Number of pending timers of the executor.
+    pub timers: u32,
+    pub disk_read: u64,
+    pub disk_written: u64,
+    pub net_rx: u64,
+    pub net_tx: u64,
+    /// Chunk packets received while flashing.
+    pub packets_received: u64,
+    /// Chunk packets estimated as lost while flashing.
+    pub packets_lost: u64,
+    pub chunks_decoded: u64,
+}
+
+/// The last metrics reported by a unit.
+#[cfg(feature = "std")]
+#[derive(Debug, Clone, Serialize, Deserialize, PartialEq, Eq)]
+pub struct UnitMetrics {
+    pub mac: macaddr::MacAddr6,
+    /// Unix timestamp of the report, in seconds.
+    pub timestamp: u64,
+    pub metrics: ClientMetrics,
+}
 
 #[derive(Debug, Default, Clone, Serialize, Deserialize)]
 pub struct RegistrationInfo {
@@ -114,6 +258,10 @@ pub struct HintPacket {
 /// The maximum number of bytes in a udp packet with mtu 1500
 pub const UDP_BODY_LEN: usize = 1472;
 
+/// The maximum number of chunks in a [`UdpRequest::RequestChunks`] that fits in a udp packet, as
+/// the variant and the length of the list take at most 3 bytes.
+pub const MAX_REQUEST_CHUNKS: usize = (UDP_BODY_LEN - 3) / OUT_LEN;
+
 #[derive(Debug, Clone, Copy, Serialize, Deserialize, PartialEq, Eq)]
 #[serde(rename_all = "lowercase")]
 pub enum Action {
@@ -157,10 +305,78 @@ pub enum UdpRequest {
     /// To be sent in broadcast over the lan.
     /// The server will reply with an empty packet.
     Discover,
-    /// Sets the progress of the client for the current action.
-    ActionProgress(usize, usize),
+    /// Sets the progress of the client for the given action, which is ignored if the action is
+    /// not the current one anymore: done and total amounts of work.
+    ActionProgress(Action, usize, usize),
     /// Requests the given chunks to be broadcasted by the server.
     RequestChunks(Vec<ChunkHash>),
+    /// Reports how the reception of broadcast chunks is going since the previous report, so that
+    /// the server can adapt its broadcast rate.
+    ReceiverReport {
+        /// Number of packets received.
+        received: u32,
+        /// Estimated number of packets lost.
+        lost: u32,
+        /// Number of chunks received but not yet written to the disk.
+        backlog: u32,
+    },
+    /// Reports the [`ClientMetrics`] of the client.
+    Metrics(ClientMetrics),
+}
+
+/// How the used ranges of a disk are split in chunks when storing an image.
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize, PartialEq, Eq)]
+#[serde(rename_all = "lowercase")]
+pub enum Chunking {
+    /// Chunks of [`MAX_CHUNK_SIZE`] bytes, aligned to multiples of their size.
+    #[default]
+    Fixed,
+    /// Content-defined chunks with the given minimum, average and maximum size in bytes, see
+    /// [`cdc`].
+    Cdc { min: usize, avg: usize, max: usize },
+}
+
+/// Options used by clients when storing an image.
+#[derive(Debug, Clone, Default, Serialize, Deserialize, PartialEq, Eq)]
+pub struct StoreOptions {
+    pub chunking: Chunking,
+}
+
+/// How clients find out which chunks are already on the disk when flashing an image.
+#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize, PartialEq, Eq)]
+#[serde(rename_all = "lowercase")]
+pub enum Verify {
+    /// Hash the content of the disk at every position of every chunk.
+    #[default]
+    Full,
+    /// Skip the chunks that are at the same position in the image version flashed last time, as
+    /// recorded by the client. This is only correct if the disk is never modified outside of
+    /// pixie, for example if the OS only mounts it read-only.
+    Incremental,
+}
+
+/// Options used by clients when flashing an image.
+#[derive(Debug, Clone, Serialize, Deserialize, PartialEq, Eq)]
+pub struct FlashOptions {
+    #[serde(default)]
+    pub verify: Verify,
+    /// Number of chunk packets that can be queued between the network card and the decoders;
+    /// packets arriving when the queue is full are dropped.
+    #[serde(default = "default_rx_queue")]
+    pub rx_queue: usize,
+}
+
+fn default_rx_queue() -> usize {
+    4096
+}
+
+impl Default for FlashOptions {
+    fn default() -> Self {
+        Self {
+            verify: Verify::default(),
+            rx_queue: default_rx_queue(),
+        }
+    }
 }
 
 /// A request for the tcp server.
@@ -173,8 +389,10 @@ pub enum UdpRequest {
 /// To each request the server will reply with a message in the same format:
 /// - request length with 8 bytes;
 /// - response content encoded with postcard;
+///
+/// Chunk data is borrowed, so that the server can deserialize uploads without copying them.
 #[derive(Debug, Clone, Serialize, Deserialize)]
-pub enum TcpRequest {
+pub enum TcpRequest<'a> {
     /// Checks if the server contains the chunk in the database.
     /// The server will reply with a bool.
     HasChunk(ChunkHash),
@@ -186,7 +404,7 @@ pub enum TcpRequest {
     Register(RegistrationInfo),
     /// Uploads the given chunk to the server, the content is already compressed.
     /// The response is empty.
-    UploadChunk(Vec<u8>),
+    UploadChunk(&'a [u8]),
     /// Uploads the [`Image`] to the server, the image name is deduced by the client configuration.
     /// The response is empty.
     UploadImage(Image),
@@ -196,6 +414,32 @@ pub enum TcpRequest {
     /// Tells the server that the action is complete and can proced to the next action.
     /// The response is emtpy.
     ActionComplete,
+    /// Asks the server how images should be stored.
+    /// The server replies with the [`StoreOptions`].
+    GetStoreOptions,
+    /// Checks which of the chunks the server contains in the database.
+    /// The server replies with a bitmap as a `Vec<u8>`: bit `i % 8` of byte `i / 8` is set if the
+    /// `i`-th chunk is present.
+    HasChunks(Vec<ChunkHash>),
+    /// Uploads the given chunks to the server, the contents are already compressed.
+    /// The response is empty.
+    #[serde(borrow)]
+    UploadChunks(Vec<&'a [u8]>),
+    /// Asks the server how images should be flashed.
+    /// The server replies with the [`FlashOptions`].
+    GetFlashOptions,
+    /// Asks the server the [`Image`] with the given full name (`name@version`).
+    /// The server replies with an `Option<Image>`.
+    GetVersionedImage(String),
+    /// Asks the server the changes from the version with the given full name to the [`Image`]
+    /// returned by [`TcpRequest::GetImage`].
+    /// The server replies with an `Option<ImageDelta>`, which is `None` if that version was
+    /// deleted.
+    GetImageDelta(String),
+    /// Asks the server at most `len` bytes, starting from `offset`, of the [`manifest`] of the
+    /// [`Image`] returned by [`TcpRequest::GetImage`].
+    /// The server replies with a [`ManifestPart`].
+    GetImageManifest { offset: u64, len: u32 },
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -203,6 +447,18 @@ pub enum TcpRequest {
 pub enum StatusUpdate {
     Config(config::Config),
     HostMap(HashMap<Ipv4Addr, String>),
+    /// All the units, sent when the stream starts.
     Units(Vec<Unit>),
+    /// The units that changed since the previous message of the stream, which has version
+    /// `version - 1`; the initial [`StatusUpdate::Units`] has version 0.
+    UnitsDelta {
+        version: u64,
+        changed: Vec<Unit>,
+        removed: Vec<macaddr::MacAddr6>,
+    },
     ImagesStats(ImagesStats),
+    ServerStats(ServerStats),
+    UnitMetrics(Vec<UnitMetrics>),
+    /// Progress of the garbage collection, `None` if it is not running.
+    GcProgress(Option<GcProgress>),
 }
@@ -0,0 +1,421 @@
+//! Compact encoding of the chunk list of an [`Image`], which can be decoded incrementally.
+//!
+//! All the integers are LEB128 varints. The manifest starts with a header:
+//! - the boot option id;
+//! - the length of the boot entry, followed by its bytes;
+//! - the number of disks, followed by the size and the number of chunks of each disk.
+//!
+//! Then come the chunks of each disk, in order. Each one is given by:
+//! - the difference between its start and the end of the previous chunk of the same disk (or 0
+//!   for the first chunk), zigzag-encoded; chunks are usually contiguous, so this is mostly 0;
+//! - a reference: 0 for a chunk seen for the first time, which is followed by its 32-byte hash,
+//!   size, compressed size and codec (one byte), and `i + 1` for a chunk with the same content as
+//!   the `i`-th distinct chunk of the manifest.
+
+use crate::{Chunk, ChunkHash, Codec, Image};
+use alloc::{collections::BTreeMap, vec::Vec};
+use blake3::OUT_LEN;
+use thiserror::Error;
+
+#[derive(Error, Debug)]
+pub enum ManifestError {
+    #[error("Manifest is truncated")]
+    Truncated,
+    #[error("Data after the end of the manifest")]
+    TrailingData,
+    #[error("Invalid varint")]
+    InvalidVarint,
+    #[error("Value out of range: {0}")]
+    OutOfRange(u64),
+    #[error("Invalid chunk reference: {0}")]
+    InvalidReference(u64),
+    #[error("Invalid codec: {0}")]
+    InvalidCodec(u8),
+}
+
+/// Size and number of chunks of a disk.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ManifestDisk {
+    pub size: u64,
+    pub chunks: u64,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ManifestHeader {
+    pub boot_option_id: u16,
+    pub boot_entry: Vec<u8>,
+    pub disks: Vec<ManifestDisk>,
+}
+
+impl ManifestHeader {
+    /// Total number of chunks, counting repeated ones many times.
+    pub fn chunks(&self) -> u64 {
+        self.disks.iter().map(|disk| disk.chunks).sum()
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut val: u64) {
+    while val >= 0x80 {
+        out.push(val as u8 | 0x80);
+        val >>= 7;
+    }
+    out.push(val as u8);
+}
+
+fn codec_byte(codec: Codec) -> u8 {
+    match codec {
+        Codec::Lz4 => 0,
+        Codec::Zstd => 1,
+    }
+}
+
+/// Encodes the manifest of `image`.
+pub fn encode(image: &Image) -> Vec<u8> {
+    let mut out = Vec::new();
+    put_varint(&mut out, image.boot_option_id as u64);
+    put_varint(&mut out, image.boot_entry.len() as u64);
+    out.extend_from_slice(&image.boot_entry);
+    put_varint(&mut out, image.disks.len() as u64);
+    for disk in &image.disks {
+        put_varint(&mut out, disk.size);
+        put_varint(&mut out, disk.chunks.len() as u64);
+    }
+
+    let mut entries: BTreeMap<ChunkHash, u64> = BTreeMap::new();
+    for disk in &image.disks {
+        let mut end = 0i64;
+        for chunk in &disk.chunks {
+            let gap = chunk.start as i64 - end;
+            put_varint(&mut out, ((gap << 1) ^ (gap >> 63)) as u64);
+            end = (chunk.start + chunk.size) as i64;
+            if let Some(&index) = entries.get(&chunk.hash) {
+                put_varint(&mut out, index + 1);
+                continue;
+            }
+            entries.insert(chunk.hash, entries.len() as u64);
+            put_varint(&mut out, 0);
+            out.extend_from_slice(&chunk.hash);
+            put_varint(&mut out, chunk.size as u64);
+            put_varint(&mut out, chunk.csize as u64);
+            out.push(codec_byte(chunk.codec));
+        }
+    }
+    out
+}
+
+/// Reads values from the start of a buffer, failing with [`ManifestError::Truncated`] if it does
+/// not contain enough data.
+struct Reader<'a> {
+    data: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> Reader<'a> {
+    fn bytes(&mut self, len: usize) -> Result<&'a [u8], ManifestError> {
+        let bytes = self
+            .data
+            .get(self.pos..self.pos.saturating_add(len))
+            .ok_or(ManifestError::Truncated)?;
+        self.pos += len;
+        Ok(bytes)
+    }
+
+    fn byte(&mut self) -> Result<u8, ManifestError> {
+        Ok(self.bytes(1)?[0])
+    }
+
+    fn varint(&mut self) -> Result<u64, ManifestError> {
+        let mut val = 0u64;
+        for shift in (0..64).step_by(7) {
+            let byte = self.byte()?;
+            val |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(val);
+            }
+        }
+        Err(ManifestError::InvalidVarint)
+    }
+
+    fn usize(&mut self) -> Result<usize, ManifestError> {
+        let val = self.varint()?;
+        usize::try_from(val).map_err(|_| ManifestError::OutOfRange(val))
+    }
+
+    fn header(&mut self) -> Result<ManifestHeader, ManifestError> {
+        let boot_option_id = self.varint()?;
+        let boot_option_id =
+            u16::try_from(boot_option_id).map_err(|_| ManifestError::OutOfRange(boot_option_id))?;
+        let len = self.usize()?;
+        let boot_entry = self.bytes(len)?.to_vec();
+        let num_disks = self.varint()?;
+        let mut disks = Vec::new();
+        for _ in 0..num_disks {
+            let size = self.varint()?;
+            let chunks = self.varint()?;
+            disks.push(ManifestDisk { size, chunks });
+        }
+        Ok(ManifestHeader {
+            boot_option_id,
+            boot_entry,
+            disks,
+        })
+    }
+
+    /// Decodes a chunk following one that ends at `end`, adding it to the distinct chunks in
+    /// `entries` if new.
+    fn chunk(&mut self, end: usize, entries: &mut Vec<Chunk>) -> Result<Chunk, ManifestError> {
+        let gap = self.varint()?;
+        let gap = (gap >> 1) as i64 ^ -((gap & 1) as i64);
+        let start = (end as i64)
+            .checked_add(gap)
+            .and_then(|start| usize::try_from(start).ok())
+            .ok_or(ManifestError::OutOfRange(gap as u64))?;
+        let mut chunk = match self.varint()? {
+            0 => {
+                let hash = self.bytes(OUT_LEN)?.try_into().unwrap();
+                let size = self.usize()?;
+                let csize = self.usize()?;
+                let codec = match self.byte()? {
+                    0 => Codec::Lz4,
+                    1 => Codec::Zstd,
+                    codec => return Err(ManifestError::InvalidCodec(codec)),
+                };
+                let chunk = Chunk {
+                    hash,
+                    start: 0,
+                    size,
+                    csize,
+                    codec,
+                };
+                entries.push(chunk);
+                chunk
+            }
+            reference => *usize::try_from(reference - 1)
+                .ok()
+                .and_then(|index| entries.get(index))
+                .ok_or(ManifestError::InvalidReference(reference))?,
+        };
+        chunk.start = start;
+        Ok(chunk)
+    }
+}
+
+/// Incremental decoder of a manifest: data is added with [`ManifestDecoder::push`] as it is
+/// received, and the chunks are taken out with [`ManifestDecoder::next_chunk`] as soon as they are
+/// complete.
+#[derive(Default)]
+pub struct ManifestDecoder {
+    buf: Vec<u8>,
+    /// Number of bytes of `buf` already decoded.
+    pos: usize,
+    header: Option<ManifestHeader>,
+    /// Disk of the next chunk, and number of chunks still to be decoded in it.
+    disk: usize,
+    left: u64,
+    /// End of the last chunk decoded on the current disk.
+    end: usize,
+    /// The distinct chunks decoded so far, with no start.
+    entries: Vec<Chunk>,
+}
+
+impl ManifestDecoder {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Adds the next bytes of the manifest.
+    pub fn push(&mut self, data: &[u8]) {
+        self.buf.drain(..self.pos);
+        self.pos = 0;
+        self.buf.extend_from_slice(data);
+    }
+
+    /// Returns the header, if enough data was received to decode it.
+    pub fn header(&mut self) -> Result<Option<&ManifestHeader>, ManifestError> {
+        if self.header.is_none() {
+            let mut reader = Reader {
+                data: &self.buf[self.pos..],
+                pos: 0,
+            };
+            let header = match reader.header() {
+                Ok(header) => header,
+                Err(ManifestError::Truncated) => return Ok(None),
+                Err(e) => return Err(e),
+            };
+            self.pos += reader.pos;
+            self.left = header.disks.first().map_or(0, |disk| disk.chunks);
+            self.header = Some(header);
+        }
+        Ok(self.header.as_ref())
+    }
+
+    /// Returns the next chunk and the index of its disk, or `None` if more data is needed or all
+    /// the chunks were decoded.
+    pub fn next_chunk(&mut self) -> Result<Option<(usize, Chunk)>, ManifestError> {
+        if self.header()?.is_none() {
+            return Ok(None);
+        }
+        let disks = self.header.as_ref().map_or(&[][..], |header| &header.disks);
+        while self.left == 0 && self.disk < disks.len() {
+            self.disk += 1;
+            self.left = disks.get(self.disk).map_or(0, |disk| disk.chunks);
+            self.end = 0;
+        }
+        if self.disk >= disks.len() {
+            return Ok(None);
+        }
+
+        let mut reader = Reader {
+            data: &self.buf[self.pos..],
+            pos: 0,
+        };
+        let chunk = match reader.chunk(self.end, &mut self.entries) {
+            Ok(chunk) => chunk,
+            Err(ManifestError::Truncated) => return Ok(None),
+            Err(e) => return Err(e),
+        };
+        self.pos += reader.pos;
+        self.left -= 1;
+        self.end = chunk.start + chunk.size;
+        Ok(Some((self.disk, chunk)))
+    }
+
+    /// Checks that the whole manifest was decoded.
+    pub fn finish(&mut self) -> Result<(), ManifestError> {
+        if self.next_chunk()?.is_some() || self.header.is_none() || self.disk < self.num_disks() {
+            return Err(ManifestError::Truncated);
+        }
+        if self.pos != self.buf.len() {
+            return Err(ManifestError::TrailingData);
+        }
+        Ok(())
+    }
+
+    fn num_disks(&self) -> usize {
+        self.header.as_ref().map_or(0, |header| header.disks.len())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ImageDisk;
+    use alloc::vec;
+
+    fn image() -> Image {
+        let chunk = |id: u8, start: usize, size: usize| Chunk {
+            hash: [id; 32],
+            start,
+            size,
+            csize: size / 3,
+            codec: if id % 2 == 0 { Codec::Lz4 } else { Codec::Zstd },
+        };
+        Image {
+            boot_option_id: 0x1234,
+            boot_entry: b"boot entry".to_vec(),
+            disks: vec![
+                ImageDisk {
+                    size: 1 << 40,
+                    chunks: vec![
+                        chunk(1, 4096, 1 << 20),
+                        chunk(2, 4096 + (1 << 20), 300),
+                        chunk(1, 1 << 30, 1 << 20),
+                        chunk(3, 0, 5000),
+                    ],
+                },
+                ImageDisk {
+                    size: 1 << 20,
+                    chunks: vec![],
+                },
+                ImageDisk {
+                    size: 1 << 30,
+                    chunks: vec![chunk(3, 0, 5000), chunk(4, 5000, 7)],
+                },
+            ],
+        }
+    }
+
+    fn decode(data: &[u8], piece: usize) -> Result<Image, ManifestError> {
+        let mut decoder = ManifestDecoder::new();
+        let mut chunks = Vec::new();
+        for piece in data.chunks(piece) {
+            decoder.push(piece);
+            while let Some(chunk) = decoder.next_chunk()? {
+                chunks.push(chunk);
+            }
+        }
+        decoder.finish()?;
+        let header = decoder.header()?.unwrap().clone();
+        let mut disks: Vec<_> = header
+            .disks
+            .iter()
+            .map(|disk| ImageDisk {
+                size: disk.size,
+                chunks: Vec::new(),
+            })
+            .collect();
+        for (index, chunk) in chunks {
+            disks[index].chunks.push(chunk);
+        }
+        Ok(Image {
+            boot_option_id: header.boot_option_id,
+            boot_entry: header.boot_entry,
+            disks,
+        })
+    }
+
+    fn assert_same(a: &Image, b: &Image) {
+        assert_eq!(a.boot_option_id, b.boot_option_id);
+        assert_eq!(a.boot_entry, b.boot_entry);
+        assert_eq!(a.disks.len(), b.disks.len());
+        for (a, b) in a.disks.iter().zip(&b.disks) {
+            assert_eq!(a.size, b.size);
+            assert_eq!(a.chunks.len(), b.chunks.len());
+            for (a, b) in a.chunks.iter().zip(&b.chunks) {
+                assert_eq!(
+                    (a.hash, a.start, a.size, a.csize, a.codec),
+                    (b.hash, b.start, b.size, b.csize, b.codec)
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn test_roundtrip() {
+        let image = image();
+        let data = encode(&image);
+        for piece in [1, 7, data.len()] {
+            assert_same(&decode(&data, piece).unwrap(), &image);
+        }
+    }
+
+    #[test]
+    fn test_invalid() {
+        let data = encode(&image());
+        assert!(matches!(
+            decode(&data[..data.len() - 1], 5),
+            Err(ManifestError::Truncated)
+        ));
+        let mut trailing = data.clone();
+        trailing.push(0);
+        assert!(matches!(
+            decode(&trailing, 5),
+            Err(ManifestError::TrailingData)
+        ));
+        let empty = Image {
+            boot_option_id: 0,
+            boot_entry: Vec::new(),
+            disks: vec![ImageDisk {
+                size: 0,
+                chunks: Vec::new(),
+            }],
+        };
+        let mut bad_ref = encode(&empty);
+        bad_ref[4] = 1;
+        bad_ref.extend([0, 5]);
+        assert!(matches!(
+            decode(&bad_ref, 1),
+            Err(ManifestError::InvalidReference(5))
+        ));
+    }
+}
@@ -1,7 +1,7 @@
 use crate::os::disk::Disk;
 
 pub async fn export() {
-    let mut disk = Disk::open_with_size(500 << 20);
+    let disk = Disk::open_with_size(500 << 20);
 
     let mut coverage = vec![];
     // SAFETY: we never create threads anyway.
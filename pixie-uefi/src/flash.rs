@@ -1,117 +1,529 @@
 use alloc::boxed::Box;
-use alloc::collections::BTreeMap;
+use alloc::collections::{BTreeMap, BTreeSet};
+use alloc::string::String;
 use alloc::vec::Vec;
 use core::cell::{Cell, RefCell};
 use core::fmt::Write;
-use core::mem;
 use core::net::SocketAddrV4;
+use core::sync::atomic::Ordering;
 use core::time::Duration;
 
 use futures::future::{Either, select};
 use log::info;
-use lz4_flex::decompress;
 use pixie_shared::chunk_codec::Decoder;
+use pixie_shared::manifest::{ManifestDecoder, ManifestError, ManifestHeader};
 use pixie_shared::util::BytesFmt;
-use pixie_shared::{CHUNKS_PORT, ChunkHash, Image, MAX_CHUNK_SIZE, TcpRequest, UdpRequest};
-
-use crate::MIN_MEMORY;
-use crate::os::boot_options::BootOptions;
+use pixie_shared::{
+    Action, CHUNKS_PORT, Chunk, ChunkHash, Codec, FlashOptions, ImageDelta, MAX_CHUNK_SIZE,
+    MAX_REQUEST_CHUNKS, ManifestPart, TcpRequest, UdpRequest, Verify,
+};
+use ruzstd::decoding::FrameDecoder;
+use uefi::runtime::{VariableAttributes, VariableVendor};
+
+use crate::os::boot_options::{BootOptions, Variable};
 use crate::os::error::{Error, Result};
 use crate::os::executor::Executor;
-use crate::os::net::{ETH_PACKET_SIZE, TcpStream, UdpSocket};
+use crate::os::net::{FastUdpReceiver, TcpStream, UdpSocket};
+use crate::os::timer::Timer;
 use crate::os::ui::{DrawArea, update_content};
 use crate::os::{disk, memory};
+use crate::{MIN_MEMORY, metrics};
+
+/// Vendor of the variable holding the full name of the image version flashed last time, which
+/// is deleted before starting to write to the disk.
+const PIXIE_VENDOR: VariableVendor =
+    VariableVendor(uefi::guid!("b78196bf-af83-4d34-a190-c8832358357a"));
+
+/// Length of the parts in which the manifest of the image is downloaded.
+const MANIFEST_PART_LEN: u32 = 256 << 10;
+
+/// Bounds of the number of chunks requested at once.
+const MIN_WINDOW: usize = 8;
+const MAX_WINDOW: usize = 1024;
+
+/// Minimum number of chunks being received that are kept in memory, regardless of the free memory.
+const MIN_DECODERS: usize = 16;
+
+/// Interval between two receiver reports.
+const REPORT_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Maximum interval between two chunk requests, as long as chunks are being received.
+const REQUEST_INTERVAL: Duration = Duration::from_millis(500);
+
+/// Number of chunks waiting to be written to disk above which the request window shrinks.
+const MAX_BACKLOG: usize = 32;
 
-async fn fetch_image(stream: &TcpStream) -> Result<Image> {
-    let req = TcpRequest::GetImage;
-    let mut buf = postcard::to_allocvec(&req)?;
+fn flashed_version() -> Variable {
+    Variable::new("PixieFlashedVersion", PIXIE_VENDOR)
+}
+
+/// Sends a request to the server, returning the serialized reply.
+async fn request(stream: &TcpStream, req: &TcpRequest<'_>) -> Result<Vec<u8>> {
+    let mut buf = postcard::to_allocvec(req)?;
     stream.write_u64_le(buf.len() as u64).await?;
     stream.write_all(&buf).await?;
     let len = stream.read_u64_le().await?;
     buf.resize(len as usize, 0);
     stream.read_exact(&mut buf).await?;
-    Ok(postcard::from_bytes(&buf)?)
+    Ok(buf)
+}
+
+/// Index of the disk and offset of a chunk.
+type Position = (usize, usize);
+
+/// Returns the positions of the chunks of the image with the given layout hash that are not known
+/// to be already on the disks, according to the image version flashed last time; `None` if
+/// nothing is known about the disks.
+async fn changed_chunks(
+    stream: &TcpStream,
+    layout_hash: ChunkHash,
+) -> Result<Option<BTreeSet<Position>>> {
+    let Ok((last, _)) = flashed_version().get() else {
+        info!("No record of the last flashed image; verifying all chunks");
+        return Ok(None);
+    };
+    let last = String::from_utf8_lossy(&last).into_owned();
+    let req = TcpRequest::GetImageDelta(last.clone());
+    let delta: Option<ImageDelta> = postcard::from_bytes(&request(stream, &req).await?)?;
+    let Some(delta) = delta else {
+        info!("Last flashed image {last} is not available; verifying all chunks");
+        return Ok(None);
+    };
+    // The image may have changed since its manifest was requested.
+    if delta.layout_hash != layout_hash {
+        info!("Image changed while flashing; verifying all chunks");
+        return Ok(None);
+    }
+    info!(
+        "Last flashed image is {last}: {} chunks added ({}), {} moved",
+        delta.added.len(),
+        BytesFmt(delta.added_csize),
+        delta.moved.len()
+    );
+    Ok(Some(
+        delta
+            .added
+            .iter()
+            .chain(&delta.moved)
+            .map(|(index, chunk)| (*index, chunk.start))
+            .collect(),
+    ))
+}
+
+/// Downloads the manifest of the image in parts, decoding it as it is received.
+struct ManifestReader<'a> {
+    stream: &'a TcpStream,
+    decoder: ManifestDecoder,
+    offset: u64,
+    total_len: u64,
+    layout_hash: Option<ChunkHash>,
+    /// Full name of the version with the content of the manifest, sent with its layout hash.
+    version: Option<String>,
+}
+
+impl<'a> ManifestReader<'a> {
+    fn new(stream: &'a TcpStream) -> Self {
+        ManifestReader {
+            stream,
+            decoder: ManifestDecoder::new(),
+            offset: 0,
+            total_len: 0,
+            layout_hash: None,
+            version: None,
+        }
+    }
+
+    /// Receives the next part of the manifest, returning false if it was all received already.
+    async fn fetch(&mut self) -> Result<bool> {
+        if self.layout_hash.is_some() && self.offset >= self.total_len {
+            return Ok(false);
+        }
+        let req = TcpRequest::GetImageManifest {
+            offset: self.offset,
+            len: MANIFEST_PART_LEN,
+        };
+        let part: ManifestPart = postcard::from_bytes(&request(self.stream, &req).await?)?;
+        if self
+            .layout_hash
+            .is_some_and(|hash| hash != part.layout_hash)
+        {
+            return Err(Error::msg("Image changed while downloading its manifest"));
+        }
+        if part.data.is_empty() && self.offset < part.total_len {
+            return Err(Error::msg("Empty manifest part"));
+        }
+        if self.layout_hash.is_none() {
+            self.layout_hash = Some(part.layout_hash);
+            self.version = part.version;
+        }
+        self.total_len = part.total_len;
+        self.offset += part.data.len() as u64;
+        self.decoder.push(&part.data);
+        Ok(true)
+    }
+
+    async fn header(&mut self) -> Result<ManifestHeader> {
+        loop {
+            if let Some(header) = self.decoder.header()? {
+                return Ok(header.clone());
+            }
+            if !self.fetch().await? {
+                return Err(ManifestError::Truncated.into());
+            }
+        }
+    }
+
+    /// Returns the next chunk and the index of its disk, or `None` at the end of the manifest.
+    async fn next_chunk(&mut self) -> Result<Option<(usize, Chunk)>> {
+        loop {
+            if let Some(chunk) = self.decoder.next_chunk()? {
+                return Ok(Some(chunk));
+            }
+            if !self.fetch().await? {
+                self.decoder.finish()?;
+                return Ok(None);
+            }
+        }
+    }
+}
+
+/// A chunk that is not on the disk yet.
+struct ChunkInfo {
+    size: usize,
+    csize: usize,
+    codec: Codec,
+    pos: Vec<Position>,
+    /// Whether the disk was already checked for this chunk, which can then be requested.
+    scanned: bool,
 }
 
 #[derive(Clone, PartialEq, Eq)]
 struct Stats {
     chunks: usize,
     unique: usize,
+    scanned: usize,
     fetch: usize,
+    found: usize,
     recv: usize,
     pack_recv: usize,
     requested: usize,
+    up_to_date: usize,
+    spilled: usize,
+    /// Packets dropped as the receive queue was full.
+    dropped: u64,
 }
 
-fn handle_packet(
-    buf: &[u8],
-    chunks_info: &mut BTreeMap<ChunkHash, (usize, usize, Vec<usize>)>,
-    received: &mut BTreeMap<ChunkHash, Decoder>,
-    last_seen: &mut Vec<ChunkHash>,
-) -> Result<Option<(Vec<usize>, Vec<u8>)>> {
-    let hash: ChunkHash = buf[..32].try_into().unwrap();
-    let csize = match chunks_info.get(&hash) {
-        Some(&(_, csize, _)) => csize,
-        _ => return Ok(None),
+const NIL: usize = usize::MAX;
+
+struct DecoderSlot {
+    hash: ChunkHash,
+    decoder: Decoder,
+    /// Neighbours in the list of the decoders holding their data in memory.
+    prev: usize,
+    next: usize,
+}
+
+/// Decoders of the chunks being received, kept in a slab so that their buffers are reused.
+///
+/// At most `max_in_memory` decoders keep their packet data in memory; when more are needed, the
+/// least recently used one is spilled to the first disk position of its chunk, which will be
+/// overwritten when the chunk is complete, and read back when more of its packets arrive. Chunks
+/// that do not fit in their own disk space (or that may still be found on the disk) are dropped
+/// instead.
+struct DecoderPool {
+    slots: Vec<DecoderSlot>,
+    free: Vec<usize>,
+    by_hash: BTreeMap<ChunkHash, usize>,
+    /// Most recently used decoder in memory.
+    head: usize,
+    /// Least recently used decoder in memory.
+    tail: usize,
+    in_memory: usize,
+    max_in_memory: usize,
+}
+
+impl DecoderPool {
+    fn new(max_in_memory: usize) -> Self {
+        DecoderPool {
+            slots: Vec::new(),
+            free: Vec::new(),
+            by_hash: BTreeMap::new(),
+            head: NIL,
+            tail: NIL,
+            in_memory: 0,
+            max_in_memory,
+        }
+    }
+
+    fn unlink(&mut self, slot: usize) {
+        let DecoderSlot { prev, next, .. } = self.slots[slot];
+        match prev {
+            NIL => self.head = next,
+            prev => self.slots[prev].next = next,
+        }
+        match next {
+            NIL => self.tail = prev,
+            next => self.slots[next].prev = prev,
+        }
+        self.in_memory -= 1;
+    }
+
+    fn push_front(&mut self, slot: usize) {
+        self.slots[slot].prev = NIL;
+        self.slots[slot].next = self.head;
+        match self.head {
+            NIL => self.tail = slot,
+            head => self.slots[head].prev = slot,
+        }
+        self.head = slot;
+        self.in_memory += 1;
+    }
+
+    /// Number of decoders whose data is on the disk.
+    fn spilled(&self) -> usize {
+        self.by_hash.len() - self.in_memory
+    }
+
+    /// Forgets about a chunk, keeping its decoder for reuse.
+    fn remove(&mut self, hash: &ChunkHash) {
+        let Some(slot) = self.by_hash.remove(hash) else {
+            return;
+        };
+        if !self.slots[slot].decoder.is_spilled() {
+            self.unlink(slot);
+        }
+        self.free.push(slot);
+    }
+
+    /// Returns the decoder for the chunk, which is ready to receive packets.
+    fn get(
+        &mut self,
+        hash: ChunkHash,
+        chunks_info: &BTreeMap<ChunkHash, ChunkInfo>,
+        disks: &[disk::Disk],
+    ) -> Result<&mut Decoder> {
+        let info = &chunks_info[&hash];
+        let slot = match self.by_hash.get(&hash).copied() {
+            Some(slot) if self.slots[slot].decoder.is_spilled() => {
+                let decoder = &mut self.slots[slot].decoder;
+                let mut data = vec![0; decoder.buffer_len()];
+                let (index, offset) = info.pos[0];
+                disks[index].read_sync(offset as u64, &mut data)?;
+                decoder.restore(data);
+                self.push_front(slot);
+                slot
+            }
+            Some(slot) => {
+                self.unlink(slot);
+                self.push_front(slot);
+                slot
+            }
+            None => {
+                let slot = match self.free.pop() {
+                    Some(slot) => {
+                        self.slots[slot].hash = hash;
+                        self.slots[slot].decoder.reset(info.csize);
+                        slot
+                    }
+                    None => {
+                        self.slots.push(DecoderSlot {
+                            hash,
+                            decoder: Decoder::new(info.csize),
+                            prev: NIL,
+                            next: NIL,
+                        });
+                        self.slots.len() - 1
+                    }
+                };
+                self.by_hash.insert(hash, slot);
+                self.push_front(slot);
+                slot
+            }
+        };
+
+        while self.in_memory > self.max_in_memory {
+            let victim = self.tail;
+            let victim_hash = self.slots[victim].hash;
+            let info = &chunks_info[&victim_hash];
+            let decoder = &mut self.slots[victim].decoder;
+            if info.scanned && decoder.buffer_len() <= info.size {
+                let data = decoder.spill();
+                let (index, offset) = info.pos[0];
+                disks[index].write_sync(offset as u64, &data)?;
+                self.unlink(victim);
+            } else {
+                self.remove(&victim_hash);
+            }
+        }
+        Ok(&mut self.slots[slot].decoder)
+    }
+}
+
+/// Decompresses the data of a chunk of `size` bytes.
+fn decompress(cdata: &[u8], codec: Codec, size: usize) -> Result<Vec<u8>> {
+    let data = match codec {
+        Codec::Lz4 => lz4_flex::decompress(cdata, size)?,
+        Codec::Zstd => {
+            let mut data = vec![0; size];
+            let len = FrameDecoder::new().decode_all(cdata, &mut data)?;
+            data.truncate(len);
+            data
+        }
     };
+    if data.len() != size {
+        return Err(Error(format!(
+            "Decompressed chunk is {} bytes instead of {size}",
+            data.len()
+        )));
+    }
+    Ok(data)
+}
 
-    let decoder = received.entry(hash).or_insert_with(|| Decoder::new(csize));
-    last_seen.retain(|x| x != &hash);
-    last_seen.push(hash);
+fn handle_packet(
+    buf: &[u8],
+    chunks_info: &mut BTreeMap<ChunkHash, ChunkInfo>,
+    decoders: &mut DecoderPool,
+    disks: &[disk::Disk],
+    lost: &mut usize,
+) -> Result<Option<(Vec<Position>, Vec<u8>)>> {
+    let hash: ChunkHash = buf[..32].try_into().expect("packet length was checked");
+    if !chunks_info.contains_key(&hash) {
+        // The chunk may have been found on the disk in the meantime.
+        decoders.remove(&hash);
+        return Ok(None);
+    }
 
+    let decoder = decoders.get(hash, chunks_info, disks)?;
+    let lost_before = decoder.lost_packets();
     if let Err(e) = decoder.add_packet(&buf[32..]) {
         log::warn!("Received invalid packet for chunk {hash:02x?}: {e}");
         return Ok(None);
     }
+    *lost += decoder.lost_packets() - lost_before;
     let Some(cdata) = decoder.finish() else {
         return Ok(None);
     };
+    decoders.remove(&hash);
 
-    let (size, _, pos) = chunks_info.remove(&hash).unwrap();
-    received.remove(&hash).unwrap();
-    last_seen.retain(|x| x != &hash);
-
-    let data = decompress(&cdata, size)?;
-    assert_eq!(data.len(), size);
+    let ChunkInfo {
+        size, codec, pos, ..
+    } = chunks_info
+        .remove(&hash)
+        .expect("chunk was checked to be needed");
+    let data = decompress(&cdata, codec, size)?;
 
     Ok(Some((pos, data)))
 }
 
 pub async fn flash(server_addr: SocketAddrV4) -> Result<()> {
     let stream = TcpStream::connect(server_addr).await?;
-    let image = fetch_image(&stream).await?;
-    stream.shutdown().await;
-    // TODO(virv): this could be better
-    stream.force_close().await;
+    let mut manifest = ManifestReader::new(&stream);
+    let header = manifest.header().await?;
+
+    // Disks are matched to the ones of the image by decreasing size.
+    let disks = disk::Disk::all();
+    if header.disks.len() > disks.len() {
+        return Err(Error(format!(
+            "The image has {} disks, but only {} were found",
+            header.disks.len(),
+            disks.len()
+        )));
+    }
+    for (index, (image_disk, disk)) in header.disks.iter().zip(&disks).enumerate() {
+        if disk.size() < image_disk.size {
+            return Err(Error(format!(
+                "Disk {index} is too small for the image: {} < {}",
+                BytesFmt(disk.size()),
+                BytesFmt(image_disk.size)
+            )));
+        }
+    }
 
+    let FlashOptions { verify, rx_queue } =
+        postcard::from_bytes(&request(&stream, &TcpRequest::GetFlashOptions).await?)?;
+    // The version is recorded only at the end of the flash: it is the one with the layout hash
+    // checked for all the parts of the manifest, so it matches the data that is written.
+    let version = manifest.version.clone();
+    let layout_hash = manifest.layout_hash.expect("manifest header was received");
+    let changed = match verify {
+        Verify::Full => None,
+        Verify::Incremental => changed_chunks(&stream, layout_hash).await?,
+    };
+    let is_up_to_date = |pos: &Position| {
+        changed
+            .as_ref()
+            .is_some_and(|changed| !changed.contains(pos))
+    };
+
+    // Chunks are deduplicated across all the disks.
     let mut chunks_info = BTreeMap::new();
-    for chunk in &image.disk {
+    while let Some((index, chunk)) = manifest.next_chunk().await? {
         chunks_info
             .entry(chunk.hash)
-            .or_insert((chunk.size, chunk.csize, Vec::new()))
-            .2
-            .push(chunk.start);
+            .or_insert(ChunkInfo {
+                size: chunk.size,
+                csize: chunk.csize,
+                codec: chunk.codec,
+                pos: Vec::new(),
+                scanned: false,
+            })
+            .pos
+            .push((index, chunk.start));
     }
+    drop(manifest);
+    stream.shutdown().await;
+    // TODO(virv): this could be better
+    stream.force_close().await;
 
     info!("Obtained chunks; {} distinct chunks", chunks_info.len());
 
     let stats = RefCell::new(Stats {
-        chunks: image.disk.len(),
+        chunks: header.chunks() as usize,
         unique: chunks_info.len(),
+        scanned: 0,
         fetch: 0,
+        found: 0,
         recv: 0,
         pack_recv: 0,
         requested: 0,
+        up_to_date: 0,
+        spilled: 0,
+        dropped: 0,
     });
 
     let draw = |draw_area: &mut DrawArea| {
         draw_area.clear();
-        writeln!(draw_area, "{} total chunks", stats.borrow().chunks).unwrap();
-        writeln!(draw_area, "{} unique chunks", stats.borrow().unique).unwrap();
-        writeln!(draw_area, "{} chunks to fetch", stats.borrow().fetch).unwrap();
-        writeln!(draw_area, "{} chunks received", stats.borrow().recv).unwrap();
-        writeln!(draw_area, "{} packets received", stats.borrow().pack_recv).unwrap();
-        writeln!(draw_area, "{} chunks requested", stats.borrow().requested).unwrap();
+        let stats = stats.borrow();
+        writeln!(draw_area, "{} total chunks", stats.chunks).unwrap();
+        writeln!(
+            draw_area,
+            "{} / {} unique chunks scanned",
+            stats.scanned, stats.unique
+        )
+        .unwrap();
+        writeln!(
+            draw_area,
+            "{} chunks known to be up to date",
+            stats.up_to_date
+        )
+        .unwrap();
+        writeln!(draw_area, "{} chunks found on disk", stats.found).unwrap();
+        writeln!(draw_area, "{} chunks to fetch", stats.fetch).unwrap();
+        writeln!(draw_area, "{} chunks received", stats.recv).unwrap();
+        writeln!(draw_area, "{} packets received", stats.pack_recv).unwrap();
+        writeln!(
+            draw_area,
+            "{} packets dropped by the receive queue",
+            stats.dropped
+        )
+        .unwrap();
+        writeln!(draw_area, "{} chunks requested", stats.requested).unwrap();
+        writeln!(
+            draw_area,
+            "{} partially received chunks spilled to disk",
+            stats.spilled
+        )
+        .unwrap();
     };
 
     update_content(draw);
@@ -132,102 +544,224 @@ pub async fn flash(server_addr: SocketAddrV4) -> Result<()> {
         Ok(())
     };
 
-    let mut disk = disk::Disk::largest();
+    // The disks are about to be changed, so the record of their content is not valid anymore.
+    flashed_version().delete()?;
+
+    // Chunk packets are received without going through smoltcp, which is too slow for them; the
+    // socket is only used to send requests.
+    let receiver = FastUdpReceiver::bind(CHUNKS_PORT, rx_queue).await?;
+    let socket = UdpSocket::bind(None).await?;
+    let chunks_info = RefCell::new(chunks_info);
+
+    let send_progress = async || {
+        // Chunks are done when found on the disk or received.
+        let stats = stats.borrow().clone();
+        let msg = UdpRequest::ActionProgress(Action::Flash, stats.found + stats.recv, stats.unique);
+        socket
+            .send_to(server_addr, &postcard::to_allocvec(&msg)?)
+            .await
+    };
 
-    for (hash, (size, csize, pos)) in mem::take(&mut chunks_info) {
-        let mut found = None;
-        let mut buf = vec![0; size];
-        for &offset in &pos {
-            disk.read(offset as u64, &mut buf).await.unwrap();
-            if blake3::hash(&buf).as_bytes() == &hash {
-                found = Some(offset);
-                break;
-            }
-        }
-        if let Some(found) = found {
-            for &offset in &pos {
-                if offset != found {
-                    disk.write(offset as u64, &buf).await.unwrap();
+    // Looks for the chunks on the disk while they are being received; chunks are requested only
+    // after checking that they are not on the disk, but they are accepted if broadcasted anyway.
+    let scan_task = async {
+        let hashes: Vec<ChunkHash> = chunks_info.borrow().keys().copied().collect();
+        for hash in hashes {
+            let Some((size, pos)) = chunks_info
+                .borrow()
+                .get(&hash)
+                .map(|info| (info.size, info.pos.clone()))
+            else {
+                // Already received.
+                continue;
+            };
+
+            let (known, unknown): (Vec<Position>, Vec<Position>) =
+                pos.iter().copied().partition(is_up_to_date);
+            stats.borrow_mut().up_to_date += known.len();
+
+            let mut found = None;
+            let mut buf = if unknown.is_empty() {
+                Vec::new()
+            } else {
+                vec![0; size]
+            };
+            if unknown.is_empty() {
+                found = known.first().copied();
+            } else if let Some(&(index, offset)) = known.first() {
+                disks[index].read(offset as u64, &mut buf).await?;
+                found = Some((index, offset));
+            } else {
+                for &(index, offset) in &pos {
+                    disks[index].read(offset as u64, &mut buf).await?;
+                    if blake3::hash(&buf).as_bytes() == &hash {
+                        found = Some((index, offset));
+                        break;
+                    }
                 }
             }
-        } else {
-            chunks_info.insert(hash, (size, csize, pos));
-            stats.borrow_mut().fetch = chunks_info.len();
-        }
-        update_content(draw);
-    }
 
-    info!("Disk scanned; {} chunks to fetch", stats.borrow().fetch);
-
-    let socket = UdpSocket::bind(Some(CHUNKS_PORT)).await?;
-    let mut buf = [0; ETH_PACKET_SIZE];
+            let Some(found) = found else {
+                let mut stats = stats.borrow_mut();
+                stats.scanned += 1;
+                if let Some(info) = chunks_info.borrow_mut().get_mut(&hash) {
+                    info.scanned = true;
+                    stats.fetch += 1;
+                }
+                continue;
+            };
+            {
+                let mut stats = stats.borrow_mut();
+                stats.scanned += 1;
+                // If the chunk was received in the meantime, it is being written already.
+                if chunks_info.borrow_mut().remove(&hash).is_none() {
+                    continue;
+                }
+                stats.found += 1;
+            }
 
-    let mut received = BTreeMap::new();
+            for &(index, offset) in &unknown {
+                if (index, offset) != found {
+                    disks[index].write(offset as u64, buf.clone()).await?;
+                }
+            }
+            send_progress().await?;
+        }
+        info!("Disk scanned; {} chunks to fetch", stats.borrow().fetch);
+        Ok::<_, Error>(())
+    };
 
     let (tx, rx) = thingbuf::mpsc::channel(128);
+    // Chunks received but not yet written to disk.
+    let backlog = Cell::new(0usize);
 
     let task1 = async {
         let tx = tx;
-        let mut last_seen = Vec::new();
+        // Congestion-control style window: it grows while the chunks requested last time are
+        // received, and halves on packet loss or when the disk cannot keep up.
+        let mut window = 4 * MIN_WINDOW;
+        let mut recv_since_request = 0;
+        let mut lost_since_request = 0;
+        let mut report_packets = 0;
+        let mut report_lost = 0;
+        let mut next_report = Timer::micros() + REPORT_INTERVAL.as_micros() as i64;
         let free_mem = memory::stats().free;
-        let max_chunks = (free_mem.saturating_sub(MIN_MEMORY) as usize / MAX_CHUNK_SIZE).max(128);
+        let max_chunks =
+            (free_mem.saturating_sub(MIN_MEMORY) as usize / MAX_CHUNK_SIZE).max(MIN_DECODERS);
+        let mut decoders = DecoderPool::new(max_chunks);
         log::debug!(
             "Free memory: {}. Max chunks in memory: {max_chunks}",
             BytesFmt(free_mem)
         );
-        while !chunks_info.is_empty() {
-            let recv = Box::pin(socket.recv_from(&mut buf));
+        let mut next_request = Timer::micros();
+        while !chunks_info.borrow().is_empty() {
+            let recv = Box::pin(receiver.recv());
             let sleep = Box::pin(Executor::sleep(Duration::from_millis(100)));
+            // Nothing was received for a while: the chunks requested last time were either all
+            // sent or lost.
+            let mut idle = false;
             match select(recv, sleep).await {
-                Either::Left(((buf, _addr), _)) => {
-                    stats.borrow_mut().pack_recv += 1;
-                    assert!(buf.len() >= 34);
+                Either::Left((datagram, _)) => {
+                    let buf = datagram.payload();
+                    {
+                        let mut stats = stats.borrow_mut();
+                        stats.pack_recv += 1;
+                        stats.dropped = receiver.dropped();
+                    }
+                    report_packets += 1;
+                    metrics::PACKETS_RECEIVED.fetch_add(1, Ordering::Relaxed);
+                    if buf.len() < 34 {
+                        log::warn!("Received truncated chunk packet from {}", datagram.src());
+                        continue;
+                    }
 
-                    let chunk =
-                        handle_packet(buf, &mut chunks_info, &mut received, &mut last_seen)?;
+                    let mut lost = 0;
+                    let chunk = handle_packet(
+                        buf,
+                        &mut chunks_info.borrow_mut(),
+                        &mut decoders,
+                        &disks,
+                        &mut lost,
+                    )?;
+                    stats.borrow_mut().spilled = decoders.spilled();
+                    report_lost += lost;
+                    lost_since_request += lost;
+                    metrics::PACKETS_LOST.fetch_add(lost as u64, Ordering::Relaxed);
                     if let Some((pos, data)) = chunk {
+                        metrics::CHUNKS_DECODED.fetch_add(1, Ordering::Relaxed);
+                        recv_since_request += 1;
+                        backlog.set(backlog.get() + 1);
                         tx.send((pos, data)).await.expect("receiver was dropped");
                     }
+                }
+                Either::Right(((), _sleep)) => idle = true,
+            }
 
-                    assert_eq!(last_seen.len(), received.len());
-                    if last_seen.len() > max_chunks {
-                        let hash = last_seen.remove(0);
-                        received
-                            .remove(&hash)
-                            .expect("last_seen should contain only received chunks");
-                    }
+            // More chunks are requested as soon as the window was received, without waiting for
+            // the broadcast to go idle, and at least every REQUEST_INTERVAL.
+            let now = Timer::micros();
+            if idle || recv_since_request >= window || now >= next_request {
+                next_request = now + REQUEST_INTERVAL.as_micros() as i64;
+                if lost_since_request > 0 || backlog.get() > MAX_BACKLOG {
+                    window = (window / 2).max(MIN_WINDOW);
+                } else if 2 * recv_since_request >= window {
+                    window = (window + recv_since_request).min(MAX_WINDOW);
                 }
-                Either::Right(((), _sleep)) => {
-                    // TODO(virv): compute the number of chunks to request
-                    let chunks: Vec<_> =
-                        chunks_info.iter().take(40).map(|(hash, _)| *hash).collect();
-                    stats.borrow_mut().requested += chunks.len();
-                    let msg = postcard::to_allocvec(&UdpRequest::RequestChunks(chunks)).unwrap();
+                recv_since_request = 0;
+                lost_since_request = 0;
+
+                let chunks: Vec<_> = chunks_info
+                    .borrow()
+                    .iter()
+                    .filter(|(_, info)| info.scanned)
+                    .take(window)
+                    .map(|(hash, _)| *hash)
+                    .collect();
+                stats.borrow_mut().requested += chunks.len();
+                // Large windows do not fit in a single packet.
+                for chunks in chunks.chunks(MAX_REQUEST_CHUNKS) {
+                    let msg = postcard::to_allocvec(&UdpRequest::RequestChunks(chunks.to_vec()))?;
                     socket.send_to(server_addr, &msg).await?;
                 }
             }
+
+            let now = Timer::micros();
+            if now >= next_report {
+                next_report = now + REPORT_INTERVAL.as_micros() as i64;
+                if report_packets > 0 {
+                    let msg = postcard::to_allocvec(&UdpRequest::ReceiverReport {
+                        received: report_packets,
+                        lost: report_lost as u32,
+                        backlog: backlog.get() as u32,
+                    })?;
+                    socket.send_to(server_addr, &msg).await?;
+                }
+                report_packets = 0;
+                report_lost = 0;
+            }
         }
         Ok::<_, Error>(())
     };
 
     let task2 = async {
         while let Some((pos, data)) = rx.recv().await {
-            for offset in pos {
-                disk.write(offset as u64, &data).await?;
+            let (&last, others) = pos.split_last().expect("chunk without positions");
+            for &(index, offset) in others {
+                disks[index].write(offset as u64, data.clone()).await?;
             }
+            let (index, offset) = last;
+            disks[index].write(offset as u64, data).await?;
+            backlog.set(backlog.get() - 1);
 
             stats.borrow_mut().recv += 1;
-
-            let msg = UdpRequest::ActionProgress(stats.borrow().recv, stats.borrow().fetch);
-            socket
-                .send_to(server_addr, &postcard::to_allocvec(&msg)?)
-                .await?;
+            send_progress().await?;
         }
         done.set(true);
         Ok(())
     };
 
-    let ((), (), ()) = futures::try_join!(task1, task2, draw_task)?;
+    let ((), (), (), ()) = futures::try_join!(scan_task, task1, task2, draw_task)?;
+    futures::future::try_join_all(disks.iter().map(|disk| disk.flush())).await?;
 
     info!("Fetch complete, updating boot options");
 
@@ -236,13 +770,26 @@ pub async fn flash(server_addr: SocketAddrV4) -> Result<()> {
     if let Some(target) = reboot_target {
         order = order
             .into_iter()
-            .map(|x| if x != target { x } else { image.boot_option_id })
+            .map(|x| {
+                if x != target {
+                    x
+                } else {
+                    header.boot_option_id
+                }
+            })
             .collect();
     } else {
-        order.push(image.boot_option_id);
+        order.push(header.boot_option_id);
     };
     BootOptions::set_order(&order);
-    BootOptions::set(image.boot_option_id, &image.boot_entry);
+    BootOptions::set(header.boot_option_id, &header.boot_entry);
+
+    if let Some(version) = version {
+        flashed_version().set(
+            version.as_bytes(),
+            VariableAttributes::NON_VOLATILE | VariableAttributes::BOOTSERVICE_ACCESS,
+        )?;
+    }
 
     Ok(())
 }
@@ -22,6 +22,7 @@ use crate::register::register;
 use crate::store::store;
 
 mod flash;
+mod metrics;
 mod os;
 mod parse_disk;
 mod power_control;
@@ -113,6 +114,12 @@ async fn run() -> Result<()> {
         }
     });
 
+    Executor::spawn("metrics", async move {
+        if let Err(e) = metrics::report(server).await {
+            log::warn!("Stopped reporting metrics: {e}");
+        }
+    });
+
     loop {
         update_content(|d| d.clear());
         if !last_was_wait {
@@ -0,0 +1,56 @@
+//! Metrics reported periodically to the server, to find slow machines and bottlenecks.
+
+use core::net::SocketAddrV4;
+use core::sync::atomic::{AtomicU64, Ordering};
+use core::time::Duration;
+
+use pixie_shared::{ClientMetrics, UdpRequest};
+
+use crate::os::disk;
+use crate::os::error::Result;
+use crate::os::executor::Executor;
+use crate::os::net::{self, UdpSocket};
+use crate::os::timer::Timer;
+
+const REPORT_INTERVAL: Duration = Duration::from_secs(5);
+/// Number of tasks included in a report, which must fit in a single packet.
+const MAX_TASKS: usize = 16;
+const MAX_TASK_NAME_LEN: usize = 32;
+
+/// Counters of the chunk decoders, updated while flashing.
+pub static PACKETS_RECEIVED: AtomicU64 = AtomicU64::new(0);
+pub static PACKETS_LOST: AtomicU64 = AtomicU64::new(0);
+pub static CHUNKS_DECODED: AtomicU64 = AtomicU64::new(0);
+
+fn collect() -> ClientMetrics {
+    let (mut tasks, timers) = Executor::metrics(MAX_TASKS);
+    for task in &mut tasks {
+        if let Some((end, _)) = task.name.char_indices().nth(MAX_TASK_NAME_LEN) {
+            task.name.truncate(end);
+        }
+    }
+    let (disk_read, disk_written) = disk::io_bytes();
+    let (net_rx, net_tx) = net::io_bytes();
+    ClientMetrics {
+        uptime_micros: Timer::micros() as u64,
+        tasks,
+        timers: timers as u32,
+        disk_read,
+        disk_written,
+        net_rx,
+        net_tx,
+        packets_received: PACKETS_RECEIVED.load(Ordering::Relaxed),
+        packets_lost: PACKETS_LOST.load(Ordering::Relaxed),
+        chunks_decoded: CHUNKS_DECODED.load(Ordering::Relaxed),
+    }
+}
+
+/// Sends the metrics to the server every [`REPORT_INTERVAL`].
+pub async fn report(server: SocketAddrV4) -> Result<()> {
+    let socket = UdpSocket::bind(None).await?;
+    loop {
+        let msg = postcard::to_allocvec(&UdpRequest::Metrics(collect()))?;
+        socket.send_to(server, &msg).await?;
+        Executor::sleep(REPORT_INTERVAL).await;
+    }
+}
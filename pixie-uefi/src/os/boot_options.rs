@@ -4,7 +4,7 @@ use alloc::vec::Vec;
 
 use uefi::proto::device_path::DevicePath;
 use uefi::runtime::{VariableAttributes, VariableVendor};
-use uefi::{CStr16, CString16};
+use uefi::{CStr16, CString16, Status};
 
 use crate::os::error::{Error, Result};
 
@@ -34,6 +34,16 @@ impl Variable {
         uefi::runtime::set_variable(&self.name, &self.vendor, attrs, data)
             .map_err(|e| Error(format!("Error setting variable: {e:?}")))
     }
+
+    /// Deletes the variable, if it exists.
+    pub fn delete(&self) -> Result<()> {
+        match uefi::runtime::delete_variable(&self.name, &self.vendor) {
+            Err(e) if e.status() != Status::NOT_FOUND => {
+                Err(Error(format!("Error deleting variable: {e:?}")))
+            }
+            _ => Ok(()),
+        }
+    }
 }
 
 pub struct BootOptions;
@@ -1,19 +1,50 @@
+use alloc::boxed::Box;
+use alloc::collections::{BTreeMap, VecDeque};
 use alloc::string::{String, ToString};
 use alloc::vec::Vec;
+use core::cell::{Cell, RefCell};
+use core::hint::spin_loop;
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicU64, Ordering};
 
 use gpt_disk_io::BlockIo;
 use gpt_disk_io::gpt_disk_types::{BlockSize, Lba};
-use uefi::Handle;
-use uefi::boot::{OpenProtocolParams, ScopedProtocol};
+use uefi::boot::{EventType, OpenProtocolParams, ScopedProtocol, Tpl};
+use uefi::proto::ProtocolPointer;
 use uefi::proto::media::block::BlockIO;
+use uefi::proto::media::disk::{DiskIo2, DiskIo2Token};
+use uefi::{Handle, Status, StatusExt};
 
 use super::error::Result;
 use crate::os::executor::Executor;
 
-fn open_disk(handle: Handle) -> Result<ScopedProtocol<BlockIO>> {
+/// Maximum number of writes submitted to the disk and not completed yet.
+const MAX_PENDING_WRITES: usize = 8;
+
+/// Buffered writes are submitted once a contiguous run reaches this size...
+const MAX_RUN_LEN: usize = 2 << 20;
+/// ... or once this much data is buffered in total.
+const MAX_COMBINED_LEN: usize = 8 << 20;
+
+/// The buffer used for unaligned accesses is not kept if it grows past this size.
+const MAX_SCRATCH_LEN: usize = 8 << 20;
+
+/// Bytes read from and written to all the disks.
+static BYTES_READ: AtomicU64 = AtomicU64::new(0);
+static BYTES_WRITTEN: AtomicU64 = AtomicU64::new(0);
+
+/// Returns the number of bytes read from and written to all the disks so far.
+pub fn io_bytes() -> (u64, u64) {
+    (
+        BYTES_READ.load(Ordering::Relaxed),
+        BYTES_WRITTEN.load(Ordering::Relaxed),
+    )
+}
+
+fn open_disk<P: ProtocolPointer + ?Sized>(handle: Handle) -> Result<ScopedProtocol<P>> {
     let image_handle = uefi::boot::image_handle();
     let bio = unsafe {
-        uefi::boot::open_protocol::<BlockIO>(
+        uefi::boot::open_protocol::<P>(
             OpenProtocolParams {
                 agent: image_handle,
                 controller: None,
@@ -33,33 +64,202 @@ pub struct DiskPartition {
     pub name: String,
 }
 
+/// An asynchronous DiskIo2 operation. Its token, and the buffer it uses, must stay alive until
+/// it completes: dropping it waits for completion.
+struct Request {
+    token: Box<DiskIo2Token>,
+    submitted: bool,
+    done: Cell<bool>,
+}
+
+impl Request {
+    fn new() -> Result<Self> {
+        // SAFETY: the event has no notification function.
+        let event =
+            unsafe { uefi::boot::create_event(EventType::empty(), Tpl::CALLBACK, None, None)? };
+        Ok(Request {
+            token: Box::new(DiskIo2Token {
+                event: Some(event),
+                transaction_status: Status::SUCCESS,
+            }),
+            submitted: false,
+            done: Cell::new(false),
+        })
+    }
+
+    fn token(&mut self) -> Option<NonNull<DiskIo2Token>> {
+        Some(NonNull::from(&mut *self.token))
+    }
+
+    fn is_done(&self) -> bool {
+        if !self.done.get() {
+            let event = self.token.event.as_ref().unwrap();
+            // SAFETY: the event is only closed when the request is dropped. Checking the event
+            // resets it, so the result is remembered.
+            let signaled = uefi::boot::check_event(unsafe { event.unsafe_clone() });
+            // An error would mean that the event will never be signaled.
+            self.done.set(signaled.unwrap_or(true));
+        }
+        self.done.get()
+    }
+
+    fn status(&self) -> Result<()> {
+        Ok(self.token.transaction_status.to_result()?)
+    }
+
+    async fn wait(&self) -> Result<()> {
+        while !self.is_done() {
+            Executor::sched_yield().await;
+        }
+        self.status()
+    }
+}
+
+impl Drop for Request {
+    fn drop(&mut self) {
+        if self.submitted {
+            while !self.is_done() {
+                spin_loop();
+            }
+        }
+        if let Some(event) = self.token.event.take() {
+            let _ = uefi::boot::close_event(event);
+        }
+    }
+}
+
+struct PendingWrite {
+    // Dropped first, waiting for the write to complete before freeing the data.
+    request: Request,
+    offset: u64,
+    data: Vec<u8>,
+}
+
+impl PendingWrite {
+    fn overlaps(&self, offset: u64, len: usize) -> bool {
+        offset < self.offset + self.data.len() as u64 && self.offset < offset + len as u64
+    }
+}
+
+/// Writes not submitted to the disk yet, merged into contiguous runs keyed by their offset.
+#[derive(Default)]
+struct WriteCombiner {
+    runs: BTreeMap<u64, Vec<u8>>,
+    /// Total size of the runs.
+    len: usize,
+}
+
+impl WriteCombiner {
+    /// Removes the runs overlapping the given range, in order of offset.
+    fn take_overlapping(&mut self, offset: u64, len: usize) -> Vec<(u64, Vec<u8>)> {
+        let end = offset + len as u64;
+        let starts: Vec<u64> = self
+            .runs
+            .range(..end)
+            .rev()
+            .take_while(|(start, run)| **start + run.len() as u64 > offset)
+            .map(|(start, _)| *start)
+            .collect();
+        starts
+            .into_iter()
+            .rev()
+            .map(|start| (start, self.remove(start)))
+            .collect()
+    }
+
+    fn remove(&mut self, start: u64) -> Vec<u8> {
+        let run = self.runs.remove(&start).unwrap();
+        self.len -= run.len();
+        run
+    }
+
+    /// Adds a write that does not overlap any run, returning the offset of the run containing it.
+    fn insert(&mut self, offset: u64, data: Vec<u8>) -> u64 {
+        self.len += data.len();
+        let end = offset + data.len() as u64;
+        let prev = self
+            .runs
+            .range(..offset)
+            .next_back()
+            .filter(|(start, run)| **start + run.len() as u64 == offset)
+            .map(|(start, _)| *start);
+        let (start, mut run) = match prev {
+            Some(start) => {
+                let mut run = self.runs.remove(&start).unwrap();
+                run.extend_from_slice(&data);
+                (start, run)
+            }
+            None => (offset, data),
+        };
+        if let Some(next) = self.runs.remove(&end) {
+            run.extend_from_slice(&next);
+        }
+        self.runs.insert(start, run);
+        start
+    }
+}
+
+/// Access to a disk. If the firmware supports DiskIo2, reads and writes run asynchronously, with
+/// up to [`MAX_PENDING_WRITES`] writes in flight, so that other tasks (and network polling) can
+/// run meanwhile; otherwise they block, after yielding to the other tasks once. Writes are also
+/// combined into large transfers, see [`Disk::write`].
 pub struct Disk {
-    block: ScopedProtocol<BlockIO>,
+    combiner: RefCell<WriteCombiner>,
+    // Dropped first, waiting for the writes to complete before closing the protocols.
+    pending: RefCell<VecDeque<PendingWrite>>,
+    /// Aligned buffer for unaligned accesses.
+    scratch: RefCell<Vec<u8>>,
+    block: RefCell<ScopedProtocol<BlockIO>>,
+    disk_io: Option<RefCell<ScopedProtocol<DiskIo2>>>,
 }
 
-// TODO(veluca): consider making parts of this actually async, i.e. by using DiskIo2/BlockIO2 if
-// available; support having more than one disk.
 impl Disk {
-    pub fn largest() -> Disk {
-        let (_size, handle) = uefi::boot::find_handles::<BlockIO>()
+    fn open(handle: Handle) -> Disk {
+        let block = open_disk::<BlockIO>(handle).unwrap();
+        let disk_io = match open_disk::<DiskIo2>(handle) {
+            Ok(disk_io) => Some(RefCell::new(disk_io)),
+            Err(err) => {
+                log::info!("DiskIo2 not available, using blocking disk access: {err:?}");
+                None
+            }
+        };
+        Disk {
+            combiner: RefCell::default(),
+            pending: RefCell::new(VecDeque::new()),
+            scratch: RefCell::new(Vec::new()),
+            block: RefCell::new(block),
+            disk_io,
+        }
+    }
+
+    /// Opens all the disks, from the biggest to the smallest. Removable disks are ignored, unless
+    /// there is no other disk.
+    pub fn all() -> Vec<Disk> {
+        let mut disks: Vec<_> = uefi::boot::find_handles::<BlockIO>()
             .unwrap()
             .into_iter()
             .filter_map(|handle| {
-                let Ok(block) = open_disk(handle) else {
+                let Ok(block) = open_disk::<BlockIO>(handle) else {
                     return None;
                 };
                 let m = block.media();
-                if !m.is_media_present() {
+                // Partitions also have their own BlockIO.
+                if !m.is_media_present() || m.is_logical_partition() {
                     return None;
                 }
                 let size = (m.last_block() as u128 + 1) * (m.block_size() as u128);
-                Some((size, handle))
+                Some((m.is_removable_media(), size, handle))
             })
-            .max_by_key(|(size, _)| *size)
-            .expect("Disk not found");
-
-        let block = open_disk(handle).unwrap();
-        Disk { block }
+            .collect();
+        if disks.iter().any(|(removable, _, _)| !removable) {
+            disks.retain(|(removable, _, _)| !removable);
+        }
+        disks.sort_by_key(|(_, size, _)| core::cmp::Reverse(*size));
+        assert!(!disks.is_empty(), "Disk not found");
+        disks
+            .into_iter()
+            .map(|(_, _, handle)| Disk::open(handle))
+            .collect()
     }
 
     #[cfg(feature = "coverage")]
@@ -68,7 +268,7 @@ impl Disk {
             .unwrap()
             .into_iter()
             .filter_map(|handle| {
-                let Ok(block) = open_disk(handle) else {
+                let Ok(block) = open_disk::<BlockIO>(handle) else {
                     return None;
                 };
                 let m = block.media();
@@ -81,84 +281,263 @@ impl Disk {
             .min_by_key(|(size, _)| *size)
             .expect("Disk not found");
 
-        let block = open_disk(handle).unwrap();
-        Disk { block }
+        Disk::open(handle)
     }
 
     pub fn size(&self) -> u64 {
-        self.block.media().block_size() as u64 * (self.block.media().last_block() + 1)
+        let block = self.block.borrow();
+        block.media().block_size() as u64 * (block.media().last_block() + 1)
     }
 
-    pub async fn flush(&mut self) -> Result<()> {
-        self.block.flush_blocks()?;
+    /// Submits all the buffered writes, waits for them, and flushes the disk caches.
+    pub async fn flush(&self) -> Result<()> {
+        self.submit_combined().await?;
+        while let Some(write) = self.pending.borrow_mut().pop_front() {
+            write.request.wait().await?;
+        }
+        self.block.borrow_mut().flush_blocks()?;
         Ok(())
     }
 
-    pub fn read_sync(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
-        let block_size = self.block.media().block_size() as u64;
-        let media_id = self.block.media().media_id();
-        let start_block = offset / block_size;
-        let end_block = (offset + buf.len() as u64).div_ceil(block_size);
-        let num_blocks = end_block - start_block;
-        if buf.len() as u64 != num_blocks * block_size
-            || !(buf.as_ptr() as usize).is_multiple_of(16)
+    /// Waits for the completed pending writes, and for those overlapping the given range, after
+    /// writing any buffered data overlapping it.
+    fn wait_pending_sync(&self, offset: u64, len: usize) -> Result<()> {
+        let runs = self.combiner.borrow_mut().take_overlapping(offset, len);
+        for (start, run) in runs {
+            self.wait_pending_sync(start, run.len())?;
+            self.raw_write_sync(start, &run)?;
+        }
+
+        let mut pending = self.pending.borrow_mut();
+        while let Some(last) = pending
+            .iter()
+            .rposition(|write| write.request.is_done() || write.overlaps(offset, len))
         {
-            //log::warn!(
-            //    "Unaligned read: offset {}, block size {}, buf addr {:p}, buf len {}",
-            //    offset,
-            //    block_size,
-            //    buf.as_ptr(),
-            //    buf.len()
-            //);
-            let mut buf2 = vec![0u8; (num_blocks * block_size) as usize + 15];
-            let delta = buf2.as_ptr().align_offset(16);
-            let buf2 = &mut buf2[delta..delta + (num_blocks * block_size) as usize];
-            self.block.read_blocks(media_id, start_block, buf2)?;
-            let start_offset = (offset % block_size) as usize;
-            buf.copy_from_slice(&buf2[start_offset..start_offset + buf.len()]);
-        } else {
-            self.block.read_blocks(media_id, start_block, buf)?;
+            // Writes are waited for in order, so that errors are reported by the next operation.
+            for write in pending.drain(..=last) {
+                while !write.request.is_done() {
+                    spin_loop();
+                }
+                write.request.status()?;
+            }
         }
         Ok(())
     }
 
-    pub async fn read(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
-        Executor::sched_yield().await;
-        self.read_sync(offset, buf)
+    /// Asynchronous version of [`Disk::wait_pending_sync`], which also waits until fewer than
+    /// `max_pending` writes are pending.
+    async fn wait_pending(&self, offset: u64, len: usize, max_pending: usize) -> Result<()> {
+        let runs = self.combiner.borrow_mut().take_overlapping(offset, len);
+        for (start, run) in runs {
+            self.submit_write(start, run).await?;
+        }
+        self.wait_submitted(offset, len, max_pending).await
     }
 
-    pub fn write_sync(&mut self, offset: u64, buf: &[u8]) -> Result<()> {
-        let block_size = self.block.media().block_size() as u64;
-        let media_id = self.block.media().media_id();
+    /// Waits for the completed pending writes, for those overlapping the given range, and until
+    /// fewer than `max_pending` writes are pending. Unlike [`Disk::wait_pending`], buffered data
+    /// is not written.
+    async fn wait_submitted(&self, offset: u64, len: usize, max_pending: usize) -> Result<()> {
+        loop {
+            let write = {
+                let mut pending = self.pending.borrow_mut();
+                let wait = pending.len() >= max_pending
+                    || pending
+                        .iter()
+                        .any(|write| write.request.is_done() || write.overlaps(offset, len));
+                if !wait {
+                    return Ok(());
+                }
+                pending.pop_front().unwrap()
+            };
+            write.request.wait().await?;
+        }
+    }
+
+    /// Runs `f` on a buffer of `num_bytes` bytes aligned as required by the media. The buffer is
+    /// reused across calls.
+    fn with_aligned_buf<T>(&self, num_bytes: usize, f: impl FnOnce(&mut [u8]) -> T) -> T {
+        let align = (self.block.borrow().media().io_align() as usize).max(16);
+        let mut scratch = self.scratch.borrow_mut();
+        if scratch.len() < num_bytes + align - 1 {
+            scratch.resize(num_bytes + align - 1, 0);
+        }
+        let delta = scratch.as_ptr().align_offset(align);
+        let ret = f(&mut scratch[delta..delta + num_bytes]);
+        if scratch.capacity() > MAX_SCRATCH_LEN {
+            *scratch = Vec::new();
+        }
+        ret
+    }
+
+    fn is_aligned(&self, offset: u64, buf: &[u8]) -> bool {
+        let block = self.block.borrow();
+        let align = (block.media().io_align() as usize).max(16);
+        let block_size = block.media().block_size() as u64;
+        offset.is_multiple_of(block_size)
+            && (buf.len() as u64).is_multiple_of(block_size)
+            && (buf.as_ptr() as usize).is_multiple_of(align)
+    }
+
+    fn raw_read_sync(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        BYTES_READ.fetch_add(buf.len() as u64, Ordering::Relaxed);
+        let (block_size, media_id) = {
+            let block = self.block.borrow();
+            (block.media().block_size() as u64, block.media().media_id())
+        };
         let start_block = offset / block_size;
+        if self.is_aligned(offset, buf) {
+            return Ok(self
+                .block
+                .borrow()
+                .read_blocks(media_id, start_block, buf)?);
+        }
         let end_block = (offset + buf.len() as u64).div_ceil(block_size);
-        let num_blocks = end_block - start_block;
-        if buf.len() as u64 != num_blocks * block_size
-            || !(buf.as_ptr() as usize).is_multiple_of(16)
-        {
-            //log::warn!(
-            //    "Unaligned write: offset {}, block size {}, buf addr {:p}, buf len {}",
-            //    offset,
-            //    block_size,
-            //    buf.as_ptr(),
-            //    buf.len()
-            //);
-            let mut buf2 = vec![0u8; (num_blocks * block_size) as usize + 15];
-            let delta = buf2.as_ptr().align_offset(16);
-            let buf2 = &mut buf2[delta..delta + (num_blocks * block_size) as usize];
-            self.block.read_blocks(media_id, start_block, buf2)?;
+        let num_bytes = ((end_block - start_block) * block_size) as usize;
+        self.with_aligned_buf(num_bytes, |buf2| {
+            self.block
+                .borrow()
+                .read_blocks(media_id, start_block, buf2)?;
+            let start_offset = (offset % block_size) as usize;
+            buf.copy_from_slice(&buf2[start_offset..start_offset + buf.len()]);
+            Ok(())
+        })
+    }
+
+    fn raw_write_sync(&self, offset: u64, buf: &[u8]) -> Result<()> {
+        BYTES_WRITTEN.fetch_add(buf.len() as u64, Ordering::Relaxed);
+        let (block_size, media_id) = {
+            let block = self.block.borrow();
+            (block.media().block_size() as u64, block.media().media_id())
+        };
+        let start_block = offset / block_size;
+        if self.is_aligned(offset, buf) {
+            return Ok(self
+                .block
+                .borrow_mut()
+                .write_blocks(media_id, start_block, buf)?);
+        }
+        let end_block = (offset + buf.len() as u64).div_ceil(block_size);
+        let num_bytes = ((end_block - start_block) * block_size) as usize;
+        self.with_aligned_buf(num_bytes, |buf2| {
+            let mut block = self.block.borrow_mut();
             let start_offset = (offset % block_size) as usize;
+            // Only the first and last blocks may be partially overwritten.
+            if start_offset != 0 {
+                block.read_blocks(media_id, start_block, &mut buf2[..block_size as usize])?;
+            }
+            if !(offset + buf.len() as u64).is_multiple_of(block_size) {
+                let last = num_bytes - block_size as usize;
+                block.read_blocks(media_id, end_block - 1, &mut buf2[last..])?;
+            }
             buf2[start_offset..start_offset + buf.len()].copy_from_slice(buf);
-            self.block.write_blocks(media_id, start_block, buf2)?;
-        } else {
-            self.block.write_blocks(media_id, start_block, buf)?;
+            Ok(block.write_blocks(media_id, start_block, buf2)?)
+        })
+    }
+
+    pub fn read_sync(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        self.wait_pending_sync(offset, buf.len())?;
+        self.raw_read_sync(offset, buf)
+    }
+
+    pub async fn read(&self, offset: u64, buf: &mut [u8]) -> Result<()> {
+        let Some(disk_io) = &self.disk_io else {
+            Executor::sched_yield().await;
+            return self.read_sync(offset, buf);
+        };
+        self.wait_pending(offset, buf.len(), usize::MAX).await?;
+        let mut request = Request::new()?;
+        let token = request.token();
+        let media_id = self.block.borrow().media().media_id();
+        // SAFETY: the buffer outlives the request, as dropping the request waits for it to
+        // complete.
+        unsafe {
+            disk_io.borrow_mut().read_disk_raw(
+                media_id,
+                offset,
+                token,
+                buf.len(),
+                buf.as_mut_ptr(),
+            )?
+        };
+        request.submitted = true;
+        BYTES_READ.fetch_add(buf.len() as u64, Ordering::Relaxed);
+        request.wait().await
+    }
+
+    pub fn write_sync(&self, offset: u64, buf: &[u8]) -> Result<()> {
+        self.wait_pending_sync(offset, buf.len())?;
+        self.raw_write_sync(offset, buf)
+    }
+
+    /// Writes `data` at `offset`.
+    ///
+    /// Writes are buffered and merged with adjacent ones, and only submitted to the disk as
+    /// large transfers, in order of offset, once enough of them are buffered or on
+    /// [`Disk::flush`]. Later operations on overlapping ranges wait for them, and errors may be
+    /// reported by a later operation.
+    pub async fn write(&self, offset: u64, data: Vec<u8>) -> Result<()> {
+        let runs = self
+            .combiner
+            .borrow_mut()
+            .take_overlapping(offset, data.len());
+        for (start, run) in runs {
+            self.submit_write(start, run).await?;
+        }
+        let (start, run_len, total_len) = {
+            let mut combiner = self.combiner.borrow_mut();
+            let start = combiner.insert(offset, data);
+            (start, combiner.runs[&start].len(), combiner.len)
+        };
+        if run_len >= MAX_RUN_LEN {
+            let run = self.combiner.borrow_mut().remove(start);
+            self.submit_write(start, run).await?;
+        } else if total_len >= MAX_COMBINED_LEN {
+            self.submit_combined().await?;
+        }
+        Ok(())
+    }
+
+    async fn submit_combined(&self) -> Result<()> {
+        let runs = core::mem::take(&mut *self.combiner.borrow_mut()).runs;
+        for (start, run) in runs {
+            self.submit_write(start, run).await?;
         }
         Ok(())
     }
 
-    pub async fn write(&mut self, offset: u64, buf: &[u8]) -> Result<()> {
-        Executor::sched_yield().await;
-        self.write_sync(offset, buf)
+    /// Submits a write to the disk. With DiskIo2 this returns as soon as the write is submitted.
+    async fn submit_write(&self, offset: u64, data: Vec<u8>) -> Result<()> {
+        let Some(disk_io) = &self.disk_io else {
+            Executor::sched_yield().await;
+            return self.write_sync(offset, &data);
+        };
+        // The data was taken from the combiner, whose runs do not overlap each other, so only the
+        // submitted writes need to be waited for.
+        self.wait_submitted(offset, data.len(), MAX_PENDING_WRITES)
+            .await?;
+        let mut write = PendingWrite {
+            request: Request::new()?,
+            offset,
+            data,
+        };
+        let token = write.request.token();
+        let media_id = self.block.borrow().media().media_id();
+        // SAFETY: the data is kept alive together with the request, whose drop waits for the
+        // write to complete; moving a Vec does not move its buffer.
+        unsafe {
+            disk_io.borrow_mut().write_disk_raw(
+                media_id,
+                offset,
+                token,
+                write.data.len(),
+                write.data.as_ptr(),
+            )?
+        };
+        write.request.submitted = true;
+        BYTES_WRITTEN.fetch_add(write.data.len() as u64, Ordering::Relaxed);
+        self.pending.borrow_mut().push_back(write);
+        Ok(())
     }
 
     pub fn partitions(&mut self) -> Result<Vec<DiskPartition>> {
@@ -195,17 +574,29 @@ impl Disk {
     }
 }
 
+impl Drop for Disk {
+    fn drop(&mut self) {
+        let runs = core::mem::take(self.combiner.get_mut()).runs;
+        for (start, run) in runs {
+            if let Err(err) = self.write_sync(start, &run) {
+                log::error!("Failed to write buffered data to disk: {err:?}");
+            }
+        }
+    }
+}
+
 impl gpt_disk_io::BlockIo for &mut Disk {
     type Error = super::error::Error;
 
     fn block_size(&self) -> BlockSize {
-        BlockSize::new(self.block.media().block_size()).unwrap()
+        BlockSize::new(self.block.borrow().media().block_size()).unwrap()
     }
     fn num_blocks(&mut self) -> Result<u64> {
-        Ok(self.block.media().last_block() + 1)
+        Ok(self.block.borrow().media().last_block() + 1)
     }
     fn read_blocks(&mut self, start_lba: Lba, dst: &mut [u8]) -> Result<()> {
-        self.read_sync(self.block.media().block_size() as u64 * start_lba.0, dst)
+        let block_size = self.block.borrow().media().block_size() as u64;
+        self.read_sync(block_size * start_lba.0, dst)
     }
     fn write_blocks(&mut self, _start_lba: Lba, _src: &[u8]) -> Result<()> {
         unreachable!();
@@ -33,6 +33,8 @@ err!(smoltcp::socket::udp::BindError);
 err!(smoltcp::socket::udp::SendError);
 err!(postcard::Error);
 err!(lz4_flex::block::DecompressError);
+err!(ruzstd::decoding::errors::FrameDecoderError);
+err!(pixie_shared::manifest::ManifestError);
 err!(gpt_disk_io::DiskError<Error>);
 err!(gpt_disk_types::GptPartitionEntrySizeError);
 
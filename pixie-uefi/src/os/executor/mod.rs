@@ -7,11 +7,12 @@ use alloc::vec::Vec;
 use core::fmt::Write;
 use core::future::{Future, poll_fn};
 use core::pin::Pin;
-use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicI64, AtomicU64, Ordering};
 use core::task::{Context, Poll, Waker};
 use core::time::Duration;
 
 use futures::channel::oneshot;
+use pixie_shared::TaskMetrics;
 use spin::Mutex;
 use uefi::proto::console::text::Color;
 
@@ -32,6 +33,11 @@ struct Task {
     micros: AtomicU64,
     last_micros: AtomicU64,
     done: AtomicBool,
+    polls: AtomicU64,
+    /// Time at which the task was put in the ready queue.
+    woken_at: AtomicI64,
+    wake_latency_micros: AtomicU64,
+    max_wake_latency_micros: AtomicU64,
 }
 
 impl Task {
@@ -46,13 +52,28 @@ impl Task {
             last_micros: AtomicU64::new(0),
             in_queue: AtomicBool::new(false),
             done: AtomicBool::new(false),
+            polls: AtomicU64::new(0),
+            woken_at: AtomicI64::new(Timer::micros()),
+            wake_latency_micros: AtomicU64::new(0),
+            max_wake_latency_micros: AtomicU64::new(0),
         })
     }
+
+    fn metrics(&self) -> TaskMetrics {
+        TaskMetrics {
+            name: self.name.into(),
+            polls: self.polls.load(Ordering::Relaxed),
+            busy_micros: self.micros.load(Ordering::Relaxed),
+            wake_latency_micros: self.wake_latency_micros.load(Ordering::Relaxed),
+            max_wake_latency_micros: self.max_wake_latency_micros.load(Ordering::Relaxed),
+        }
+    }
 }
 
 impl Wake for Task {
     fn wake(self: Arc<Self>) {
         if !self.in_queue.swap(true, Ordering::Relaxed) && !self.done.load(Ordering::Relaxed) {
+            self.woken_at.store(Timer::micros(), Ordering::Relaxed);
             EXECUTOR.lock().ready_tasks.push_back(self);
         }
     }
@@ -256,16 +277,34 @@ impl Executor {
             let mut context = Context::from_waker(&waker);
             let mut fut = task.future.try_lock().unwrap();
             let begin = Timer::micros();
+            let latency = (begin - task.woken_at.load(Ordering::Relaxed)).max(0) as u64;
             let done = fut.0.as_mut().poll(&mut context);
             let end = Timer::micros();
             task.micros
                 .fetch_add((end - begin) as u64, Ordering::Relaxed);
+            task.polls.fetch_add(1, Ordering::Relaxed);
+            task.wake_latency_micros
+                .fetch_add(latency, Ordering::Relaxed);
+            task.max_wake_latency_micros
+                .fetch_max(latency, Ordering::Relaxed);
             if done.is_ready() {
                 task.done.swap(true, Ordering::Relaxed);
             }
         }
     }
 
+    /// Returns the counters of the `max_tasks` tasks that were busy for the longest time, and the
+    /// number of pending timers.
+    pub fn metrics(max_tasks: usize) -> (Vec<TaskMetrics>, usize) {
+        let executor = EXECUTOR.lock();
+        let mut tasks: Vec<_> = executor.tasks.iter().map(|task| task.metrics()).collect();
+        let timers = executor.timed_wait.len();
+        drop(executor);
+        tasks.sort_unstable_by_key(|task| core::cmp::Reverse(task.busy_micros));
+        tasks.truncate(max_tasks);
+        (tasks, timers)
+    }
+
     /// Interrupt task execution.
     /// This is useful to yield the CPU to other tasks.
     pub fn sched_yield() -> impl Future<Output = ()> {
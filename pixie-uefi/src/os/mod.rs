@@ -18,9 +18,10 @@ pub mod executor;
 pub mod input;
 mod logger;
 pub mod memory;
+pub mod mp;
 pub mod net;
 mod send_wrapper;
-mod timer;
+pub mod timer;
 pub mod ui;
 pub mod util;
 
@@ -53,6 +54,7 @@ where
     ui::init();
     logger::init();
     net::init();
+    mp::init();
 
     Executor::spawn("init", async move {
         loop {
@@ -0,0 +1,281 @@
+//! Runs CPU-bound jobs on the application processors (APs), using the MP Services protocol.
+//!
+//! Every AP is started only once, and then waits for jobs in its own mailbox: completion of a
+//! procedure started through the protocol is only noticed by the firmware on a periodic timer,
+//! which is way too slow for jobs that take a few milliseconds.
+//!
+//! Boot services, including memory allocation, may only be used by the BSP, so jobs must be
+//! restricted to pure computations; see [`spawn`].
+
+use alloc::boxed::Box;
+use alloc::vec::Vec;
+use core::arch::asm;
+use core::cell::UnsafeCell;
+use core::ffi::c_void;
+use core::future::Future;
+use core::hint::spin_loop;
+use core::pin::Pin;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering};
+use core::task::{Context, Poll};
+
+use spin::Once;
+use uefi::boot::{EventType, Tpl};
+use uefi::proto::pi::mp::MpServices;
+
+use super::error::Result;
+
+const CR4_OSFXSR: u64 = 1 << 9;
+const CR4_OSXMMEXCPT: u64 = 1 << 10;
+const CR4_OSXSAVE: u64 = 1 << 18;
+
+static BSP_CR4: AtomicU64 = AtomicU64::new(0);
+static BSP_XCR0: AtomicU64 = AtomicU64::new(0);
+
+static WORKERS: Once<Box<[Worker]>> = Once::new();
+
+struct Worker {
+    /// Job to be run, set by the BSP and cleared by the AP before marking the job as done.
+    job: AtomicPtr<Header>,
+    running: AtomicBool,
+}
+
+/// Common prefix of all the [`Slot`]s, which lets the APs run jobs of any type.
+#[repr(C)]
+struct Header {
+    run: unsafe fn(*const Header),
+    done: AtomicBool,
+}
+
+#[repr(C)]
+struct Slot<F, T> {
+    header: Header,
+    f: UnsafeCell<Option<F>>,
+    result: UnsafeCell<Option<T>>,
+}
+
+/// Type-erased access to a [`Slot`], so that [`Job`] does not depend on the type of the closure.
+trait JobSlot<T> {
+    fn header(&self) -> &Header;
+
+    /// # Safety
+    /// The job must be done.
+    unsafe fn take_result(&self) -> Option<T>;
+}
+
+impl<F, T> JobSlot<T> for Slot<F, T> {
+    fn header(&self) -> &Header {
+        &self.header
+    }
+
+    unsafe fn take_result(&self) -> Option<T> {
+        // SAFETY: the job is done, so the AP is not accessing the slot anymore.
+        unsafe { (*self.result.get()).take() }
+    }
+}
+
+/// # Safety
+/// `header` must point to the header of a `Slot<F, T>` that is not done yet.
+unsafe fn run<F: FnOnce() -> T, T>(header: *const Header) {
+    // SAFETY: the header is the first field of the slot, and nobody else accesses the slot until
+    // it is marked as done.
+    unsafe {
+        let slot = &*(header as *const Slot<F, T>);
+        if let Some(f) = (*slot.f.get()).take() {
+            *slot.result.get() = Some(f());
+        }
+    }
+}
+
+fn read_cpu_state() {
+    let cr4: u64;
+    // SAFETY: we run in ring 0, where reading control registers is allowed.
+    unsafe { asm!("mov {}, cr4", out(reg) cr4, options(nomem, nostack)) };
+    BSP_CR4.store(cr4, Ordering::Relaxed);
+    if cr4 & CR4_OSXSAVE != 0 {
+        let (lo, hi): (u32, u32);
+        // SAFETY: xgetbv is available, as OSXSAVE is set.
+        unsafe {
+            asm!("xgetbv", in("ecx") 0, out("eax") lo, out("edx") hi, options(nomem, nostack))
+        };
+        BSP_XCR0.store((hi as u64) << 32 | lo as u64, Ordering::Relaxed);
+    }
+}
+
+/// Enables on the current AP the same SIMD extensions that are enabled on the BSP, which the
+/// firmware does not necessarily do: code is compiled, and features are detected, on the BSP.
+///
+/// # Safety
+/// Must run on an AP of the same model as the BSP, after [`read_cpu_state`].
+unsafe fn load_cpu_state() {
+    let cr4 = BSP_CR4.load(Ordering::Relaxed) & (CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_OSXSAVE);
+    // SAFETY: the BSP has the same CPU, so it supports the same bits.
+    unsafe {
+        asm!(
+            "mov {tmp}, cr4",
+            "or {tmp}, {cr4}",
+            "mov cr4, {tmp}",
+            tmp = out(reg) _,
+            cr4 = in(reg) cr4,
+            options(nomem, nostack),
+        );
+        if cr4 & CR4_OSXSAVE != 0 {
+            let xcr0 = BSP_XCR0.load(Ordering::Relaxed);
+            asm!(
+                "xsetbv",
+                in("ecx") 0,
+                in("eax") xcr0 as u32,
+                in("edx") (xcr0 >> 32) as u32,
+                options(nomem, nostack),
+            );
+        }
+    }
+}
+
+extern "efiapi" fn worker_main(arg: *mut c_void) {
+    // SAFETY: `arg` points to an element of WORKERS, which is never dropped.
+    let worker = unsafe { &*(arg as *const Worker) };
+    // SAFETY: this runs on an AP, after the BSP state was saved by `start_workers`.
+    unsafe { load_cpu_state() };
+    loop {
+        let job = worker.job.load(Ordering::Acquire);
+        if job.is_null() {
+            spin_loop();
+            continue;
+        }
+        // SAFETY: the job is kept alive by its `Job` until it is done.
+        unsafe {
+            ((*job).run)(job);
+            worker.job.store(ptr::null_mut(), Ordering::Relaxed);
+            (*job).done.store(true, Ordering::Release);
+        }
+    }
+}
+
+fn start_workers() -> Result<Box<[Worker]>> {
+    let handle = uefi::boot::get_handle_for_protocol::<MpServices>()?;
+    let mp = uefi::boot::open_protocol_exclusive::<MpServices>(handle)?;
+    let count = mp.get_number_of_processors()?;
+    let processors: Vec<usize> = (0..count.total)
+        .filter(|&n| {
+            mp.get_processor_info(n)
+                .is_ok_and(|info| !info.is_bsp() && info.is_enabled() && info.is_healthy())
+        })
+        .collect();
+
+    let workers: Box<[Worker]> = processors
+        .iter()
+        .map(|_| Worker {
+            job: AtomicPtr::new(ptr::null_mut()),
+            running: AtomicBool::new(false),
+        })
+        .collect();
+
+    read_cpu_state();
+    for (worker, &n) in workers.iter().zip(&processors) {
+        // Passing an event makes the call return without waiting for the procedure to finish.
+        // SAFETY: the event has no notification function.
+        let event =
+            unsafe { uefi::boot::create_event(EventType::empty(), Tpl::CALLBACK, None, None)? };
+        let arg = worker as *const Worker as *mut c_void;
+        match mp.startup_this_ap(n, worker_main, arg, Some(event), None) {
+            Ok(()) => worker.running.store(true, Ordering::Relaxed),
+            Err(err) => log::warn!("Failed to start processor {n}: {err:?}"),
+        }
+    }
+    Ok(workers)
+}
+
+pub(super) fn init() {
+    WORKERS.call_once(|| {
+        let workers = start_workers().unwrap_or_else(|err| {
+            log::info!("Application processors not available: {err:?}");
+            Box::new([])
+        });
+        workers
+    });
+    log::info!("Running jobs on {} application processors", num_workers());
+}
+
+/// Number of application processors that can run jobs.
+pub fn num_workers() -> usize {
+    WORKERS.get().map_or(0, |workers| {
+        workers
+            .iter()
+            .filter(|worker| worker.running.load(Ordering::Relaxed))
+            .count()
+    })
+}
+
+/// A job running on an AP; awaiting it returns its result.
+pub struct Job<T> {
+    slot: Box<dyn JobSlot<T>>,
+}
+
+impl<T> Future for Job<T> {
+    type Output = T;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<T> {
+        if !self.slot.header().done.load(Ordering::Acquire) {
+            // There is no way to be notified by the AP: try again at the next scheduling round.
+            cx.waker().wake_by_ref();
+            return Poll::Pending;
+        }
+        // SAFETY: the job is done.
+        let result = unsafe { self.slot.take_result() };
+        Poll::Ready(result.expect("job result already taken"))
+    }
+}
+
+impl<T> Drop for Job<T> {
+    fn drop(&mut self) {
+        // The AP may still be using the slot.
+        while !self.slot.header().done.load(Ordering::Acquire) {
+            spin_loop();
+        }
+    }
+}
+
+/// Runs `f` on an idle AP, or right away on the current processor if there is none.
+///
+/// # Safety
+/// `f` must not use boot services, directly or indirectly: in particular, it must not allocate
+/// or free memory (so it must not drop any value it owns, nor panic) and must not log. Its stack
+/// usage must fit the AP stack allocated by the firmware, which is only 32 KiB on EDK2.
+pub unsafe fn spawn<F, T>(f: F) -> Job<T>
+where
+    F: FnOnce() -> T + Send + 'static,
+    T: Send + 'static,
+{
+    let slot = Box::new(Slot {
+        header: Header {
+            run: run::<F, T>,
+            done: AtomicBool::new(false),
+        },
+        f: UnsafeCell::new(Some(f)),
+        result: UnsafeCell::new(None),
+    });
+    let header = &slot.header as *const Header as *mut Header;
+    let submitted = WORKERS
+        .get()
+        .into_iter()
+        .flat_map(|workers| workers.iter())
+        .filter(|worker| worker.running.load(Ordering::Relaxed))
+        .any(|worker| {
+            worker
+                .job
+                .compare_exchange(
+                    ptr::null_mut(),
+                    header,
+                    Ordering::Release,
+                    Ordering::Relaxed,
+                )
+                .is_ok()
+        });
+    if !submitted {
+        // SAFETY: the slot was just created, and was not given to any AP.
+        unsafe { run::<F, T>(header) };
+        slot.header.done.store(true, Ordering::Relaxed);
+    }
+    Job { slot }
+}
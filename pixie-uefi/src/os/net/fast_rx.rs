@@ -0,0 +1,200 @@
+//! Receive path for the UDP datagrams sent to a single port, bypassing smoltcp.
+//!
+//! While a [`FastUdpReceiver`] is bound, SNP receives every frame directly into a buffer taken
+//! from a fixed pool. Datagrams for the bound port are queued in their buffer as they are, and
+//! all the other frames are handed to smoltcp by swapping the buffer with the one of the device,
+//! so that no frame is copied. When the pool is exhausted frames are received into the buffer of
+//! the device, and datagrams for the bound port are dropped and counted.
+//!
+//! Datagrams are not checksummed: the Ethernet FCS is checked by the NIC, and the content of the
+//! chunks is verified anyway.
+
+use alloc::boxed::Box;
+use alloc::collections::VecDeque;
+use alloc::vec::Vec;
+use core::future::poll_fn;
+use core::net::{Ipv4Addr, SocketAddrV4};
+use core::ops::Range;
+use core::task::{Poll, Waker};
+
+use crate::os::error::{Error, Result};
+use crate::os::net::speed::RX_SPEED;
+use crate::os::net::{RX_BUF_SIZE, with_net};
+
+const ETHERTYPE_IPV4: u16 = 0x0800;
+const IP_PROTOCOL_UDP: u8 = 17;
+const ETH_HEADER_LEN: usize = 14;
+const UDP_HEADER_LEN: usize = 8;
+
+/// Returns the source and the range of the payload of `frame`, if it is an unfragmented UDP
+/// datagram sent to `port`.
+fn parse_udp(frame: &[u8], port: u16) -> Option<(SocketAddrV4, Range<usize>)> {
+    let be16 = |pos: usize| {
+        Some(u16::from_be_bytes(
+            frame.get(pos..pos + 2)?.try_into().ok()?,
+        ))
+    };
+
+    if be16(12)? != ETHERTYPE_IPV4 {
+        return None;
+    }
+    let ip = ETH_HEADER_LEN;
+    let version_ihl = *frame.get(ip)?;
+    let ihl = (version_ihl & 0xf) as usize * 4;
+    // Fragmented datagrams (or with the more fragments flag set) are left to smoltcp.
+    if version_ihl >> 4 != 4 || ihl < 20 || be16(ip + 6)? & 0x3fff != 0 {
+        return None;
+    }
+    if *frame.get(ip + 9)? != IP_PROTOCOL_UDP {
+        return None;
+    }
+    let ip_end = ip + be16(ip + 2)? as usize;
+    let udp = ip + ihl;
+    if be16(udp + 2)? != port {
+        return None;
+    }
+    let udp_end = udp + be16(udp + 4)? as usize;
+    if udp_end < udp + UDP_HEADER_LEN || udp_end > ip_end || ip_end > frame.len() {
+        return None;
+    }
+    let src = frame.get(ip + 12..ip + 16)?;
+    let src = Ipv4Addr::new(src[0], src[1], src[2], src[3]);
+    let src = SocketAddrV4::new(src, be16(udp)?);
+    Some((src, udp + UDP_HEADER_LEN..udp_end))
+}
+
+/// State of the fast path, owned by the device.
+pub(super) struct FastRx {
+    port: u16,
+    depth: usize,
+    /// Buffers not holding any datagram.
+    free: Vec<Box<[u8]>>,
+    ready: VecDeque<Datagram>,
+    dropped: u64,
+    waker: Option<Waker>,
+}
+
+impl FastRx {
+    fn new(port: u16, depth: usize) -> Self {
+        FastRx {
+            port,
+            depth,
+            free: (0..depth)
+                .map(|_| vec![0; RX_BUF_SIZE].into_boxed_slice())
+                .collect(),
+            ready: VecDeque::with_capacity(depth),
+            dropped: 0,
+            waker: None,
+        }
+    }
+
+    /// Takes a free buffer to receive the next frame into.
+    pub(super) fn take_buffer(&mut self) -> Option<Box<[u8]>> {
+        self.free.pop()
+    }
+
+    pub(super) fn recycle(&mut self, buf: Box<[u8]>) {
+        if self.free.len() + self.ready.len() < self.depth && buf.len() == RX_BUF_SIZE {
+            self.free.push(buf);
+        }
+    }
+
+    /// Queues the frame of `len` bytes in `buf` if it is a datagram for the bound port, and
+    /// gives the buffer back otherwise.
+    pub(super) fn push(&mut self, buf: Box<[u8]>, len: usize) -> Result<(), Box<[u8]>> {
+        let Some((src, payload)) = parse_udp(&buf[..len], self.port) else {
+            return Err(buf);
+        };
+        RX_SPEED.add_bytes(payload.len());
+        self.ready.push_back(Datagram { buf, payload, src });
+        if let Some(waker) = self.waker.take() {
+            waker.wake();
+        }
+        Ok(())
+    }
+
+    /// Counts the frame as dropped if it is a datagram for the bound port, which could not be
+    /// queued as no buffer was free.
+    pub(super) fn drop_if_matches(&mut self, frame: &[u8]) -> bool {
+        let matches = parse_udp(frame, self.port).is_some();
+        self.dropped += matches as u64;
+        matches
+    }
+}
+
+/// A datagram received through the fast path; its buffer goes back to the pool when dropped.
+pub struct Datagram {
+    buf: Box<[u8]>,
+    payload: Range<usize>,
+    src: SocketAddrV4,
+}
+
+impl Datagram {
+    pub fn payload(&self) -> &[u8] {
+        &self.buf[self.payload.clone()]
+    }
+
+    pub fn src(&self) -> SocketAddrV4 {
+        self.src
+    }
+}
+
+impl Drop for Datagram {
+    fn drop(&mut self) {
+        let buf = core::mem::take(&mut self.buf);
+        with_net(|net| {
+            if let Some(rx) = &mut net.device.fast_rx {
+                rx.recycle(buf);
+            }
+        })
+    }
+}
+
+/// Receives the UDP datagrams sent to a port through the fast path, queueing up to a fixed
+/// number of them. Only one receiver can be bound at a time.
+pub struct FastUdpReceiver {
+    _private: (),
+}
+
+impl FastUdpReceiver {
+    pub async fn bind(port: u16, depth: usize) -> Result<FastUdpReceiver> {
+        super::wait_for_ip().await;
+        with_net(|net| {
+            if net.device.fast_rx.is_some() {
+                return Err(Error::msg("Fast receive path already in use"));
+            }
+            net.device.fast_rx = Some(FastRx::new(port, depth.max(1)));
+            Ok(FastUdpReceiver { _private: () })
+        })
+    }
+
+    pub async fn recv(&self) -> Datagram {
+        poll_fn(|cx| {
+            with_net(|net| {
+                let rx = net.device.fast_rx.as_mut().expect("receiver not bound");
+                match rx.ready.pop_front() {
+                    Some(datagram) => Poll::Ready(datagram),
+                    None => {
+                        rx.waker = Some(cx.waker().clone());
+                        Poll::Pending
+                    }
+                }
+            })
+        })
+        .await
+    }
+
+    /// Number of datagrams dropped because the queue was full.
+    pub fn dropped(&self) -> u64 {
+        with_net(|net| net.device.fast_rx.as_ref().map_or(0, |rx| rx.dropped))
+    }
+}
+
+impl Drop for FastUdpReceiver {
+    fn drop(&mut self) {
+        let rx = with_net(|net| net.device.fast_rx.take());
+        // The queued datagrams give their buffers back to the network, so they must be dropped
+        // without holding the lock.
+        drop(rx);
+    }
+}
@@ -1,21 +1,31 @@
+use alloc::boxed::Box;
+
 use smoltcp::phy::{Device, DeviceCapabilities, Medium, RxToken, TxToken};
 use smoltcp::time::Instant;
 use uefi::Status;
 use uefi::boot::ScopedProtocol;
 use uefi::proto::network::snp::{ReceiveFlags, SimpleNetwork};
 
-use super::ETH_PACKET_SIZE;
+use super::fast_rx::FastRx;
+use super::{ETH_PACKET_SIZE, RX_BUF_SIZE};
 use crate::os::send_wrapper::SendWrapper;
 use crate::os::{input, ui};
 use crate::power_control;
 
 type Snp = SendWrapper<ScopedProtocol<SimpleNetwork>>;
 
+/// Maximum number of frames taken by the fast path in a single call to `receive`, so that the
+/// other tasks can run during a burst.
+const MAX_FAST_FRAMES: usize = 64;
+
 pub struct SnpDevice {
     snp: Snp,
     tx_buf: [u8; ETH_PACKET_SIZE],
-    // Received packets might contain Ethernet-related padding (up to 4 bytes).
-    rx_buf: [u8; ETH_PACKET_SIZE + 4],
+    /// Buffer of the frame given to smoltcp, swapped with the fast path buffers.
+    rx_buf: Box<[u8]>,
+    pub(super) fast_rx: Option<FastRx>,
+    /// Whether the fast path received frames since the last call to `take_fast_progress`.
+    fast_progress: bool,
 }
 
 impl SnpDevice {
@@ -38,9 +48,51 @@ impl SnpDevice {
         SnpDevice {
             snp,
             tx_buf: [0; ETH_PACKET_SIZE],
-            rx_buf: [0; ETH_PACKET_SIZE + 4],
+            rx_buf: vec![0; RX_BUF_SIZE].into_boxed_slice(),
+            fast_rx: None,
+            fast_progress: false,
         }
     }
+
+    pub(super) fn take_fast_progress(&mut self) -> bool {
+        core::mem::take(&mut self.fast_progress)
+    }
+
+    /// Receives frames until one is for smoltcp, returning its length; frames for the fast path
+    /// are queued directly in their buffer.
+    fn receive_frame(&mut self) -> Option<usize> {
+        for _ in 0..MAX_FAST_FRAMES {
+            let mut pooled = self.fast_rx.as_mut().and_then(FastRx::take_buffer);
+            let buf = match &mut pooled {
+                Some(buf) => buf,
+                None => &mut self.rx_buf,
+            };
+            let rec = self.snp.receive(buf, None, None, None, None);
+            if rec == Err(Status::NOT_READY.into()) {
+                if let (Some(rx), Some(buf)) = (&mut self.fast_rx, pooled) {
+                    rx.recycle(buf);
+                }
+                return None;
+            }
+            let len = rec.unwrap();
+            let Some(rx) = &mut self.fast_rx else {
+                return Some(len);
+            };
+            match pooled {
+                Some(buf) => match rx.push(buf, len) {
+                    Ok(()) => self.fast_progress = true,
+                    Err(mut buf) => {
+                        core::mem::swap(&mut buf, &mut self.rx_buf);
+                        rx.recycle(buf);
+                        return Some(len);
+                    }
+                },
+                None if rx.drop_if_matches(&self.rx_buf[..len]) => self.fast_progress = true,
+                None => return Some(len),
+            }
+        }
+        None
+    }
 }
 
 impl Drop for SnpDevice {
@@ -101,13 +153,10 @@ impl Device for SnpDevice {
     type RxToken<'d> = SnpRxToken<'d>;
 
     fn receive(&mut self, _: Instant) -> Option<(SnpRxToken<'_>, SnpTxToken<'_>)> {
-        let rec = self.snp.receive(&mut self.rx_buf, None, None, None, None);
-        if rec == Err(Status::NOT_READY.into()) {
-            return None;
-        }
+        let len = self.receive_frame()?;
         Some((
             SnpRxToken {
-                packet: &mut self.rx_buf[..rec.unwrap()],
+                packet: &mut self.rx_buf[..len],
             },
             SnpTxToken {
                 snp: &self.snp,
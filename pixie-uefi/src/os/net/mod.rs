@@ -23,6 +23,7 @@ use super::timer::Timer;
 use crate::os::boot_options::BootOptions;
 use crate::os::executor::Executor;
 use crate::os::executor::event::{Event as ExecutorEvent, EventTrigger};
+pub use crate::os::net::fast_rx::{Datagram, FastUdpReceiver};
 use crate::os::net::interface::SnpDevice;
 pub use crate::os::net::tcp::TcpStream;
 pub use crate::os::net::udp::UdpSocket;
@@ -30,12 +31,15 @@ use crate::os::send_wrapper::SendWrapper;
 use crate::os::timer::rdtsc;
 use crate::os::ui;
 
+mod fast_rx;
 mod interface;
 mod speed;
 mod tcp;
 mod udp;
 
 pub const ETH_PACKET_SIZE: usize = 1514;
+/// Received packets might contain Ethernet-related padding (up to 4 bytes).
+const RX_BUF_SIZE: usize = ETH_PACKET_SIZE + 4;
 
 static EPHEMERAL_PORT_COUNTER: AtomicU64 = AtomicU64::new(0);
 
@@ -177,6 +181,11 @@ pub async fn wait_for_ip() {
     event.await;
 }
 
+/// Returns the number of bytes received and sent so far.
+pub fn io_bytes() -> (u64, u64) {
+    (speed::RX_SPEED.total(), speed::TX_SPEED.total())
+}
+
 fn ip() -> Option<Ipv4Addr> {
     with_net(|n| n.interface.ipv4_addr())
 }
@@ -203,7 +212,11 @@ fn poll() -> Option<u64> {
     let status_out = interface.poll_egress(now, device, socket_set);
     let status_in = interface.poll_ingress_single(now, device, socket_set);
 
-    if status_in == PollIngressSingleResult::None && status_out == PollResult::None {
+    let fast_progress = device.take_fast_progress();
+    if status_in == PollIngressSingleResult::None
+        && status_out == PollResult::None
+        && !fast_progress
+    {
         return interface.poll_delay(now, socket_set).map(|x| x.micros());
     }
 
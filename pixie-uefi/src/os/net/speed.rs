@@ -30,6 +30,10 @@ impl NetSpeed {
         self.total.fetch_add(count as u64, Ordering::Relaxed);
     }
 
+    pub fn total(&self) -> u64 {
+        self.total.load(Ordering::Relaxed)
+    }
+
     pub fn bytes_per_second(&self) -> u64 {
         self.bytes_per_second.load(Ordering::Relaxed)
     }
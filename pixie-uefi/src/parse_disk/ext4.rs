@@ -1,6 +1,11 @@
 use alloc::vec::Vec;
+use core::pin::pin;
 
-use super::{le16, le32, le64_32_32};
+use futures::StreamExt;
+
+use super::{
+    MAX_METADATA_READ, le16, le32, le64_32_32, push_bitmap_ranges, push_range, read_ahead,
+};
 use crate::os::disk::Disk;
 use crate::os::error::Result;
 use crate::store::ChunkInfo;
@@ -23,87 +28,115 @@ fn has_superblock(group: usize) -> bool {
     false
 }
 
-pub async fn get_ext4_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<Vec<ChunkInfo>>> {
-    if start + 2048 > end {
+pub async fn get_ext4_chunks(
+    disk: &Disk,
+    start: u64,
+    head: &[u8],
+) -> Result<Option<Vec<ChunkInfo>>> {
+    if head.len() < 2048 {
         // Not an ext4 partition.
         return Ok(None);
     }
-    // Read superblock.
-    let mut superblock = [0; 1024];
-    disk.read(start + 1024, &mut superblock).await?;
+    let superblock = &head[1024..2048];
 
-    let magic = le16(&superblock, 0x38);
+    let magic = le16(superblock, 0x38);
     if magic != 0xEF53 {
         return Ok(None);
     }
 
-    let feature_incompat = le32(&superblock, 0x60);
+    let feature_incompat = le32(superblock, 0x60);
     if feature_incompat & 0x80 == 0 {
         // INCOMPAT_64BIT flag
         return Ok(None);
     }
 
-    let feature_ro_compat = le32(&superblock, 0x64);
+    let feature_ro_compat = le32(superblock, 0x64);
     if feature_ro_compat & 0x1 == 0 {
         // RO_COMPAT_SPARSE_SUPER flag
         return Ok(None);
     }
 
-    let blocks_count = le64_32_32(&superblock, 0x4, 0x150);
-    let log_block_size = le32(&superblock, 0x18);
+    let blocks_count = le64_32_32(superblock, 0x4, 0x150);
+    let log_block_size = le32(superblock, 0x18);
     assert!(blocks_count.checked_shl(10 + log_block_size).is_some());
     let block_size = 1u64 << (10 + log_block_size);
 
-    let blocks_per_group = le32(&superblock, 0x20) as u64;
+    let blocks_per_group = le32(superblock, 0x20) as u64;
     let groups = blocks_count.div_ceil(blocks_per_group);
 
-    let first_data_block = le32(&superblock, 0x14) as u64;
-    let desc_size = le16(&superblock, 0xfe) as u64;
-    let reserved_gdt_blocks = le16(&superblock, 0xce);
+    let first_data_block = le32(superblock, 0x14) as u64;
+    let desc_size = le16(superblock, 0xfe) as u64;
+    let reserved_gdt_blocks = le16(superblock, 0xce);
 
     let blocks_for_special_group =
         1 + (desc_size * groups).div_ceil(block_size) as usize + reserved_gdt_blocks as usize;
 
     let mut group_descriptors = vec![0; (desc_size * groups) as usize];
-    let mut bitmap = vec![0; block_size as usize];
     disk.read(
         start + block_size * (first_data_block + 1),
         &mut group_descriptors,
     )
     .await?;
+    let group_descriptors = group_descriptors.chunks(desc_size as usize);
+    let is_uninit = |group_descriptor: &[u8]| {
+        // EXT4_BG_BLOCK_UNINIT
+        le16(group_descriptor, 0x12) & 0x2 != 0
+    };
+
+    // Block bitmaps are usually stored next to each other (always, with flex_bg): read runs of
+    // adjacent ones together, ahead of parsing them.
+    let bitmap_len = block_size as usize;
+    let max_run_len = MAX_METADATA_READ.max(bitmap_len) / bitmap_len * bitmap_len;
+    let mut runs = Vec::<(u64, usize)>::new();
+    for group_descriptor in group_descriptors.clone() {
+        if is_uninit(group_descriptor) {
+            continue;
+        }
+        let offset = start + block_size * le64_32_32(group_descriptor, 0x0, 0x20);
+        match runs.last_mut() {
+            Some((run_offset, run_len))
+                if *run_offset + *run_len as u64 == offset && *run_len < max_run_len =>
+            {
+                *run_len += bitmap_len;
+            }
+            _ => runs.push((offset, bitmap_len)),
+        }
+    }
+    let mut bitmaps = pin!(read_ahead(disk, runs));
+    let mut run = Vec::new();
+    let mut run_pos = 0;
 
     let mut ans = Vec::new();
 
-    for (group, group_descriptor) in group_descriptors.chunks(desc_size as usize).enumerate() {
-        let flags = le16(group_descriptor, 0x12);
-        if flags & 0x2 != 0 {
-            // EXT4_BG_BLOCK_UNINIT
+    for (group, group_descriptor) in group_descriptors.enumerate() {
+        let first_block = group * blocks_per_group as usize;
+        if is_uninit(group_descriptor) {
             if has_superblock(group) {
-                for block in 0..blocks_for_special_group {
-                    if group * blocks_per_group as usize + block < blocks_count as usize {
-                        ans.push(ChunkInfo {
-                            start: block_size as usize
-                                * (group * blocks_per_group as usize + block),
-                            size: block_size as usize,
-                        });
-                    }
-                }
+                let blocks = blocks_for_special_group.min(blocks_count as usize - first_block);
+                push_range(
+                    &mut ans,
+                    block_size as usize * first_block,
+                    block_size as usize * blocks,
+                );
             }
         } else {
-            let block_bitmap = le64_32_32(group_descriptor, 0x0, 0x20);
-
-            disk.read(start + block_size * block_bitmap, &mut bitmap)
-                .await?;
-
-            for block in 0..8 * block_size as usize {
-                let is_used = bitmap[block / 8] >> (block % 8) & 1 != 0;
-                if is_used && group * blocks_per_group as usize + block < blocks_count as usize {
-                    ans.push(ChunkInfo {
-                        start: block_size as usize * (group * blocks_per_group as usize + block),
-                        size: block_size as usize,
-                    });
-                }
+            if run_pos == run.len() {
+                run = bitmaps.next().await.expect("missing block bitmap")?;
+                run_pos = 0;
             }
+            let bitmap = &run[run_pos..run_pos + bitmap_len];
+            run_pos += bitmap_len;
+
+            let blocks = (8 * bitmap_len)
+                .min(blocks_per_group as usize)
+                .min(blocks_count as usize - first_block);
+            push_bitmap_ranges(
+                &mut ans,
+                bitmap,
+                blocks,
+                block_size as usize * first_block,
+                block_size as usize,
+            );
         }
     }
 
@@ -1,6 +1,6 @@
 use alloc::vec::Vec;
 
-use super::{le16, le32};
+use super::{le16, le32, push_range};
 use crate::os::disk::Disk;
 use crate::os::error::Result;
 use crate::store::ChunkInfo;
@@ -33,13 +33,16 @@ impl Type {
     }
 }
 
-pub async fn get_fat_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<Vec<ChunkInfo>>> {
-    if end - start < 512 {
+pub async fn get_fat_chunks(
+    disk: &Disk,
+    start: u64,
+    head: &[u8],
+) -> Result<Option<Vec<ChunkInfo>>> {
+    if head.len() < 512 {
         return Ok(None);
     }
 
-    let mut ebpb = [0; 512];
-    disk.read(start, &mut ebpb).await?;
+    let ebpb = &head[..512];
     let fat_type = if &ebpb[0x52..0x5A] == b"FAT32   " {
         Type::Fat32
     } else if &ebpb[0x36..0x3E] == b"FAT16   " {
@@ -50,11 +53,11 @@ pub async fn get_fat_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<
         return Ok(None);
     };
 
-    let sector_size = le16(&ebpb, 0x0B) as u64;
+    let sector_size = le16(ebpb, 0x0B) as u64;
     let sectors_per_cluster = ebpb[0x0D] as u64;
     let cluster_size = sector_size * sectors_per_cluster;
-    let total_sectors_short = le16(&ebpb, 0x13) as u64;
-    let total_sectors_long = le32(&ebpb, 0x20) as u64;
+    let total_sectors_short = le16(ebpb, 0x13) as u64;
+    let total_sectors_long = le32(ebpb, 0x20) as u64;
     let total_sectors = if total_sectors_short > 0 {
         total_sectors_short
     } else {
@@ -64,10 +67,10 @@ pub async fn get_fat_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<
         "FAT partition: sector_size={sector_size}, sectors_per_cluster={sectors_per_cluster}, cluster_size={cluster_size}, total_sectors={total_sectors}"
     );
 
-    let first_fat_sector = le16(&ebpb, 0x0E) as u64;
+    let first_fat_sector = le16(ebpb, 0x0E) as u64;
     let fat_size = match fat_type {
-        Type::Fat12 | Type::Fat16 => le16(&ebpb, 0x16) as u64,
-        Type::Fat32 => le32(&ebpb, 0x24) as u64,
+        Type::Fat12 | Type::Fat16 => le16(ebpb, 0x16) as u64,
+        Type::Fat32 => le32(ebpb, 0x24) as u64,
     };
     let table_count = ebpb[0x10] as u64;
     log::trace!(
@@ -75,7 +78,7 @@ pub async fn get_fat_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<
         fat_type.bits(),
     );
 
-    let root_dir_entries = le16(&ebpb, 0x11) as u64;
+    let root_dir_entries = le16(ebpb, 0x11) as u64;
     let root_dir_sectors = (root_dir_entries * 32).div_ceil(sector_size);
     log::trace!(
         "FAT partition: root_dir_entries={root_dir_entries}, root_dir_sectors={root_dir_sectors}"
@@ -97,11 +100,12 @@ pub async fn get_fat_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<
 
     for idx in 2..2 + data_cluster_count as usize {
         if fat_type.index(&fat, idx) != 0 {
-            chunks.push(ChunkInfo {
-                start: (first_data_sector + (idx - 2) as u64 * sectors_per_cluster) as usize
+            push_range(
+                &mut chunks,
+                (first_data_sector + (idx - 2) as u64 * sectors_per_cluster) as usize
                     * sector_size as usize,
-                size: cluster_size as usize,
-            });
+                cluster_size as usize,
+            );
         }
     }
 
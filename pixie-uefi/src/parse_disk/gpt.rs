@@ -17,15 +17,23 @@ pub async fn parse_gpt(disk: &mut Disk) -> Result<Option<Vec<ChunkInfo>>> {
         }
     };
 
+    // Partitions are parsed concurrently, so that their metadata reads are in flight together.
+    let disk = &*disk;
+    let parsed = futures::future::try_join_all(partitions.iter().map(|partition| {
+        info!(
+            "Partition starting at 0x{:x}, size {}",
+            partition.byte_start,
+            BytesFmt(partition.byte_end - partition.byte_start)
+        );
+        super::parse_partition(disk, partition.byte_start, partition.byte_end)
+    }))
+    .await?;
+
     let mut pos = 0usize;
     let mut chunks = vec![];
-    for partition in partitions {
+    for (partition, part_chunks) in partitions.iter().zip(parsed) {
         let begin = partition.byte_start as usize;
         let end = partition.byte_end as usize;
-        info!(
-            "Partition starting at 0x{begin:x}, size {}",
-            BytesFmt((end - begin) as u64)
-        );
 
         if pos < begin {
             chunks.push(ChunkInfo {
@@ -34,7 +42,6 @@ pub async fn parse_gpt(disk: &mut Disk) -> Result<Option<Vec<ChunkInfo>>> {
             });
         }
 
-        let part_chunks = super::parse_partition(disk, begin as u64, end as u64).await?;
         for ChunkInfo { start, size } in part_chunks {
             chunks.push(ChunkInfo {
                 start: start + begin,
@@ -1,7 +1,7 @@
 use alloc::vec::Vec;
 
+use futures::stream::{self, Stream, StreamExt};
 use log::info;
-use pixie_shared::MAX_CHUNK_SIZE;
 use pixie_shared::util::BytesFmt;
 
 use crate::os::disk::Disk;
@@ -14,6 +14,13 @@ mod gpt;
 mod ntfs;
 mod swap;
 
+/// Bytes read from the start of a partition to detect its filesystem.
+const HEAD_LEN: usize = 4096;
+/// Maximum size of a metadata read done with [`read_ahead`].
+const MAX_METADATA_READ: usize = 1 << 20;
+/// Number of metadata reads kept in flight by [`read_ahead`].
+const METADATA_READ_AHEAD: usize = 4;
+
 fn le16(buf: &[u8], lo: usize) -> u16 {
     (0..2).map(|i| (buf[lo + i] as u16) << (8 * i)).sum()
 }
@@ -32,38 +39,92 @@ fn le64_32_32(buf: &[u8], lo: usize, hi: usize) -> u64 {
         .sum()
 }
 
+/// Reads the given extents, as (offset, length) pairs of at most [`MAX_METADATA_READ`] bytes,
+/// keeping up to [`METADATA_READ_AHEAD`] of them in flight. The buffers are returned in order.
+fn read_ahead(disk: &Disk, extents: Vec<(u64, usize)>) -> impl Stream<Item = Result<Vec<u8>>> {
+    stream::iter(extents)
+        .map(move |(offset, len)| async move {
+            let mut buf = vec![0; len];
+            disk.read(offset, &mut buf).await?;
+            Ok(buf)
+        })
+        .buffered(METADATA_READ_AHEAD)
+}
+
+/// Appends the range of `size` bytes at `start` to `chunks`, merging it with the last range if
+/// they are adjacent.
+fn push_range(chunks: &mut Vec<ChunkInfo>, start: usize, size: usize) {
+    if let Some(last) = chunks.last_mut()
+        && last.start + last.size == start
+    {
+        last.size += size;
+        return;
+    }
+    chunks.push(ChunkInfo { start, size });
+}
+
+/// Appends to `chunks` the ranges marked as used in the first `bits` bits of `bitmap`, where bit
+/// `i` (least significant first) covers the `unit` bytes at `base + i * unit`.
+///
+/// The bitmap is scanned one 64-bit word at a time, so that free and fully used words cost a
+/// single step.
+fn push_bitmap_ranges(
+    chunks: &mut Vec<ChunkInfo>,
+    bitmap: &[u8],
+    bits: usize,
+    base: usize,
+    unit: usize,
+) {
+    for (index, bytes) in bitmap.chunks(8).enumerate() {
+        let first = index * 64;
+        if first >= bits {
+            break;
+        }
+        let mut word = [0; 8];
+        word[..bytes.len()].copy_from_slice(bytes);
+        let mut word = u64::from_le_bytes(word);
+        if bits - first < 64 {
+            word &= (1 << (bits - first)) - 1;
+        }
+        let mut bit = 0;
+        while bit < 64 && word >> bit != 0 {
+            bit += (word >> bit).trailing_zeros() as usize;
+            let ones = (word >> bit).trailing_ones() as usize;
+            push_range(chunks, base + (first + bit) * unit, ones * unit);
+            bit += ones;
+        }
+    }
+}
+
 /// Returns chunks *relative to the start of the partition*.
 async fn parse_partition(disk: &Disk, start: u64, end: u64) -> Result<Vec<ChunkInfo>> {
-    if let Some(chunks) = fat::get_fat_chunks(disk, start, end).await? {
+    // All the parsers look for their magic number at the start of the partition: read it once.
+    let mut head = vec![0; (end - start).min(HEAD_LEN as u64) as usize];
+    if !head.is_empty() {
+        disk.read(start, &mut head).await?;
+    }
+    let log = |kind: &str, chunks: &[ChunkInfo]| {
         info!(
-            "FAT partition with {} chunks of size {}",
+            "{kind} partition at 0x{start:x} with {} used ranges of size {}",
             chunks.len(),
             BytesFmt(chunks.iter().map(|x| x.size as u64).sum::<u64>())
         );
+    };
+
+    if let Some(chunks) = fat::get_fat_chunks(disk, start, &head).await? {
+        log("FAT", &chunks);
         Ok(chunks)
-    } else if let Some(chunks) = ext4::get_ext4_chunks(disk, start, end).await? {
-        info!(
-            "Ext4 partition with {} chunks of size {}",
-            chunks.len(),
-            BytesFmt(chunks.iter().map(|x| x.size as u64).sum::<u64>())
-        );
+    } else if let Some(chunks) = ext4::get_ext4_chunks(disk, start, &head).await? {
+        log("Ext4", &chunks);
         Ok(chunks)
-    } else if let Some(chunks) = ntfs::get_ntfs_chunks(disk, start, end).await? {
-        info!(
-            "NTFS partition with {} chunks of size {}",
-            chunks.len(),
-            BytesFmt(chunks.iter().map(|x| x.size as u64).sum::<u64>())
-        );
+    } else if let Some(chunks) = ntfs::get_ntfs_chunks(disk, start, end, &head).await? {
+        log("NTFS", &chunks);
         Ok(chunks)
-    } else if let Some(chunks) = swap::get_swap_chunks(disk, start, end).await? {
-        info!(
-            "Swap partition with {} chunks of size {}",
-            chunks.len(),
-            BytesFmt(chunks.iter().map(|x| x.size as u64).sum::<u64>())
-        );
+    } else if let Some(chunks) = swap::get_swap_chunks(&head) {
+        log("Swap", &chunks);
         Ok(chunks)
     } else {
-        info!("Unknown partition type");
+        info!("Unknown partition type at 0x{start:x}");
         Ok(vec![ChunkInfo {
             start: 0,
             size: (end - start) as usize,
@@ -79,30 +140,20 @@ async fn parse_partition_table(disk: &mut Disk) -> Result<Vec<ChunkInfo>> {
     }
 }
 
+/// Returns the used ranges of the disk, sorted and with adjacent ranges merged.
 pub async fn parse_disk(disk: &mut Disk) -> Result<Vec<ChunkInfo>> {
     let chunks = parse_partition_table(disk).await?;
 
-    // Split up chunks.
-    let mut final_chunks = Vec::<ChunkInfo>::new();
-    for ChunkInfo { mut start, size } in chunks {
-        let end = start + size;
-
-        if let Some(last) = final_chunks.last() {
+    let mut ranges = Vec::<ChunkInfo>::new();
+    for ChunkInfo { start, size } in chunks {
+        if let Some(last) = ranges.last_mut() {
             assert!(last.start + last.size <= start);
             if last.start + last.size == start {
-                start = last.start;
-                final_chunks.pop();
+                last.size += size;
+                continue;
             }
         }
-
-        while start < end {
-            let split = (start + 1).next_multiple_of(MAX_CHUNK_SIZE).min(end);
-            final_chunks.push(ChunkInfo {
-                start,
-                size: split - start,
-            });
-            start = split;
-        }
+        ranges.push(ChunkInfo { start, size });
     }
-    Ok(final_chunks)
+    Ok(ranges)
 }
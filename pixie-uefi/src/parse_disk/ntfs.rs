@@ -1,23 +1,30 @@
 use alloc::vec::Vec;
+use core::pin::pin;
 
-use super::{le16, le32, le64};
+use futures::StreamExt;
+
+use super::{MAX_METADATA_READ, le16, le32, le64, push_bitmap_ranges, read_ahead};
 use crate::os::disk::Disk;
 use crate::os::error::Result;
 use crate::store::ChunkInfo;
 
-pub async fn get_ntfs_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<Vec<ChunkInfo>>> {
-    if end - start < 512 {
+pub async fn get_ntfs_chunks(
+    disk: &Disk,
+    start: u64,
+    end: u64,
+    head: &[u8],
+) -> Result<Option<Vec<ChunkInfo>>> {
+    if head.len() < 512 {
         return Ok(None);
     }
 
-    let mut boot_sector = [0u8; 512];
-    disk.read(start, &mut boot_sector).await?;
+    let boot_sector = &head[..512];
 
     if &boot_sector[3..11] != b"NTFS    " {
         return Ok(None);
     }
 
-    let bytes_per_sector = le16(&boot_sector, 0x0b) as usize;
+    let bytes_per_sector = le16(boot_sector, 0x0b) as usize;
 
     let sectors_per_cluster = match boot_sector[0x0d] {
         x @ 0..=127 => x as usize,
@@ -33,7 +40,7 @@ pub async fn get_ntfs_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option
         x @ 128..=224 => panic!("too many bytes per file record: {}", x),
     };
 
-    let mft_cluster_number = le64(&boot_sector, 0x30) as usize;
+    let mft_cluster_number = le64(boot_sector, 0x30) as usize;
     let mft_address = bytes_per_cluster * mft_cluster_number;
 
     let bitmap_entry_address = mft_address + 6 * bytes_per_file_record;
@@ -54,9 +61,8 @@ pub async fn get_ntfs_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option
     let mut data_run_offset =
         attribute_offset + le16(&bitmap_entry, attribute_offset + 0x20) as usize;
 
-    let mut cnt = 0;
-    let mut chunks = Vec::new();
-
+    // Collect the extents of the bitmap first, to read them ahead of parsing them.
+    let mut extents = Vec::new();
     while start_vcn <= last_vcn {
         let ctrl_byte = bitmap_entry[data_run_offset];
 
@@ -68,29 +74,34 @@ pub async fn get_ntfs_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option
         let offset = (le64(&bitmap_entry, data_run_offset + 1 + length_len)
             & ((1 << (8 * offset_len)) - 1)) as usize;
 
-        let mut buf = vec![0u8; bytes_per_cluster];
-        for i in 0..length {
-            let x = start + (offset + i) as u64 * bytes_per_cluster as u64;
-            disk.read(x, &mut buf).await?;
-
-            for &byte in &buf {
-                for bit in 0..8 {
-                    if cnt < num_clusters as u64 {
-                        if byte >> bit & 1 != 0 {
-                            chunks.push(ChunkInfo {
-                                start: cnt as usize * bytes_per_cluster,
-                                size: bytes_per_cluster,
-                            });
-                        }
-                        cnt += 1;
-                    }
-                }
-            }
+        let mut pos = start + (offset * bytes_per_cluster) as u64;
+        let mut len = length * bytes_per_cluster;
+        while len > 0 {
+            let part = len.min(MAX_METADATA_READ);
+            extents.push((pos, part));
+            pos += part as u64;
+            len -= part;
         }
 
         start_vcn += length;
         data_run_offset += 1 + length_len + offset_len;
     }
 
+    let mut cnt = 0;
+    let mut chunks = Vec::new();
+    let mut bitmap = pin!(read_ahead(disk, extents));
+    while let Some(buf) = bitmap.next().await {
+        let buf = buf?;
+        let bits = (8 * buf.len()).min(num_clusters - cnt);
+        push_bitmap_ranges(
+            &mut chunks,
+            &buf,
+            bits,
+            cnt * bytes_per_cluster,
+            bytes_per_cluster,
+        );
+        cnt += bits;
+    }
+
     Ok(Some(chunks))
 }
@@ -1,23 +1,19 @@
 use alloc::vec::Vec;
 
-use crate::os::disk::Disk;
-use crate::os::error::Result;
+use super::HEAD_LEN;
 use crate::store::ChunkInfo;
 
-pub async fn get_swap_chunks(disk: &Disk, start: u64, end: u64) -> Result<Option<Vec<ChunkInfo>>> {
-    if end - start < 4096 {
-        return Ok(None);
+pub fn get_swap_chunks(head: &[u8]) -> Option<Vec<ChunkInfo>> {
+    if head.len() < HEAD_LEN {
+        return None;
     }
 
-    let mut first_chunk = [0u8; 4096];
-    disk.read(start, &mut first_chunk).await?;
-
-    if &first_chunk[4096 - 10..] != b"SWAPSPACE2" {
-        return Ok(None);
+    if &head[HEAD_LEN - 10..] != b"SWAPSPACE2" {
+        return None;
     }
 
-    Ok(Some(vec![ChunkInfo {
+    Some(vec![ChunkInfo {
         start: 0,
-        size: 4096,
-    }]))
+        size: HEAD_LEN,
+    }])
 }
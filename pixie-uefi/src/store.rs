@@ -1,3 +1,5 @@
+use alloc::collections::{BTreeSet, VecDeque};
+use alloc::sync::Arc;
 use alloc::vec::Vec;
 use core::cell::RefCell;
 use core::fmt::Write;
@@ -6,15 +8,36 @@ use core::net::SocketAddrV4;
 use log::info;
 use lz4_flex::compress;
 use pixie_shared::util::BytesFmt;
-use pixie_shared::{Chunk, Image, MAX_CHUNK_SIZE, Offset, TcpRequest, UdpRequest};
+use pixie_shared::{
+    Action, Chunk, ChunkHash, Chunking, Codec, Image, ImageDisk, MAX_CHUNK_SIZE, Offset,
+    StoreOptions, TcpRequest, UdpRequest,
+};
+use thingbuf::mpsc::Sender;
 
 use crate::os::boot_options::BootOptions;
 use crate::os::error::{Error, Result};
 use crate::os::net::{TcpStream, UdpSocket};
+use crate::os::timer::Timer;
 use crate::os::ui::DrawArea;
-use crate::os::{disk, memory, ui};
+use crate::os::{disk, memory, mp, ui};
 use crate::{MIN_MEMORY, parse_disk};
 
+/// A chunk that is being hashed: start, size, compressed data and hashing job, which returns the
+/// hash, the data and the time it took.
+type PendingChunk = (
+    usize,
+    usize,
+    Vec<u8>,
+    mp::Job<(blake3::Hash, Arc<Vec<u8>>, u64)>,
+);
+
+/// Maximum number of chunks checked and uploaded with a single request.
+const MAX_BATCH_CHUNKS: usize = 64;
+/// Compressed size after which no more chunks are added to a batch.
+const MAX_BATCH_SIZE: usize = 8 << 20;
+/// With content defined chunking, the disk is read this many maximum sized chunks at a time.
+const CDC_READ_CHUNKS: usize = 2;
+
 #[derive(Debug)]
 pub struct ChunkInfo {
     pub start: Offset,
@@ -31,8 +54,32 @@ async fn save_image(stream: &TcpStream, image: Image) -> Result<()> {
     Ok(())
 }
 
+async fn get_store_options(stream: &TcpStream) -> Result<StoreOptions> {
+    let req = TcpRequest::GetStoreOptions;
+    let buf = postcard::to_allocvec(&req)?;
+    stream.write_u64_le(buf.len() as u64).await?;
+    stream.write_all(&buf).await?;
+    let len = stream.read_u64_le().await?;
+    let mut buf = vec![0; len as usize];
+    stream.read_exact(&mut buf).await?;
+    Ok(postcard::from_bytes(&buf)?)
+}
+
 struct PushingChunks {
+    chunking: Chunking,
+    /// Total size of the used ranges of the disks.
     total: usize,
+    /// Bytes read from the disks.
+    read: usize,
+    /// Bytes hashed and compressed.
+    processed: usize,
+    /// Number of APs hashing chunks.
+    workers: usize,
+    /// Time spent in each stage, in microseconds; hashing time is summed over all processors.
+    read_micros: u64,
+    hash_micros: u64,
+    compress_micros: u64,
+    start_micros: i64,
     step1: usize,
     step2: usize,
     step3: usize,
@@ -40,6 +87,8 @@ struct PushingChunks {
     step5: usize,
     tsize: usize,
     tcsize: usize,
+    /// Compressed size of the chunks not already present in the server.
+    uploaded: usize,
 }
 
 enum State {
@@ -66,7 +115,15 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
                 writeln!(draw_area, "Reading partitions...").unwrap();
             }
             State::PushingChunks(PushingChunks {
+                chunking,
                 total,
+                read,
+                processed,
+                workers,
+                read_micros,
+                hash_micros,
+                compress_micros,
+                start_micros,
                 step1,
                 step2,
                 step3,
@@ -74,13 +131,43 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
                 step5,
                 tsize,
                 tcsize,
+                uploaded,
             }) => {
                 writeln!(
                     draw_area,
-                    "Pushed {step5} / {step4} / {step3} / {step2} / {step1} / {total} chunks"
+                    "Read {} / {} with {chunking:?} chunking",
+                    BytesFmt(*read as u64),
+                    BytesFmt(*total as u64)
+                )
+                .unwrap();
+                // Throughput of each stage while it is running, to find the bottleneck.
+                let speed = |bytes: usize, micros: u64| {
+                    BytesFmt((bytes as f64 / (micros.max(1) as f64 * 1e-6)) as u64)
+                };
+                writeln!(
+                    draw_area,
+                    "Disk read {}/s, hashing {}/s on {} cores, compression {}/s",
+                    speed(*read, *read_micros),
+                    speed(*processed, *hash_micros / (*workers as u64).max(1)),
+                    (*workers).max(1),
+                    speed(*processed, *compress_micros),
+                )
+                .unwrap();
+                let elapsed = (Timer::micros() - start_micros).max(0) as u64;
+                writeln!(draw_area, "Overall {}/s", speed(*tsize, elapsed)).unwrap();
+                writeln!(
+                    draw_area,
+                    "Pushed {step5} / {step4} / {step3} / {step2} / {step1} chunks"
+                )
+                .unwrap();
+                writeln!(
+                    draw_area,
+                    "total size {}, compressed {}, uploaded {}",
+                    BytesFmt(*tsize as u64),
+                    BytesFmt(*tcsize as u64),
+                    BytesFmt(*uploaded as u64)
                 )
                 .unwrap();
-                writeln!(draw_area, "total size {tsize}, compressed {tcsize}").unwrap();
             }
         }
     };
@@ -90,21 +177,33 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
     let boid = BootOptions::reboot_target().expect("Could not find reboot target");
     let bo_command = BootOptions::get(boid);
 
-    let mut disk = disk::Disk::largest();
-    let chunks = parse_disk::parse_disk(&mut disk).await?;
-    info!(
-        "Total size of chunks: {}",
-        BytesFmt(chunks.iter().map(|x| x.size as u64).sum::<u64>())
-    );
+    let mut disks = disk::Disk::all();
+    let mut disks_ranges = Vec::with_capacity(disks.len());
+    for disk in &mut disks {
+        let ranges = parse_disk::parse_disk(disk).await?;
+        info!(
+            "Disk of {}: {} used ranges",
+            BytesFmt(disk.size()),
+            ranges.len()
+        );
+        disks_ranges.push(ranges);
+    }
+    let total = disks_ranges.iter().flatten().map(|x| x.size).sum::<usize>();
+    info!("Total size of used ranges: {}", BytesFmt(total as u64));
 
     let udp = UdpSocket::bind(None).await?;
     let stream_get_csize = TcpStream::connect(server_address).await?;
     let stream_upload_chunk = TcpStream::connect(server_address).await?;
 
-    let total = chunks.len();
+    let StoreOptions { chunking } = get_store_options(&stream_get_csize).await?;
+    if !chunking.is_valid() {
+        return Err(Error(format!("Invalid chunking options: {chunking:?}")));
+    }
+    info!("Using {chunking:?} chunking");
 
     let mut total_size = 0;
     let mut total_csize = 0;
+    let mut uploaded = 0;
 
     let free_mem = memory::stats().free;
     let channel_size =
@@ -115,7 +214,15 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
     );
 
     stats.replace(State::PushingChunks(PushingChunks {
+        chunking,
         total,
+        read: 0,
+        processed: 0,
+        workers: mp::num_workers(),
+        read_micros: 0,
+        hash_micros: 0,
+        compress_micros: 0,
+        start_micros: Timer::micros(),
         step1: 0,
         step2: 0,
         step3: 0,
@@ -123,103 +230,245 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
         step5: 0,
         tsize: 0,
         tcsize: 0,
+        uploaded: 0,
     }));
     ui::update_content(draw);
 
     let (tx1, rx1) = thingbuf::mpsc::channel(channel_size);
-    let (tx2, rx2) = thingbuf::mpsc::channel(channel_size);
-    let (tx3, rx3) = thingbuf::mpsc::channel(channel_size);
-    let (tx4, rx4) = thingbuf::mpsc::channel(channel_size);
+    // The other channels contain batches of chunks.
+    let batch_channel_size = (channel_size / MAX_BATCH_CHUNKS).max(4);
+    let (tx2, rx2) = thingbuf::mpsc::channel(batch_channel_size);
+    let (tx3, rx3) = thingbuf::mpsc::channel(batch_channel_size);
+    let (tx4, rx4) = thingbuf::mpsc::channel(batch_channel_size);
 
-    let task1 = async {
-        let tx1 = tx1;
-        for chunk_info in chunks {
-            let mut data = vec![0; chunk_info.size];
-            disk.read(chunk_info.start as u64, &mut data).await?;
-            let cdata = compress(&data);
-            let hash = blake3::hash(&data).into();
+    // Chunks are hashed on the APs while the BSP compresses them and reads the next ones; this
+    // is the maximum number of chunks being processed at the same time.
+    let max_pending = mp::num_workers() + 1;
+
+    // The disks are read concurrently, each keeping its chunks in order.
+    let read_disk = async |index: usize,
+                           disk: &disk::Disk,
+                           ranges: &[ChunkInfo],
+                           tx1: Sender<(usize, Chunk, Vec<u8>)>| {
+        let mut buf = Vec::new();
+        let mut pending = VecDeque::<PendingChunk>::with_capacity(max_pending);
+        // Sends the first chunk of `pending` once it is hashed, keeping chunks in disk order.
+        let send_first = async |pending: &mut VecDeque<PendingChunk>| {
+            let Some((start, size, cdata, job)) = pending.pop_front() else {
+                return;
+            };
+            let (hash, _data, micros) = job.await;
             let chunk = Chunk {
-                hash,
-                start: chunk_info.start,
-                size: chunk_info.size,
+                hash: hash.into(),
+                start,
+                size,
                 csize: cdata.len(),
+                codec: Codec::Lz4,
             };
-            stats.borrow_mut().as_pushing_chunks_mut().step1 += 1;
+            {
+                let mut stats = stats.borrow_mut();
+                let stats = stats.as_pushing_chunks_mut();
+                stats.step1 += 1;
+                stats.processed += size;
+                stats.hash_micros += micros;
+            }
             ui::update_content(draw);
-            tx1.send((chunk, cdata)).await.expect("receiver dropped");
+            tx1.send((index, chunk, cdata))
+                .await
+                .expect("receiver dropped");
+        };
+        for range in ranges {
+            let end = range.start + range.size;
+            let mut start = range.start;
+            // `buf[pos..]` contains the data of the disk starting at `start`.
+            buf.clear();
+            let mut pos = 0;
+            while start < end {
+                let (want, block) = match chunking {
+                    Chunking::Fixed => (MAX_CHUNK_SIZE, MAX_CHUNK_SIZE),
+                    Chunking::Cdc { max, .. } => (max, CDC_READ_CHUNKS * max),
+                };
+                let want = want.min(end - start);
+                if buf.len() - pos < want {
+                    // The data not cut yet is moved to the front once per block read, rather than
+                    // after every chunk.
+                    buf.drain(..pos);
+                    pos = 0;
+                    let old_len = buf.len();
+                    let new_len = block.min(end - start);
+                    buf.resize(new_len, 0);
+                    let begin = Timer::micros();
+                    disk.read((start + old_len) as u64, &mut buf[old_len..])
+                        .await?;
+                    let mut stats = stats.borrow_mut();
+                    let stats = stats.as_pushing_chunks_mut();
+                    stats.read += new_len - old_len;
+                    stats.read_micros += (Timer::micros() - begin) as u64;
+                }
+
+                let size = chunking.cut(start, &buf[pos..pos + want]);
+                let data = Arc::new(buf[pos..pos + size].to_vec());
+                pos += size;
+                let job = {
+                    let data = data.clone();
+                    // SAFETY: hashing does not allocate; `data` is given back to be dropped here.
+                    unsafe {
+                        mp::spawn(move || {
+                            let begin = Timer::micros();
+                            let hash = blake3::hash(&data);
+                            (hash, data, (Timer::micros() - begin) as u64)
+                        })
+                    }
+                };
+                let begin = Timer::micros();
+                let cdata = compress(&data);
+                stats.borrow_mut().as_pushing_chunks_mut().compress_micros +=
+                    (Timer::micros() - begin) as u64;
+
+                if pending.len() == max_pending {
+                    send_first(&mut pending).await;
+                }
+                pending.push_back((start, size, cdata, job));
+                start += size;
+            }
+        }
+        while !pending.is_empty() {
+            send_first(&mut pending).await;
         }
         Ok::<_, Error>(())
     };
 
+    let task1 = async {
+        let readers: Vec<_> = disks
+            .iter()
+            .zip(&disks_ranges)
+            .enumerate()
+            .map(|(index, (disk, ranges))| read_disk(index, disk, ranges, tx1.clone()))
+            .collect();
+        // The channel is closed once all the readers are done.
+        drop(tx1);
+        futures::future::try_join_all(readers).await?;
+        Ok::<_, Error>(())
+    };
+
     let task2 = async {
         let tx2 = tx2;
-        while let Some((chunk, cdata)) = rx1.recv().await {
-            let req = TcpRequest::HasChunk(chunk.hash);
-            let buf = postcard::to_allocvec(&req)?;
+        while let Some(first) = rx1.recv().await {
+            // Batch together all the chunks that are ready, to reduce the number of round trips.
+            let mut batch_size = first.2.len();
+            let mut batch = vec![first];
+            while batch.len() < MAX_BATCH_CHUNKS
+                && batch_size < MAX_BATCH_SIZE
+                && let Ok(item) = rx1.try_recv()
+            {
+                batch_size += item.2.len();
+                batch.push(item);
+            }
+            // Chunks with the same content in a batch are checked, and uploaded, only once.
+            let mut hashes: Vec<ChunkHash> = batch.iter().map(|(_, chunk, _)| chunk.hash).collect();
+            hashes.sort_unstable();
+            hashes.dedup();
+            let buf = postcard::to_allocvec(&TcpRequest::HasChunks(hashes.clone()))?;
             stream_get_csize.write_u64_le(buf.len() as u64).await?;
             stream_get_csize.write_all(&buf).await?;
-            stats.borrow_mut().as_pushing_chunks_mut().step2 += 1;
+            stats.borrow_mut().as_pushing_chunks_mut().step2 += batch.len();
             ui::update_content(draw);
-            tx2.send((chunk, cdata)).await.expect("receiver dropped");
+            tx2.send((batch, hashes)).await.expect("receiver dropped");
         }
         Ok(())
     };
 
     let task3 = async {
         let tx3 = tx3;
-        while let Some((chunk, cdata)) = rx2.recv().await {
+        while let Some((batch, hashes)) = rx2.recv().await {
             let len = stream_get_csize.read_u64_le().await?;
             let mut buf = vec![0; len as usize];
             stream_get_csize.read_exact(&mut buf).await?;
-            let has_chunk: bool = postcard::from_bytes(&buf)?;
-            stats.borrow_mut().as_pushing_chunks_mut().step3 += 1;
+            let bitmap: Vec<u8> = postcard::from_bytes(&buf)?;
+            if bitmap.len() != hashes.len().div_ceil(8) {
+                return Err(Error(format!(
+                    "Invalid HasChunks reply: {} bytes for {} chunks",
+                    bitmap.len(),
+                    hashes.len()
+                )));
+            }
+            let batch: Vec<_> = batch
+                .into_iter()
+                .map(|(disk, chunk, cdata)| {
+                    let i = hashes
+                        .binary_search(&chunk.hash)
+                        .expect("hashes has every chunk of the batch");
+                    (disk, chunk, cdata, (bitmap[i / 8] >> (i % 8)) & 1 != 0)
+                })
+                .collect();
+            stats.borrow_mut().as_pushing_chunks_mut().step3 += batch.len();
             ui::update_content(draw);
-            tx3.send((chunk, cdata, has_chunk))
-                .await
-                .expect("receiver dropped");
+            tx3.send(batch).await.expect("receiver dropped");
         }
         Ok(())
     };
 
     let task4 = async {
         let tx4 = tx4;
-        while let Some((chunk, cdata, has_chunk)) = rx3.recv().await {
-            if !has_chunk {
-                let req = TcpRequest::UploadChunk(cdata);
+        while let Some(batch) = rx3.recv().await {
+            let mut chunks = Vec::with_capacity(batch.len());
+            let mut missing = Vec::new();
+            let mut missing_hashes = BTreeSet::new();
+            for (disk, chunk, cdata, has_chunk) in batch {
+                if !has_chunk && missing_hashes.insert(chunk.hash) {
+                    uploaded += cdata.len();
+                    missing.push(cdata);
+                }
+                chunks.push((disk, chunk));
+            }
+            let upload = !missing.is_empty();
+            if upload {
+                stats.borrow_mut().as_pushing_chunks_mut().uploaded = uploaded;
+                let req = TcpRequest::UploadChunks(missing.iter().map(Vec::as_slice).collect());
                 let buf = postcard::to_allocvec(&req)?;
                 stream_upload_chunk.write_u64_le(buf.len() as u64).await?;
                 stream_upload_chunk.write_all(&buf).await?;
             }
-            stats.borrow_mut().as_pushing_chunks_mut().step4 += 1;
+            stats.borrow_mut().as_pushing_chunks_mut().step4 += chunks.len();
             ui::update_content(draw);
-            tx4.send((chunk, has_chunk))
-                .await
-                .expect("receiver dropped");
+            tx4.send((chunks, upload)).await.expect("receiver dropped");
         }
         Ok(())
     };
 
     let task5 = async {
-        let mut chunks = Vec::new();
-        while let Some((chunk, has_chunk)) = rx4.recv().await {
-            if !has_chunk {
+        let mut all_chunks = vec![Vec::new(); disks.len()];
+        while let Some((chunks, upload)) = rx4.recv().await {
+            if upload {
                 let len = stream_upload_chunk.read_u64_le().await?;
                 assert_eq!(len, 0);
             }
-            chunks.push(chunk);
-
-            total_size += chunk.size;
-            total_csize += chunk.csize;
+            let num_chunks = chunks.len();
+            for (disk, chunk) in chunks {
+                total_size += chunk.size;
+                total_csize += chunk.csize;
+                all_chunks[disk].push(chunk);
+            }
 
-            stats.borrow_mut().as_pushing_chunks_mut().step5 += 1;
+            {
+                let mut stats = stats.borrow_mut();
+                let stats = stats.as_pushing_chunks_mut();
+                stats.step5 += num_chunks;
+                stats.tsize = total_size;
+                stats.tcsize = total_csize;
+            }
             ui::update_content(draw);
-            udp.send_to(
-                server_address,
-                &postcard::to_allocvec(&UdpRequest::ActionProgress(chunks.len(), total))?,
-            )
-            .await?;
+            // Progress is reported in MiB, as the number of chunks is not known in advance; both
+            // are rounded up, so that small images do not show 0/0 and the end shows as done.
+            let progress = UdpRequest::ActionProgress(
+                Action::Store,
+                total_size.div_ceil(1 << 20),
+                total.div_ceil(1 << 20),
+            );
+            udp.send_to(server_address, &postcard::to_allocvec(&progress)?)
+                .await?;
         }
-        Ok(chunks)
+        Ok(all_chunks)
     };
 
     let ((), (), (), (), chunk_hashes) = futures::try_join!(task1, task2, task3, task4, task5)?;
@@ -229,7 +478,14 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
         Image {
             boot_option_id: boid,
             boot_entry: bo_command.to_vec(),
-            disk: chunk_hashes,
+            disks: disks
+                .iter()
+                .zip(chunk_hashes)
+                .map(|(disk, chunks)| ImageDisk {
+                    size: disk.size(),
+                    chunks,
+                })
+                .collect(),
         },
     )
     .await?;
@@ -242,9 +498,11 @@ pub async fn store(server_address: SocketAddrV4) -> Result<()> {
     stream_upload_chunk.force_close().await;
 
     log::info!(
-        "image saved. Total size {}, total csize {}",
+        "image saved with {chunking:?} chunking. Total size {}, total csize {}, uploaded {}, dedup ratio {:.2}",
         BytesFmt(total_size as u64),
-        BytesFmt(total_csize as u64)
+        BytesFmt(total_csize as u64),
+        BytesFmt(uploaded as u64),
+        total_csize as f64 / uploaded.max(1) as f64,
     );
 
     Ok(())
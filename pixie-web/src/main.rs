@@ -5,7 +5,10 @@ use gloo_net::http::Request;
 use js_sys::Uint8Array;
 use leptos::*;
 use leptos_use::{use_preferred_dark, use_timestamp};
-use pixie_shared::{Config, ImagesStats, StatusUpdate, Unit, util::BytesFmt};
+use pixie_shared::{
+    ClientMetrics, Config, GcProgress, ImagesStats, ServerStats, StatusUpdate, Unit, UnitMetrics,
+    util::BytesFmt,
+};
 use thaw::{
     Button, ButtonColor, ButtonGroup, ButtonVariant, GlobalStyle, Popover, PopoverPlacement,
     PopoverTrigger, Space, Table, Theme, ThemeProvider,
@@ -22,7 +25,10 @@ fn send_req(url: String) {
 }
 
 #[component]
-fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
+fn Images(
+    #[prop(into)] images: Signal<Option<ImagesStats>>,
+    #[prop(into)] gc_progress: Signal<Option<GcProgress>>,
+) -> impl IntoView {
     let image_row = move |(full_name, image): (String, (u64, u64))| {
         let url_flash = format!("admin/action/{full_name}/flash");
         let url_boot = format!("admin/action/{full_name}/boot");
@@ -34,6 +40,11 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
         let name = it.next().unwrap().to_owned();
         let version = it.next().map(ToOwned::to_owned);
         let has_version = version.is_some();
+        let delta = move || {
+            images
+                .with(|images| images.as_ref()?.deltas.get(&full_name).copied())
+                .map(|delta| BytesFmt(delta).to_string())
+        };
 
         view! {
             <tr>
@@ -41,6 +52,7 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
                 <td>{version}</td>
                 <td>{BytesFmt(image.0).to_string()}</td>
                 <td>{BytesFmt(image.1).to_string()}</td>
+                <td>{delta}</td>
                 <td>
                     <ButtonGroup>
                         {
@@ -93,6 +105,13 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
 
     let reclaimable = move || images.get().as_ref().map(|images| images.reclaimable);
 
+    let gc_running = Signal::derive(move || gc_progress.get().is_some());
+    let gc_status = move || match gc_progress.get() {
+        None => String::new(),
+        Some(GcProgress::Deleting { done, total }) => format!("Deleting chunks {done}/{total}"),
+        Some(GcProgress::Compacting { done, total }) => format!("Compacting {done}/{total}"),
+    };
+
     view! {
         <h1>"Images"</h1>
         <Table>
@@ -101,6 +120,7 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
                 <th>"Version"</th>
                 <th>"Size"</th>
                 <th>"Compressed"</th>
+                <th>"New data"</th>
                 <th></th>
             </tr>
             <For
@@ -114,15 +134,18 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
                 <td></td>
                 <td>{move || BytesFmt(total_csize().unwrap_or_default()).to_string()}</td>
                 <td></td>
+                <td></td>
             </tr>
             <tr>
                 <td>"Reclaimable"</td>
                 <td></td>
-                <td></td>
+                <td>{gc_status}</td>
                 <td>{move || BytesFmt(reclaimable().unwrap_or_default()).to_string()}</td>
+                <td></td>
                 <td>
                     <Button
                         color=ButtonColor::Primary
+                        loading=gc_running
                         on_click=move |_| send_req("admin/gc".into())
                     >
                         "Reclaim disk space"
@@ -133,17 +156,66 @@ fn Images(#[prop(into)] images: Signal<Option<ImagesStats>>) -> impl IntoView {
     }
 }
 
+/// Short summary of the metrics of a unit.
+fn fmt_metrics(metrics: &ClientMetrics) -> String {
+    let busy: u64 = metrics.tasks.iter().map(|task| task.busy_micros).sum();
+    let uptime = metrics.uptime_micros.max(1);
+    format!(
+        "busy {:.1}%, disk {} read {} written, net {} in {} out, {}/{} packets lost",
+        busy as f64 * 100.0 / uptime as f64,
+        BytesFmt(metrics.disk_read),
+        BytesFmt(metrics.disk_written),
+        BytesFmt(metrics.net_rx),
+        BytesFmt(metrics.net_tx),
+        metrics.packets_lost,
+        metrics.packets_received + metrics.packets_lost,
+    )
+}
+
+/// Per-task details of the metrics of a unit.
+fn fmt_task_metrics(metrics: &ClientMetrics) -> String {
+    let mut text = format!("{} timers pending.", metrics.timers);
+    for task in &metrics.tasks {
+        let avg_latency = task.wake_latency_micros / task.polls.max(1);
+        text += &format!(
+            " {}: {} polls, {:.3}s busy, wake latency {avg_latency}us avg {}us max.",
+            task.name,
+            task.polls,
+            task.busy_micros as f64 * 0.000_001,
+            task.max_wake_latency_micros,
+        );
+    }
+    text
+}
+
 #[component]
 fn Group(
     #[prop(into)] units: Signal<Vec<Unit>>,
     #[prop(into)] group_name: Signal<String>,
     images: Signal<Vec<String>>,
     hostmap: Signal<HashMap<Ipv4Addr, String>>,
+    unit_metrics: Signal<Vec<UnitMetrics>>,
     #[prop(into)] time: Signal<i64>,
 ) -> impl IntoView {
     let render_unit = move |idx: usize| {
         let unit = create_memo(move |_| units.get()[idx].clone());
         let ping_ago = move || time.get() - unit.get().last_ping_timestamp as i64;
+        let metrics = create_memo(move |_| {
+            let mac = unit.get().mac;
+            unit_metrics
+                .get()
+                .into_iter()
+                .find(|m| m.mac == mac)
+                .map(|m| m.metrics)
+        });
+        let fmt_metrics = move || metrics.get().as_ref().map(fmt_metrics).unwrap_or_default();
+        let fmt_task_metrics = move || {
+            metrics
+                .get()
+                .as_ref()
+                .map(fmt_task_metrics)
+                .unwrap_or_default()
+        };
 
         let mac = move || unit.get().mac.to_string();
         let url_flash = move || format!("admin/action/{}/flash", mac());
@@ -230,6 +302,14 @@ fn Group(
                     </ButtonGroup>
                 </td>
                 <td class="expand">{fmt_ca}</td>
+                <td>
+                    <Popover tooltip=true placement=PopoverPlacement::Left>
+                        <PopoverTrigger slot>
+                            {fmt_metrics}
+                        </PopoverTrigger>
+                        {fmt_task_metrics}
+                    </Popover>
+                </td>
                 <td>
                     <Button color=ButtonColor::Error on_click=move |_| send_req(url_forget())>
                     "forget"
@@ -283,6 +363,7 @@ fn Group(
                     <th>"next action"</th>
                     <th>"change action"</th>
                     <th>"current action"</th>
+                    <th>"metrics"</th>
                     <th></th>
                 </tr>
                 <For each=move || 0..units.get().len() key=|x| *x children=render_unit/>
@@ -312,6 +393,66 @@ fn Disconnect(connected: ReadSignal<bool>) -> impl IntoView {
     }
 }
 
+#[component]
+fn Broadcast(
+    #[prop(into)] config: Signal<Option<Config>>,
+    #[prop(into)] stats: Signal<Option<ServerStats>>,
+) -> impl IntoView {
+    let rows = move || -> Vec<_> {
+        let interfaces = config
+            .get()
+            .map(|config| config.hosts.interfaces)
+            .unwrap_or_default();
+        let broadcast = stats.get().map(|stats| stats.broadcast).unwrap_or_default();
+        interfaces
+            .into_iter()
+            .zip(broadcast)
+            .map(|(iface, stats)| {
+                view! {
+                    <tr>
+                        <td>{iface.network.to_string()}</td>
+                        <td>{stats.packets_per_sec}</td>
+                        <td>{format!("{}/s", BytesFmt(stats.bytes_per_sec))}</td>
+                        <td>{format!("{}/s", BytesFmt(stats.rate / 8))}</td>
+                        <td>{stats.queued}</td>
+                        <td>{stats.demand}</td>
+                    </tr>
+                }
+            })
+            .collect()
+    };
+
+    let cache = move || {
+        let cache = stats
+            .get()
+            .map(|stats| stats.chunk_cache)
+            .unwrap_or_default();
+        format!(
+            "Chunk cache: {} hits, {} misses, {} in {} chunks",
+            cache.hits,
+            cache.misses,
+            BytesFmt(cache.size),
+            cache.chunks
+        )
+    };
+
+    view! {
+        <h1>"Broadcast"</h1>
+        <Table>
+            <tr>
+                <th>"Network"</th>
+                <th>"Packets/s"</th>
+                <th>"Throughput"</th>
+                <th>"Rate limit"</th>
+                <th>"Queued chunks"</th>
+                <th>"Pending requests"</th>
+            </tr>
+            {rows}
+        </Table>
+        <p>{cache}</p>
+    }
+}
+
 #[component]
 fn App() -> impl IntoView {
     let (connected, set_connected) = create_signal(true);
@@ -320,6 +461,9 @@ fn App() -> impl IntoView {
     let (hostmap, set_hostname) = create_signal(None::<HashMap<Ipv4Addr, String>>);
     let (units, set_units) = create_signal(None::<Vec<Unit>>);
     let (image_stats, set_image_stats) = create_signal(None::<ImagesStats>);
+    let (server_stats, set_server_stats) = create_signal(None::<ServerStats>);
+    let (unit_metrics, set_unit_metrics) = create_signal(Vec::<UnitMetrics>::new());
+    let (gc_progress, set_gc_progress) = create_signal(None::<GcProgress>);
 
     let images = Signal::derive(move || {
         config
@@ -328,14 +472,41 @@ fn App() -> impl IntoView {
             .unwrap_or_else(Vec::new)
     });
 
-    let handle_message = move |msg| match msg {
+    // Version of the last units update, to detect lost deltas.
+    let mut units_version = 0;
+    let mut handle_message = move |msg| match msg {
         StatusUpdate::Units(mut u) => {
             u.sort_by_key(|x| x.static_ip());
             set_units.set(Some(u));
+            units_version = 0;
+        }
+        StatusUpdate::UnitsDelta {
+            version,
+            changed,
+            removed,
+        } => {
+            if version != units_version + 1 {
+                log::warn!("Units update {version} follows {units_version}");
+            }
+            units_version = version;
+            set_units.update(|units| {
+                let units = units.get_or_insert_with(Vec::new);
+                units.retain(|unit| !removed.contains(&unit.mac));
+                for unit in changed {
+                    match units.iter_mut().find(|u| u.mac == unit.mac) {
+                        Some(old) => *old = unit,
+                        None => units.push(unit),
+                    }
+                }
+                units.sort_by_key(|x| x.static_ip());
+            });
         }
         StatusUpdate::Config(c) => set_config.set(Some(c)),
         StatusUpdate::HostMap(h) => set_hostname.set(Some(h)),
         StatusUpdate::ImagesStats(i) => set_image_stats.set(Some(i)),
+        StatusUpdate::ServerStats(s) => set_server_stats.set(Some(s)),
+        StatusUpdate::UnitMetrics(m) => set_unit_metrics.set(m),
+        StatusUpdate::GcProgress(p) => set_gc_progress.set(p),
     };
 
     spawn_local(async move {
@@ -393,7 +564,9 @@ fn App() -> impl IntoView {
                 .collect()
         });
         let hostmap = Signal::derive(move || hostmap.get().unwrap_or_else(HashMap::new));
-        view! { <Group units group_name images hostmap time=time_in_seconds/> }.into_view()
+        let unit_metrics = Signal::derive(move || unit_metrics.get());
+        view! { <Group units group_name images hostmap unit_metrics time=time_in_seconds/> }
+            .into_view()
     };
 
     let render_group_grid = move |id: u8| {
@@ -468,7 +641,8 @@ fn App() -> impl IntoView {
     };
 
     view! {
-        <Images images=image_stats/>
+        <Images images=image_stats gc_progress/>
+        <Broadcast config stats=server_stats/>
         <h1>Ping Summary</h1>
         <Space vertical=false>
             <For
@@ -43,7 +43,7 @@ pushd pixie-server
 cargo build $RELEASE_FLAG
 popd
 
-mkdir -p "${STORAGE_DIR}/tftpboot" "${STORAGE_DIR}/images" "${STORAGE_DIR}/chunks" "${STORAGE_DIR}/admin"
+mkdir -p "${STORAGE_DIR}/tftpboot" "${STORAGE_DIR}/images" "${STORAGE_DIR}/packs" "${STORAGE_DIR}/admin"
 cp "pixie-uefi/target/x86_64-unknown-uefi/${TARGET_DIR}/pixie-uefi.efi" "${STORAGE_DIR}/tftpboot/"
 cp -r pixie-web/dist/* "${STORAGE_DIR}/admin/"
 